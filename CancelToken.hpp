@@ -0,0 +1,26 @@
+#ifndef H_CancelToken
+#define H_CancelToken
+//----------------------------------------------------------------------------
+#include <atomic>
+#include <memory>
+//----------------------------------------------------------------------------
+/// A cancellation flag shared between the owner of a job and all copies handed to the job
+class CancelToken
+{
+   private:
+   /// The flag
+   std::shared_ptr<std::atomic<bool>> flag;
+
+   public:
+   /// Constructor
+   CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+   /// Request cancellation
+   void cancel() const { flag->store(true,std::memory_order_release); }
+   /// Was cancellation requested?
+   bool isCancelled() const { return flag->load(std::memory_order_acquire); }
+   /// The raw flag, for callbacks that only pass a pointer
+   const std::atomic<bool>* get() const { return flag.get(); }
+};
+//----------------------------------------------------------------------------
+#endif
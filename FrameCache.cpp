@@ -0,0 +1,173 @@
+#include "FrameCache.hpp"
+#include "PageCache.hpp"
+#include "PageCodec.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+FrameCache::FrameCache()
+   : cache(0),capacity(0),devicePixelRatio(1.0),done(true)
+   // Constructor
+{
+}
+//----------------------------------------------------------------------------
+FrameCache::~FrameCache()
+   // Destructor
+{
+   stop();
+}
+//----------------------------------------------------------------------------
+void FrameCache::start(const PageCache& cache,unsigned capacity,double devicePixelRatio)
+   // Start decoding pages from a cache
+{
+   stop();
+
+   this->cache=&cache;
+   this->capacity=capacity;
+   this->devicePixelRatio=devicePixelRatio;
+   done=false;
+   prefetcher=thread(&FrameCache::prefetch,this);
+}
+//----------------------------------------------------------------------------
+void FrameCache::stop()
+   // Stop decoding and drop all frames
+{
+   {
+      unique_lock<mutex> guard(lock);
+      done=true;
+      requests.clear();
+   }
+   changed.notify_all();
+   if (prefetcher.joinable())
+      prefetcher.join();
+
+   unique_lock<mutex> guard(lock);
+   frames.clear();
+   wanted.clear();
+   cache=0;
+}
+//----------------------------------------------------------------------------
+FrameCache::Frame* FrameCache::lookup(unsigned page)
+   // Find a frame and mark it as recently used
+{
+   for (auto iter=frames.begin(),limit=frames.end();iter!=limit;++iter)
+      if (iter->page==page) {
+         frames.splice(frames.begin(),frames,iter);
+         return &(frames.front());
+      }
+   return nullptr;
+}
+//----------------------------------------------------------------------------
+void FrameCache::insert(unsigned page,const QImage& image)
+   // Remember a decoded frame
+{
+   if (Frame* frame=lookup(page)) {
+      frame->image=image;
+      return;
+   }
+   frames.push_front(Frame{page,image});
+   while (frames.size()>capacity)
+      frames.pop_back();
+}
+//----------------------------------------------------------------------------
+QImage FrameCache::decode(unsigned page)
+   // Decode a page
+{
+   Trace::Span span("decode page");
+   uint64_t len;
+   const unsigned char* data=cache->compressedData(page,len);
+   QImage image;
+   if ((!data)||(!PageCodec::decompress(data,len,image)))
+      return QImage();
+   image.setDevicePixelRatio(devicePixelRatio);
+   return image;
+}
+//----------------------------------------------------------------------------
+QImage FrameCache::get(unsigned page)
+   // Get a page, decoding it if needed
+{
+   unique_lock<mutex> guard(lock);
+   while (true) {
+      if (!cache)
+         return QImage();
+      if (Frame* frame=lookup(page))
+         return frame->image;
+      // Wait if the page is decoded in the background right now
+      if (find(decoding.begin(),decoding.end(),page)==decoding.end())
+         break;
+      changed.wait(guard);
+   }
+   if (!cache->isValid(page))
+      return QImage();
+
+   // Decode it ourselves
+   decoding.push_back(page);
+   guard.unlock();
+   QImage image=decode(page);
+   guard.lock();
+   decoding.erase(find(decoding.begin(),decoding.end(),page));
+   if (!image.isNull())
+      insert(page,image);
+   changed.notify_all();
+   return image;
+}
+//----------------------------------------------------------------------------
+void FrameCache::request(const vector<unsigned>& pages)
+   // Decode pages in the background
+{
+   {
+      unique_lock<mutex> guard(lock);
+      requests=pages;
+      wanted=pages;
+   }
+   changed.notify_all();
+}
+//----------------------------------------------------------------------------
+void FrameCache::offer(unsigned page,const QImage& image)
+   // Offer a freshly rendered page
+{
+   unique_lock<mutex> guard(lock);
+   if (find(wanted.begin(),wanted.end(),page)!=wanted.end())
+      insert(page,image);
+}
+//----------------------------------------------------------------------------
+void FrameCache::invalidate(unsigned page)
+   // Forget a page that is re-rendered
+{
+   unique_lock<mutex> guard(lock);
+   for (auto iter=frames.begin(),limit=frames.end();iter!=limit;++iter)
+      if (iter->page==page) {
+         frames.erase(iter);
+         break;
+      }
+}
+//----------------------------------------------------------------------------
+void FrameCache::prefetch()
+   // The prefetch loop
+{
+   unique_lock<mutex> guard(lock);
+   while (true) {
+      while ((!done)&&(requests.empty()))
+         changed.wait(guard);
+      if (done)
+         return;
+
+      // Take the most important request
+      unsigned page=requests.front();
+      requests.erase(requests.begin());
+      if (lookup(page)||(find(decoding.begin(),decoding.end(),page)!=decoding.end())||(!cache->isValid(page)))
+         continue;
+
+      // And decode it
+      decoding.push_back(page);
+      guard.unlock();
+      QImage image=decode(page);
+      guard.lock();
+      decoding.erase(find(decoding.begin(),decoding.end(),page));
+      if (!image.isNull())
+         insert(page,image);
+      changed.notify_all();
+   }
+}
+//----------------------------------------------------------------------------
@@ -0,0 +1,81 @@
+#ifndef H_FrameCache
+#define H_FrameCache
+//----------------------------------------------------------------------------
+#include <QImage>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+//----------------------------------------------------------------------------
+class PageCache;
+//----------------------------------------------------------------------------
+/// A small set of decompressed pages. Decodes pages ahead of navigation in a background thread
+class FrameCache
+{
+   private:
+   /// A decoded page
+   struct Frame {
+      /// The page
+      unsigned page;
+      /// The image
+      QImage image;
+   };
+
+   /// The compressed pages
+   const PageCache* cache;
+   /// The maximum number of frames
+   unsigned capacity;
+   /// The device pixel ratio of the decoded pages
+   double devicePixelRatio;
+   /// The lock
+   std::mutex lock;
+   /// Signals new requests and finished frames
+   std::condition_variable changed;
+   /// The frames, most recently used first
+   std::list<Frame> frames;
+   /// Pages that should be decoded
+   std::vector<unsigned> requests;
+   /// The most recently requested pages
+   std::vector<unsigned> wanted;
+   /// Pages that are decoded right now
+   std::vector<unsigned> decoding;
+   /// The prefetch thread
+   std::thread prefetcher;
+   /// Stop the prefetch thread?
+   bool done;
+
+   /// Find a frame and mark it as recently used. Requires the lock
+   Frame* lookup(unsigned page);
+   /// Remember a decoded frame. Requires the lock
+   void insert(unsigned page,const QImage& image);
+   /// Decode a page
+   QImage decode(unsigned page);
+   /// The prefetch loop
+   void prefetch();
+
+   FrameCache(const FrameCache&);
+   void operator=(const FrameCache&);
+
+   public:
+   /// Constructor
+   FrameCache();
+   /// Destructor
+   ~FrameCache();
+
+   /// Start decoding pages from a cache
+   void start(const PageCache& cache,unsigned capacity,double devicePixelRatio);
+   /// Stop decoding and drop all frames
+   void stop();
+
+   /// Get a page, decoding it if needed. Returns a null image if the page is not available
+   QImage get(unsigned page);
+   /// Decode pages in the background, most important first
+   void request(const std::vector<unsigned>& pages);
+   /// Offer a freshly rendered page. Only kept if it was requested recently
+   void offer(unsigned page,const QImage& image);
+   /// Forget a page that is re-rendered
+   void invalidate(unsigned page);
+};
+//----------------------------------------------------------------------------
+#endif
@@ -0,0 +1,296 @@
+#include "ImageKernels.hpp"
+#include <QImage>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+//----------------------------------------------------------------------------
+// All kernels work on rows of 32 bit pixels. RGB32 is ARGB32 with the alpha
+// channel forced to 0xFF, which means that the conversion from the 32 bit
+// formats Poppler renders to is a simple mask that can be applied in place.
+// Content hashes mix pixel x of a row into lane x%8 of eight 32 bit lanes,
+// which maps directly to vector registers. The vectorized kernels produce
+// exactly the same results as the scalar ones, selfTest checks that.
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+/// The alpha channel of an opaque pixel
+static const uint32_t opaque = 0xFF000000u;
+/// The mask for halving all channels of a pixel
+static const uint32_t halfMask = 0x7F7F7F7Fu;
+/// The number of hash lanes
+static const unsigned hashLanes = 8;
+/// The constant added to a hash lane for every pixel
+static const uint32_t hashIncrement = 0x9E3779B9u;
+//----------------------------------------------------------------------------
+namespace {
+//----------------------------------------------------------------------------
+/// A set of row kernels
+struct Kernels {
+   /// The name
+   const char* name;
+   /// Convert a row to RGB32
+   void (*convertRow)(const uint32_t* source,uint32_t* target,unsigned width);
+   /// Halve the brightness of a row
+   void (*dimRow)(const uint32_t* source,uint32_t* target,unsigned width);
+   /// Mix a row into the hash lanes
+   void (*hashRow)(const uint32_t* source,unsigned width,uint32_t* lanes);
+};
+//----------------------------------------------------------------------------
+}
+//----------------------------------------------------------------------------
+static void convertRowScalar(const uint32_t* source,uint32_t* target,unsigned width)
+   // Convert a row to RGB32
+{
+   for (unsigned x=0;x<width;x++)
+      target[x]=source[x]|opaque;
+}
+//----------------------------------------------------------------------------
+static void dimRowScalar(const uint32_t* source,uint32_t* target,unsigned width)
+   // Halve the brightness of a row
+{
+   for (unsigned x=0;x<width;x++)
+      target[x]=((source[x]>>1)&halfMask)|opaque;
+}
+//----------------------------------------------------------------------------
+static void hashRowScalar(const uint32_t* source,unsigned width,uint32_t* lanes)
+   // Mix a row into the hash lanes
+{
+   for (unsigned x=0;x<width;x++) {
+      uint32_t h=lanes[x%hashLanes]^source[x];
+      lanes[x%hashLanes]=((h<<13)|(h>>19))+hashIncrement;
+   }
+}
+//----------------------------------------------------------------------------
+#ifdef KERNELS_X86
+//----------------------------------------------------------------------------
+__attribute__((target("sse2"))) static void convertRowSSE2(const uint32_t* source,uint32_t* target,unsigned width)
+   // Convert a row to RGB32
+{
+   const __m128i alpha=_mm_set1_epi32(opaque);
+   unsigned x=0;
+   for (;x+4<=width;x+=4)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target+x),_mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source+x)),alpha));
+   convertRowScalar(source+x,target+x,width-x);
+}
+//----------------------------------------------------------------------------
+__attribute__((target("sse2"))) static void dimRowSSE2(const uint32_t* source,uint32_t* target,unsigned width)
+   // Halve the brightness of a row
+{
+   const __m128i alpha=_mm_set1_epi32(opaque),mask=_mm_set1_epi32(halfMask);
+   unsigned x=0;
+   for (;x+4<=width;x+=4) {
+      __m128i p=_mm_loadu_si128(reinterpret_cast<const __m128i*>(source+x));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target+x),_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p,1),mask),alpha));
+   }
+   dimRowScalar(source+x,target+x,width-x);
+}
+//----------------------------------------------------------------------------
+__attribute__((target("sse2"))) static void hashRowSSE2(const uint32_t* source,unsigned width,uint32_t* lanes)
+   // Mix a row into the hash lanes
+{
+   const __m128i increment=_mm_set1_epi32(hashIncrement);
+   __m128i lo=_mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes)),hi=_mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes+4));
+   unsigned x=0;
+   for (;x+8<=width;x+=8) {
+      __m128i a=_mm_xor_si128(lo,_mm_loadu_si128(reinterpret_cast<const __m128i*>(source+x)));
+      __m128i b=_mm_xor_si128(hi,_mm_loadu_si128(reinterpret_cast<const __m128i*>(source+x+4)));
+      lo=_mm_add_epi32(_mm_or_si128(_mm_slli_epi32(a,13),_mm_srli_epi32(a,19)),increment);
+      hi=_mm_add_epi32(_mm_or_si128(_mm_slli_epi32(b,13),_mm_srli_epi32(b,19)),increment);
+   }
+   _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes),lo);
+   _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes+4),hi);
+   hashRowScalar(source+x,width-x,lanes);
+}
+//----------------------------------------------------------------------------
+__attribute__((target("avx2"))) static void convertRowAVX2(const uint32_t* source,uint32_t* target,unsigned width)
+   // Convert a row to RGB32
+{
+   const __m256i alpha=_mm256_set1_epi32(opaque);
+   unsigned x=0;
+   for (;x+8<=width;x+=8)
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(target+x),_mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source+x)),alpha));
+   convertRowScalar(source+x,target+x,width-x);
+}
+//----------------------------------------------------------------------------
+__attribute__((target("avx2"))) static void dimRowAVX2(const uint32_t* source,uint32_t* target,unsigned width)
+   // Halve the brightness of a row
+{
+   const __m256i alpha=_mm256_set1_epi32(opaque),mask=_mm256_set1_epi32(halfMask);
+   unsigned x=0;
+   for (;x+8<=width;x+=8) {
+      __m256i p=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source+x));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(target+x),_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p,1),mask),alpha));
+   }
+   dimRowScalar(source+x,target+x,width-x);
+}
+//----------------------------------------------------------------------------
+__attribute__((target("avx2"))) static void hashRowAVX2(const uint32_t* source,unsigned width,uint32_t* lanes)
+   // Mix a row into the hash lanes
+{
+   const __m256i increment=_mm256_set1_epi32(hashIncrement);
+   __m256i h=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+   unsigned x=0;
+   for (;x+8<=width;x+=8) {
+      __m256i a=_mm256_xor_si256(h,_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source+x)));
+      h=_mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(a,13),_mm256_srli_epi32(a,19)),increment);
+   }
+   _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes),h);
+   hashRowScalar(source+x,width-x,lanes);
+}
+//----------------------------------------------------------------------------
+#endif
+//----------------------------------------------------------------------------
+static vector<Kernels> supportedKernels()
+   // All kernels the CPU supports, the scalar ones first
+{
+   vector<Kernels> result{Kernels{"scalar",convertRowScalar,dimRowScalar,hashRowScalar}};
+#ifdef KERNELS_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse2"))
+      result.push_back(Kernels{"sse2",convertRowSSE2,dimRowSSE2,hashRowSSE2});
+   if (__builtin_cpu_supports("avx2"))
+      result.push_back(Kernels{"avx2",convertRowAVX2,dimRowAVX2,hashRowAVX2});
+#endif
+   return result;
+}
+//----------------------------------------------------------------------------
+static Kernels selectKernels()
+   // Pick the best kernels for the CPU
+{
+#ifdef KERNELS_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      return Kernels{"avx2",convertRowAVX2,dimRowAVX2,hashRowAVX2};
+   if (__builtin_cpu_supports("sse2"))
+      return Kernels{"sse2",convertRowSSE2,dimRowSSE2,hashRowSSE2};
+#endif
+   return Kernels{"scalar",convertRowScalar,dimRowScalar,hashRowScalar};
+}
+//----------------------------------------------------------------------------
+static const Kernels& kernels()
+   // The kernels for this CPU
+{
+   static const Kernels selected=selectKernels();
+   return selected;
+}
+//----------------------------------------------------------------------------
+static bool makeAccessible(QImage& image)
+   // Make sure the image consists of 32 bit pixels. Returns true if the alpha channel must be masked
+{
+   switch (image.format()) {
+      case QImage::Format_RGB32: return false;
+      case QImage::Format_ARGB32: case QImage::Format_ARGB32_Premultiplied: return true;
+      default: image=image.convertToFormat(QImage::Format_RGB32); return false;
+   }
+}
+//----------------------------------------------------------------------------
+void ImageKernels::toRGB32(QImage& image)
+   // Convert a rendered page to RGB32 in place
+{
+   if (!makeAccessible(image))
+      return;
+
+   const Kernels& k=kernels();
+   unsigned char* bits=image.bits();
+   unsigned bytesPerLine=image.bytesPerLine(),width=image.width(),height=image.height();
+   for (unsigned row=0;row<height;row++) {
+      uint32_t* pixels=reinterpret_cast<uint32_t*>(bits+static_cast<size_t>(row)*bytesPerLine);
+      k.convertRow(pixels,pixels,width);
+   }
+   image.reinterpretAsFormat(QImage::Format_RGB32);
+}
+//----------------------------------------------------------------------------
+void ImageKernels::dim(const uint32_t* source,uint32_t* target,unsigned count)
+   // Halve the brightness of RGB32 pixels
+{
+   kernels().dimRow(source,target,count);
+}
+//----------------------------------------------------------------------------
+uint64_t ImageKernels::hash(const QImage& image)
+   // Hash the pixels of an RGB32 image
+{
+   const Kernels& k=kernels();
+   uint32_t lanes[hashLanes];
+   for (unsigned lane=0;lane<hashLanes;lane++)
+      lanes[lane]=lane*hashIncrement;
+   const unsigned char* bits=image.constBits();
+   unsigned bytesPerLine=image.bytesPerLine(),width=image.width(),height=image.height();
+   for (unsigned row=0;row<height;row++)
+      k.hashRow(reinterpret_cast<const uint32_t*>(bits+static_cast<size_t>(row)*bytesPerLine),width,lanes);
+
+   // Combine the lanes and the size with FNV-1a
+   uint64_t result=14695981039346656037ull;
+   for (uint32_t v:{width,height})
+      result=(result^v)*1099511628211ull;
+   for (uint32_t v:lanes)
+      result=(result^v)*1099511628211ull;
+   return result;
+}
+//----------------------------------------------------------------------------
+const char* ImageKernels::implementation()
+   // The name of the selected kernel implementation
+{
+   return kernels().name;
+}
+//----------------------------------------------------------------------------
+bool ImageKernels::selfTest()
+   // Check every implementation against the scalar kernels
+{
+   // Odd widths cover every tail length of the vector loops, the misaligned starts the unaligned loads
+   vector<unsigned> widths;
+   for (unsigned width=0;width<=67;width++)
+      widths.push_back(width);
+   for (unsigned width:{255u,1023u,1921u,4097u})
+      widths.push_back(width);
+   const unsigned maxShift=7;
+
+   mt19937 random(4711);
+   vector<Kernels> all=supportedKernels();
+   const Kernels& scalar=all.front();
+   bool ok=true;
+   for (unsigned index=1;index<all.size();index++) {
+      const Kernels& k=all[index];
+      unsigned failures=0;
+      for (unsigned width:widths)
+         for (unsigned shift=0;shift<=maxShift;shift++) {
+            vector<uint32_t> source(width+maxShift),expected(width+maxShift),actual(width+maxShift);
+            for (auto& p:source)
+               p=random();
+            const uint32_t* row=source.data()+shift;
+
+            // Conversion, out of place and in place
+            scalar.convertRow(row,expected.data(),width);
+            k.convertRow(row,actual.data(),width);
+            bool convertOk=equal(expected.begin(),expected.begin()+width,actual.begin());
+            actual.assign(row,row+width);
+            k.convertRow(actual.data(),actual.data(),width);
+            convertOk&=equal(expected.begin(),expected.begin()+width,actual.begin());
+
+            // Dimming
+            scalar.dimRow(row,expected.data(),width);
+            k.dimRow(row,actual.data(),width);
+            bool dimOk=equal(expected.begin(),expected.begin()+width,actual.begin());
+
+            // Hashing, starting from arbitrary lanes
+            uint32_t expectedLanes[hashLanes],actualLanes[hashLanes];
+            for (unsigned lane=0;lane<hashLanes;lane++)
+               expectedLanes[lane]=actualLanes[lane]=random();
+            scalar.hashRow(row,width,expectedLanes);
+            k.hashRow(row,width,actualLanes);
+            bool hashOk=equal(expectedLanes,expectedLanes+hashLanes,actualLanes);
+
+            for (auto& check:{make_pair("convert",convertOk),make_pair("dim",dimOk),make_pair("hash",hashOk)})
+               if ((!check.second)&&((++failures)<=10))
+                  cerr << k.name << " " << check.first << " differs from scalar for width " << width << ", offset " << shift << endl;
+         }
+      cerr << k.name << ": " << (failures?"FAILED":"ok") << endl;
+      ok&=!failures;
+   }
+   return ok;
+}
+//----------------------------------------------------------------------------
@@ -0,0 +1,25 @@
+#ifndef H_ImageKernels
+#define H_ImageKernels
+//----------------------------------------------------------------------------
+#include <cstdint>
+//----------------------------------------------------------------------------
+class QImage;
+//----------------------------------------------------------------------------
+/// Vectorized pixel kernels for rendered pages. Uses AVX2 or SSE2 if the CPU supports it
+class ImageKernels
+{
+   public:
+   /// Convert a rendered page to RGB32 in place
+   static void toRGB32(QImage& image);
+   /// Halve the brightness of RGB32 pixels
+   static void dim(const uint32_t* source,uint32_t* target,unsigned count);
+   /// Hash the pixels of an RGB32 image, ignoring the padding of the rows. Identical images have the same hash, the converse must be checked
+   static uint64_t hash(const QImage& image);
+
+   /// The name of the selected kernel implementation
+   static const char* implementation();
+   /// Check that every implementation the CPU supports produces exactly the results of the scalar kernels. Reports mismatches on stderr
+   static bool selfTest();
+};
+//----------------------------------------------------------------------------
+#endif
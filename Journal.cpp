@@ -0,0 +1,516 @@
+#include "Journal.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+/// The magic number of journal files
+static const char magic[8] = {'P','P','D','F','N','O','T','E'};
+/// The journal file format version
+static const uint32_t version = 2;
+/// The oldest version that can still be read. It is rewritten in the current format
+static const uint32_t oldestVersion = 1;
+/// The size of a page fingerprint
+static const unsigned fingerprintSize = 20;
+//----------------------------------------------------------------------------
+/// The file header
+struct FileHeader {
+   /// The magic number
+   char magic[8];
+   /// The format version
+   uint32_t version;
+   /// Padding
+   uint32_t reserved;
+};
+//----------------------------------------------------------------------------
+/// The header of a record. Followed by the payload, padded to 4 bytes
+struct Journal::Record {
+   /// The length including the header
+   uint32_t length;
+   /// The checksum of everything after this field
+   uint32_t checksum;
+   /// The page
+   uint32_t page;
+   /// The type
+   uint16_t type;
+   /// The width of the scribble coordinate space when recording, 0 if unknown
+   uint16_t reference;
+};
+//----------------------------------------------------------------------------
+static uint32_t checksum(const unsigned char* data,uint64_t len)
+   // Compute the FNV-1a hash of a record
+{
+   uint32_t result=2166136261u;
+   for (uint64_t index=0;index<len;index++)
+      result=(result^data[index])*16777619u;
+   return result;
+}
+//----------------------------------------------------------------------------
+static bool writeAll(int fd,const unsigned char* data,uint64_t len)
+   // Write a buffer completely
+{
+   while (len) {
+      ssize_t written=::write(fd,data,len);
+      if (written<0) {
+         if (errno==EINTR)
+            continue;
+         return false;
+      }
+      data+=written;
+      len-=written;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+static int16_t scaleCoordinate(int v,double scale)
+   // Scale a coordinate and clamp it to the stored range
+{
+   long result=lround(v*scale);
+   return max<long>(numeric_limits<int16_t>::min(),min<long>(numeric_limits<int16_t>::max(),result));
+}
+//----------------------------------------------------------------------------
+Journal::Journal()
+   : fd(-1),mapping(nullptr),mappingSize(0),done(true)
+   // Constructor
+{
+}
+//----------------------------------------------------------------------------
+Journal::~Journal()
+   // Destructor
+{
+   close();
+}
+//----------------------------------------------------------------------------
+QString Journal::defaultFileName(const QString& pdf)
+   // The default file name for the annotations of a PDF
+{
+   return pdf+".annotations";
+}
+//----------------------------------------------------------------------------
+bool Journal::open(const QString& fileName)
+   // Open a journal
+{
+   close();
+
+   // Open the file
+   fd=::open(fileName.toLocal8Bit().constData(),O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+   if (fd<0) {
+      cerr << "unable to open annotations " << fileName.toLocal8Bit().constData() << endl;
+      return false;
+   }
+   // Another instance is presenting the same file?
+   if (flock(fd,LOCK_EX|LOCK_NB)) {
+      cerr << "annotations " << fileName.toLocal8Bit().constData() << " are in use" << endl;
+      close();
+      return false;
+   }
+   struct stat info;
+   if (fstat(fd,&info)) {
+      close();
+      return false;
+   }
+   uint64_t size=info.st_size;
+
+   if (!size) {
+      // A new journal
+      FileHeader header;
+      memcpy(header.magic,magic,sizeof(magic));
+      header.version=version;
+      header.reserved=0;
+      if (!writeAll(fd,reinterpret_cast<const unsigned char*>(&header),sizeof(header))) {
+         cerr << "unable to write annotations " << fileName.toLocal8Bit().constData() << endl;
+         close();
+         return false;
+      }
+   } else {
+      bool compactable;
+      if (!scan(fileName,compactable)) {
+         close();
+         return false;
+      }
+      // Every eraser move and every renumbering adds records. Rewrite the file with the remaining lines and start over with it
+      if (compactable&&compact(fileName))
+         return open(fileName);
+   }
+
+   done=false;
+   writer=thread(&Journal::write,this);
+   return true;
+}
+//----------------------------------------------------------------------------
+bool Journal::scan(const QString& fileName,bool& compactable)
+   // Read the records of the open file
+{
+   struct stat info;
+   if (fstat(fd,&info))
+      return false;
+   uint64_t size=info.st_size;
+
+   // Map the stored records. Only their headers are read now, the rest when a page is replayed
+   void* m=(size>=sizeof(FileHeader))?mmap(nullptr,size,PROT_READ,MAP_SHARED,fd,0):MAP_FAILED;
+   if (m==MAP_FAILED) {
+      cerr << "unable to read annotations " << fileName.toLocal8Bit().constData() << endl;
+      return false;
+   }
+   mapping=static_cast<const unsigned char*>(m);
+   mappingSize=size;
+   const FileHeader* header=reinterpret_cast<const FileHeader*>(mapping);
+   if (memcmp(header->magic,magic,sizeof(magic))||(header->version<oldestVersion)||(header->version>version)) {
+      cerr << fileName.toLocal8Bit().constData() << " does not contain annotations" << endl;
+      return false;
+   }
+   compactable=(header->version!=version);
+
+   uint64_t offset=sizeof(FileHeader);
+   while (offset+sizeof(Record)<=size) {
+      Record r;
+      memcpy(&r,mapping+offset,sizeof(r));
+      if ((r.length<sizeof(Record))||(r.length%4)||(r.length>size-offset)||(r.type<Stroke)||(r.type>Renumber))
+         break;
+      const unsigned char* payload=mapping+offset+sizeof(Record);
+      uint32_t payloadLen=r.length-sizeof(Record),count=0;
+      if (payloadLen>=4)
+         memcpy(&count,payload,4);
+      bool intact=checksum(mapping+offset+offsetof(Record,page),r.length-offsetof(Record,page))==r.checksum;
+
+      switch (r.type) {
+         case Stroke:
+            stored[r.page].push_back(offset);
+            break;
+         case Erase:
+            // Only the result matters
+            stored[r.page].push_back(offset);
+            compactable=true;
+            break;
+         case Clear:
+            // Clearing makes the earlier records of a page irrelevant
+            stored.erase(r.page);
+            compactable=true;
+            break;
+         case Fingerprints:
+            // The records so far belong to a document with these pages
+            if (intact&&(payloadLen>=4)&&((payloadLen-4)/fingerprintSize>=count)) {
+               compactable|=!fingerprints.empty();
+               fingerprints.assign(count,QByteArray());
+               QByteArray none(fingerprintSize,0);
+               for (unsigned index=0;index<count;index++) {
+                  QByteArray f(reinterpret_cast<const char*>(payload+4+index*fingerprintSize),fingerprintSize);
+                  if (f!=none)
+                     fingerprints[index]=f;
+               }
+            }
+            break;
+         case Renumber:
+            // The pages of the document moved
+            if (intact&&(payloadLen>=4)&&((payloadLen-4)/4>=count)) {
+               vector<unsigned> pages(count);
+               memcpy(pages.data(),payload+4,4*count);
+               moveStored(pages);
+               compactable=true;
+            }
+            break;
+      }
+      offset+=r.length;
+   }
+
+   // Drop a partially written record, e.g., after a crash
+   if (offset<size) {
+      cerr << "ignoring the damaged end of " << fileName.toLocal8Bit().constData() << endl;
+      if (ftruncate(fd,offset))
+         return false;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+bool Journal::compact(const QString& fileName)
+   // Rewrite the file with one stroke record per remaining stroke
+{
+   Trace::Span span("compact annotations");
+   vector<unsigned char> data(sizeof(FileHeader));
+   FileHeader header;
+   memcpy(header.magic,magic,sizeof(magic));
+   header.version=version;
+   header.reserved=0;
+   memcpy(data.data(),&header,sizeof(header));
+   auto add=[&data](vector<unsigned char>& record) {
+      seal(record);
+      data.insert(data.end(),record.begin(),record.end());
+   };
+   if (!fingerprints.empty()) {
+      auto record=fingerprintsRecord(fingerprints);
+      add(record);
+   }
+
+   // Replay every page in the coordinate space of its latest record. Replaying consumes the records, keep them in case writing fails
+   auto saved=stored;
+   vector<unsigned> pages;
+   for (auto& p:stored)
+      pages.push_back(p.first);
+   sort(pages.begin(),pages.end());
+   for (unsigned page:pages) {
+      unsigned reference=0;
+      for (uint64_t offset:stored[page]) {
+         Record r;
+         memcpy(&r,mapping+offset,sizeof(r));
+         if (r.reference)
+            reference=r.reference;
+      }
+      Scribble scribble;
+      replay(page,scribble,reference);
+      scribble.exportStrokes([&](const Scribble::StrokeData& stroke) {
+         auto record=strokeRecord(page,reference,stroke);
+         add(record);
+      });
+   }
+
+   // Replace the file atomically
+   QByteArray name=fileName.toLocal8Bit(),tmp=name+".tmp";
+   int out=::open(tmp.constData(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+   bool ok=(out>=0)&&writeAll(out,data.data(),data.size())&&(!fdatasync(out));
+   if (out>=0)
+      ok&=!::close(out);
+   ok=ok&&(!rename(tmp.constData(),name.constData()));
+   if (!ok) {
+      cerr << "unable to compact annotations " << name.constData() << endl;
+      unlink(tmp.constData());
+      stored.swap(saved);
+      return false;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+void Journal::moveStored(const vector<unsigned>& pages)
+   // Move the stored records to other pages
+{
+   unordered_map<unsigned,vector<uint64_t>> moved;
+   for (auto& p:stored)
+      if ((p.first<pages.size())&&(pages[p.first]!=~0u)) {
+         auto& target=moved[pages[p.first]];
+         target.insert(target.end(),p.second.begin(),p.second.end());
+         sort(target.begin(),target.end());
+      }
+   stored.swap(moved);
+}
+//----------------------------------------------------------------------------
+void Journal::close()
+   // Write all pending records and close the journal
+{
+   if (writer.joinable()) {
+      {
+         unique_lock<mutex> guard(lock);
+         done=true;
+      }
+      changed.notify_all();
+      writer.join();
+      fdatasync(fd);
+   }
+   if (mapping) {
+      munmap(const_cast<unsigned char*>(mapping),mappingSize);
+      mapping=nullptr;
+      mappingSize=0;
+   }
+   if (fd>=0) {
+      ::close(fd);
+      fd=-1;
+   }
+   stored.clear();
+   fingerprints.clear();
+}
+//----------------------------------------------------------------------------
+vector<unsigned char> Journal::startRecord(Type type,unsigned page,unsigned reference,unsigned payload)
+   // Start a record
+{
+   vector<unsigned char> record((sizeof(Record)+payload+3)&~3u);
+   Record r{static_cast<uint32_t>(record.size()),0,page,type,static_cast<uint16_t>(min(reference,0xFFFFu))};
+   memcpy(record.data(),&r,sizeof(r));
+   return record;
+}
+//----------------------------------------------------------------------------
+void Journal::seal(vector<unsigned char>& record)
+   // Compute the checksum of a complete record
+{
+   uint32_t sum=checksum(record.data()+offsetof(Record,page),record.size()-offsetof(Record,page));
+   memcpy(record.data()+offsetof(Record,checksum),&sum,sizeof(sum));
+}
+//----------------------------------------------------------------------------
+vector<unsigned char> Journal::strokeRecord(unsigned page,unsigned reference,const Scribble::StrokeData& stroke)
+   // Build a stroke record
+{
+   auto record=startRecord(Stroke,page,reference,12+4*stroke.count);
+   uint32_t header[3]={stroke.color.rgba(),stroke.width,stroke.count};
+   unsigned char* payload=record.data()+sizeof(Record);
+   memcpy(payload,header,sizeof(header));
+   memcpy(payload+sizeof(header),stroke.xs,2*stroke.count);
+   memcpy(payload+sizeof(header)+2*stroke.count,stroke.ys,2*stroke.count);
+   return record;
+}
+//----------------------------------------------------------------------------
+vector<unsigned char> Journal::fingerprintsRecord(const vector<QByteArray>& fingerprints)
+   // Build a fingerprints record
+{
+   uint32_t count=fingerprints.size();
+   auto record=startRecord(Fingerprints,0,0,4+count*fingerprintSize);
+   unsigned char* payload=record.data()+sizeof(Record);
+   memcpy(payload,&count,4);
+   for (unsigned index=0;index<count;index++)
+      memcpy(payload+4+index*fingerprintSize,fingerprints[index].constData(),min<size_t>(fingerprints[index].size(),fingerprintSize));
+   return record;
+}
+//----------------------------------------------------------------------------
+void Journal::append(vector<unsigned char>& record)
+   // Queue a record for writing
+{
+   if (fd<0)
+      return;
+
+   seal(record);
+   {
+      unique_lock<mutex> guard(lock);
+      queue.push_back(move(record));
+   }
+   changed.notify_one();
+}
+//----------------------------------------------------------------------------
+void Journal::write()
+   // The write loop
+{
+   Trace::nameThread("journal writer");
+   bool failed=false;
+   unique_lock<mutex> guard(lock);
+   while (true) {
+      while ((!done)&&queue.empty())
+         changed.wait(guard);
+      if (queue.empty())
+         return;
+
+      // Write everything that was queued so far
+      vector<vector<unsigned char>> records;
+      records.swap(queue);
+      guard.unlock();
+      {
+         Trace::Span span("write annotations");
+         for (auto& r:records)
+            if ((!failed)&&(!writeAll(fd,r.data(),r.size()))) {
+               cerr << "unable to write annotations, further changes are lost" << endl;
+               failed=true;
+            }
+      }
+      guard.lock();
+   }
+}
+//----------------------------------------------------------------------------
+void Journal::replay(unsigned page,Scribble& scribble,unsigned reference)
+   // Replay the stored records of a page
+{
+   auto iter=stored.find(page);
+   if (iter==stored.end())
+      return;
+
+   Trace::Span span("replay annotations");
+   vector<int16_t> xs,ys;
+   for (uint64_t offset:iter->second) {
+      Record r;
+      memcpy(&r,mapping+offset,sizeof(r));
+      if (checksum(mapping+offset+offsetof(Record,page),r.length-offsetof(Record,page))!=r.checksum) {
+         cerr << "skipping a damaged annotation on page " << (page+1) << endl;
+         continue;
+      }
+      const unsigned char* payload=mapping+offset+sizeof(Record);
+      uint32_t payloadLen=r.length-sizeof(Record);
+      double scale=(reference&&r.reference)?(static_cast<double>(reference)/r.reference):1.0;
+
+      switch (r.type) {
+         case Stroke: {
+            uint32_t header[3];
+            if (payloadLen<sizeof(header))
+               break;
+            memcpy(header,payload,sizeof(header));
+            uint32_t count=header[2];
+            if ((payloadLen-sizeof(header))/4<count)
+               break;
+            xs.resize(count); ys.resize(count);
+            const unsigned char* points=payload+sizeof(header);
+            for (uint32_t index=0;index<count;index++) {
+               int16_t x,y;
+               memcpy(&x,points+2*index,2);
+               memcpy(&y,points+2*(count+index),2);
+               xs[index]=scaleCoordinate(x,scale);
+               ys[index]=scaleCoordinate(y,scale);
+            }
+            scribble.addStroke(max<long>(1,lround(header[1]*scale)),QColor::fromRgba(header[0]),xs.data(),ys.data(),count);
+            break;
+         }
+         case Erase: {
+            int32_t coords[5];
+            if (payloadLen<sizeof(coords))
+               break;
+            memcpy(coords,payload,sizeof(coords));
+            scribble.eraseLine(lround(coords[0]*scale),lround(coords[1]*scale),lround(coords[2]*scale),lround(coords[3]*scale),max<long>(1,lround(coords[4]*scale)));
+            break;
+         }
+         case Clear:
+            scribble.clear();
+            break;
+      }
+   }
+   stored.erase(iter);
+}
+//----------------------------------------------------------------------------
+void Journal::recordStroke(unsigned page,unsigned reference,const Scribble::StrokeData& stroke)
+   // Record a finished stroke
+{
+   auto record=strokeRecord(page,reference,stroke);
+   append(record);
+}
+//----------------------------------------------------------------------------
+void Journal::recordErase(unsigned page,unsigned reference,int x1,int y1,int x2,int y2,unsigned width)
+   // Record an eraser move
+{
+   auto record=startRecord(Erase,page,reference,20);
+   int32_t coords[5]={x1,y1,x2,y2,static_cast<int32_t>(width)};
+   memcpy(record.data()+sizeof(Record),coords,sizeof(coords));
+   append(record);
+}
+//----------------------------------------------------------------------------
+void Journal::recordClear(unsigned page)
+   // Record clearing a page
+{
+   auto record=startRecord(Clear,page,0,0);
+   append(record);
+}
+//----------------------------------------------------------------------------
+void Journal::recordFingerprints(const vector<QByteArray>& fingerprints)
+   // Record the page fingerprints of the document the annotations belong to
+{
+   this->fingerprints=fingerprints;
+   auto record=fingerprintsRecord(fingerprints);
+   append(record);
+}
+//----------------------------------------------------------------------------
+void Journal::renumber(const vector<unsigned>& pages)
+   // Move the annotations to other pages
+{
+   moveStored(pages);
+   uint32_t count=pages.size();
+   auto record=startRecord(Renumber,0,0,4+4*count);
+   unsigned char* payload=record.data()+sizeof(Record);
+   memcpy(payload,&count,4);
+   for (unsigned index=0;index<count;index++) {
+      uint32_t page=pages[index];
+      memcpy(payload+4+4*index,&page,4);
+   }
+   append(record);
+}
+//----------------------------------------------------------------------------
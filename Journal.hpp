@@ -0,0 +1,105 @@
+#ifndef H_Journal
+#define H_Journal
+//----------------------------------------------------------------------------
+#include "Scribble.hpp"
+#include <QByteArray>
+#include <QString>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+//----------------------------------------------------------------------------
+/// An append-only file of annotations next to the PDF. Records are written by a background thread,
+/// stored records are mapped and replayed page by page when a page is first needed. Opening rewrites the file compactly once erased or moved lines accumulate.
+/// The records are kept with the page fingerprints of the document they belong to, and are renumbered when pages move
+class Journal
+{
+   public:
+   /// The record types
+   enum Type : uint16_t { Stroke = 1, Erase = 2, Clear = 3, Fingerprints = 4, Renumber = 5 };
+
+   private:
+   struct Record;
+
+   /// The file descriptor
+   int fd;
+   /// The mapping of the records that existed when opening
+   const unsigned char* mapping;
+   /// The size of the mapping
+   uint64_t mappingSize;
+   /// The stored records of pages that were not replayed yet
+   std::unordered_map<unsigned,std::vector<uint64_t>> stored;
+   /// The page fingerprints of the document the records belong to, empty if unknown
+   std::vector<QByteArray> fingerprints;
+   /// Protects the queue
+   std::mutex lock;
+   /// Signals new records
+   std::condition_variable changed;
+   /// The records that still have to be written
+   std::vector<std::vector<unsigned char>> queue;
+   /// Shutting down?
+   bool done;
+   /// The writer
+   std::thread writer;
+
+   /// Start a record
+   static std::vector<unsigned char> startRecord(Type type,unsigned page,unsigned reference,unsigned payload);
+   /// Build a stroke record
+   static std::vector<unsigned char> strokeRecord(unsigned page,unsigned reference,const Scribble::StrokeData& stroke);
+   /// Build a fingerprints record
+   static std::vector<unsigned char> fingerprintsRecord(const std::vector<QByteArray>& fingerprints);
+   /// Compute the checksum of a complete record
+   static void seal(std::vector<unsigned char>& record);
+   /// Read the records of the open file. Returns false if the file is not a journal. Sets compactable if rewriting would shrink the file
+   bool scan(const QString& fileName,bool& compactable);
+   /// Rewrite the file with one stroke record per remaining stroke
+   bool compact(const QString& fileName);
+   /// Move the stored records to other pages
+   void moveStored(const std::vector<unsigned>& pages);
+   /// Queue a record for writing
+   void append(std::vector<unsigned char>& record);
+   /// The write loop
+   void write();
+
+   Journal(const Journal&);
+   void operator=(const Journal&);
+
+   public:
+   /// Constructor
+   Journal();
+   /// Destructor
+   ~Journal();
+
+   /// The default file name for the annotations of a PDF
+   static QString defaultFileName(const QString& pdf);
+
+   /// Open a journal, creating it if needed
+   bool open(const QString& fileName);
+   /// Write all pending records and close the journal
+   void close();
+
+   /// Are there stored records for a page that were not replayed yet?
+   bool hasRecords(unsigned page) const { return stored.count(page); }
+   /// Replay the stored records of a page. The reference is the current width of the scribble coordinate space
+   void replay(unsigned page,Scribble& scribble,unsigned reference);
+   /// The page fingerprints of the document the annotations belong to. Empty if unknown
+   const std::vector<QByteArray>& getFingerprints() const { return fingerprints; }
+
+   // The following functions only queue the record, they never wait for the disk
+
+   /// Record a finished stroke
+   void recordStroke(unsigned page,unsigned reference,const Scribble::StrokeData& stroke);
+   /// Record an eraser move
+   void recordErase(unsigned page,unsigned reference,int x1,int y1,int x2,int y2,unsigned width);
+   /// Record clearing a page
+   void recordClear(unsigned page);
+   /// Record the page fingerprints of the document the annotations belong to
+   void recordFingerprints(const std::vector<QByteArray>& fingerprints);
+   /// Move the annotations to other pages after the document changed. Maps every old page to its new page, or ~0u if it was removed.
+   /// Records that were not replayed yet are moved, too
+   void renumber(const std::vector<unsigned>& pages);
+};
+//----------------------------------------------------------------------------
+#endif
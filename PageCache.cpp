@@ -0,0 +1,724 @@
+#include "PageCache.hpp"
+#include <QImage>
+#include <QDir>
+#include <QStandardPaths>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+/// The magic number of cache files
+static const char magic[8] = {'P','P','D','F','C','A','C','H'};
+/// The cache file format version
+static const uint32_t version = 7;
+/// The alignment of stored images
+static const uint64_t alignment = 64;
+/// The minimum size of a chunk
+static const uint64_t minChunkSize = 64ull<<20;
+/// The maximum number of chunks
+static const unsigned maxChunks = 16384;
+/// Cache files that were not used for this long are deleted, in seconds
+static const time_t maxCacheAge = 30*24*60*60;
+/// The maximum total size of the cache files. The least recently used ones are deleted beyond that
+static const uint64_t maxCacheSize = 8ull<<30;
+/// The number of attempts to open a cache file that is deleted concurrently
+static const unsigned maxOpenAttempts = 3;
+//----------------------------------------------------------------------------
+static uint64_t align(uint64_t len)
+   // Round up to the alignment
+{
+   return (len+alignment-1)&~(alignment-1);
+}
+//----------------------------------------------------------------------------
+/// The file header
+struct PageCache::Header {
+   /// The magic number
+   char magic[8];
+   /// The format version
+   uint32_t version;
+   /// The number of pages
+   uint32_t pageCount;
+   /// The content key
+   Key key;
+   /// The size of a chunk
+   uint64_t chunkSize;
+   /// The used part of the file
+   atomic<uint64_t> used;
+};
+//----------------------------------------------------------------------------
+/// A page directory entry
+struct PageCache::Entry {
+   /// The position of the image in the file
+   uint64_t offset;
+   /// The image layout
+   uint32_t width,height,bytesPerLine,format;
+   /// The compressed length (if compressed)
+   uint32_t length;
+   /// Is the image complete?
+   atomic<uint32_t> valid;
+};
+//----------------------------------------------------------------------------
+/// The images handed out
+struct PageCache::Pins {
+   /// Protects the pins. Taken before the free lock
+   mutex lock;
+   /// The cache, nullptr once it is closed
+   PageCache* cache;
+   /// The number of live images for each stored image
+   unordered_map<uint64_t,unsigned> counts;
+   /// Released space that is still pinned, offset and length
+   unordered_map<uint64_t,uint64_t> retired;
+   /// The chunks of the closed cache, unmapped once the last image is gone
+   vector<pair<unsigned char*,uint64_t>> mappings;
+
+   /// Destructor
+   ~Pins();
+};
+//----------------------------------------------------------------------------
+PageCache::Pins::~Pins()
+   // Destructor
+{
+   for (auto& m:mappings)
+      munmap(m.first,m.second);
+}
+//----------------------------------------------------------------------------
+/// A handed out image
+struct PageCache::Pin {
+   /// The pins
+   shared_ptr<Pins> pins;
+   /// The stored image
+   uint64_t offset;
+};
+//----------------------------------------------------------------------------
+uint64_t PageCache::dataOffset(unsigned pageCount)
+   // The begin of the image data
+{
+   uint64_t size=sizeof(Header)+(static_cast<uint64_t>(pageCount)*sizeof(Entry));
+   return (size+4095)&~static_cast<uint64_t>(4095);
+}
+//----------------------------------------------------------------------------
+PageCache::PageCache()
+   : file(0),fd(-1),directory(0),dataStart(0),chunkSize(0),chunks(new atomic<unsigned char*>[maxChunks]),chunkCount(0),header(0),entries(0),pageCount(0),imageBudget(0),imageSpace(0)
+   // Constructor
+{
+   for (unsigned index=0;index<maxChunks;index++)
+      chunks[index]=nullptr;
+}
+//----------------------------------------------------------------------------
+PageCache::~PageCache()
+   // Destructor
+{
+   cleanup();
+}
+//----------------------------------------------------------------------------
+QString PageCache::defaultFileName(const Key& key)
+   // The default file name for a cache
+{
+   QString dir=QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+   if (dir.isEmpty())
+      return QString();
+   dir+="/presentpdf";
+   if (!QDir().mkpath(dir))
+      return QString();
+
+   QByteArray hash(reinterpret_cast<const char*>(key.hash),sizeof(key.hash));
+   char buffer[100];
+   snprintf(buffer,sizeof(buffer),"-%dx%d-%x-%x.cache",key.imageWidth,key.imageHeight,key.hints,key.flags);
+   return dir+"/"+QString(hash.toHex())+buffer;
+}
+//----------------------------------------------------------------------------
+static void pruneCacheFiles(const string& keep)
+   // Delete the cache files next to a cache file that were not used for a long time, and the least recently used ones beyond the size limit
+{
+   string dir=keep.substr(0,keep.rfind('/'));
+   DIR* d=opendir(dir.c_str());
+   if (!d)
+      return;
+   struct CacheFile { string name; time_t used; uint64_t size; };
+   vector<CacheFile> files;
+   uint64_t total=0;
+   while (dirent* entry=readdir(d)) {
+      string name=dir+"/"+entry->d_name;
+      struct stat info;
+      if ((name.size()<6)||name.compare(name.size()-6,6,".cache")||stat(name.c_str(),&info)||(!S_ISREG(info.st_mode)))
+         continue;
+      uint64_t size=static_cast<uint64_t>(info.st_blocks)*512;
+      total+=size;
+      if (name!=keep)
+         files.push_back(CacheFile{name,info.st_mtime,size});
+   }
+   closedir(d);
+
+   // The file times are updated whenever a cache is opened. Delete the oldest first, files in use by other instances are locked
+   sort(files.begin(),files.end(),[](const CacheFile& a,const CacheFile& b) { return a.used<b.used; });
+   time_t now=time(nullptr);
+   for (auto& f:files) {
+      if ((now-f.used<maxCacheAge)&&(total<=maxCacheSize))
+         break;
+      int fd=::open(f.name.c_str(),O_RDWR|O_CLOEXEC);
+      if (fd<0)
+         continue;
+      if ((!flock(fd,LOCK_EX|LOCK_NB))&&(!unlink(f.name.c_str())))
+         total-=f.size;
+      ::close(fd);
+   }
+}
+//----------------------------------------------------------------------------
+bool PageCache::open(const QString& fileName,const Key& key,unsigned pageCount,uint64_t largestImage)
+   // Open a cache file
+{
+   cleanup();
+
+   // Open the file
+   if (fileName.isEmpty()) {
+      file=tmpfile();
+      if (!file) {
+         cerr << "unable to create a cache file" << endl;
+         return false;
+      }
+      fd=fileno(static_cast<FILE*>(file));
+   } else {
+      string name=fileName.toLocal8Bit().constData();
+      for (unsigned attempt=1;;attempt++) {
+         fd=::open(name.c_str(),O_RDWR|O_CREAT|O_CLOEXEC,0600);
+         if (fd<0) {
+            cerr << "unable to open cache file " << name << endl;
+            return false;
+         }
+         // Another instance is using the same cache?
+         if (flock(fd,LOCK_EX|LOCK_NB)) {
+            cerr << "cache file " << name << " is in use" << endl;
+            cleanup();
+            return false;
+         }
+         // Another instance may have pruned the file between opening and locking it. Its content would be lost, open the new one
+         struct stat opened,named;
+         if ((!fstat(fd,&opened))&&(!stat(name.c_str(),&named))&&(opened.st_dev==named.st_dev)&&(opened.st_ino==named.st_ino))
+            break;
+         cleanup();
+         if (attempt==maxOpenAttempts) {
+            cerr << "cache file " << name << " keeps being deleted" << endl;
+            return false;
+         }
+      }
+      // Remember the use, and drop the caches of old documents
+      futimens(fd,nullptr);
+      pruneCacheFiles(fileName.toLocal8Bit().constData());
+   }
+
+   // Map the page directory. The image data is mapped chunk by chunk when needed
+   pins=make_shared<Pins>();
+   pins->cache=this;
+   dataStart=dataOffset(pageCount);
+   chunkSize=max(minChunkSize,(align(largestImage)+4095)&~static_cast<uint64_t>(4095));
+   if (posix_fallocate(fd,0,dataStart)) {
+      cerr << "unable to allocate the cache directory" << endl;
+      cleanup();
+      return false;
+   }
+   void* m=mmap(0,dataStart,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+   if (m==MAP_FAILED) {
+      cerr << "unable to map cache into memory" << endl;
+      cleanup();
+      return false;
+   }
+   directory=static_cast<unsigned char*>(m);
+   header=reinterpret_cast<Header*>(directory);
+   entries=reinterpret_cast<Entry*>(directory+sizeof(Header));
+   this->pageCount=pageCount;
+
+   // Start from scratch if the content does not match
+   if (!validate(key)) {
+      memset(directory,0,dataStart);
+      memcpy(header->magic,magic,sizeof(magic));
+      header->version=version;
+      header->pageCount=pageCount;
+      header->key=key;
+      header->chunkSize=chunkSize;
+      header->used=dataStart;
+   }
+   collectFreeSpace();
+   return true;
+}
+//----------------------------------------------------------------------------
+bool PageCache::adopt(int fd)
+   // Use a cache file that another process opened
+{
+   cleanup();
+   this->fd=fd;
+
+   // The other process set up the header, we only need the layout
+   alignas(Header) unsigned char buffer[sizeof(Header)];
+   const Header* h=reinterpret_cast<const Header*>(buffer);
+   if ((pread(fd,buffer,sizeof(buffer),0)!=static_cast<ssize_t>(sizeof(buffer)))||memcmp(h->magic,magic,sizeof(magic))||(h->version!=version)) {
+      cerr << "unable to use the cache file of another process" << endl;
+      cleanup();
+      return false;
+   }
+   pageCount=h->pageCount;
+   chunkSize=h->chunkSize;
+   dataStart=dataOffset(pageCount);
+
+   pins=make_shared<Pins>();
+   pins->cache=this;
+   void* m=mmap(0,dataStart,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+   if (m==MAP_FAILED) {
+      cerr << "unable to map cache into memory" << endl;
+      cleanup();
+      return false;
+   }
+   directory=static_cast<unsigned char*>(m);
+   header=reinterpret_cast<Header*>(directory);
+   entries=reinterpret_cast<Entry*>(directory+sizeof(Header));
+   return true;
+}
+//----------------------------------------------------------------------------
+static uint64_t storedLength(uint64_t length,uint64_t bytesPerLine,uint64_t height)
+   // The space occupied by an image
+{
+   return align(length?length:(bytesPerLine*height));
+}
+//----------------------------------------------------------------------------
+bool PageCache::validate(const Key& key)
+   // Check if the existing content can be reused
+{
+   if (memcmp(header->magic,magic,sizeof(magic))||(header->version!=version)||(header->pageCount!=pageCount)||memcmp(&(header->key),&key,sizeof(Key))||(header->chunkSize!=chunkSize))
+      return false;
+   if ((header->used<dataStart)||(header->used>dataStart+(maxChunks*chunkSize)))
+      return false;
+
+   // Map the used chunks
+   for (unsigned chunk=0;chunk*chunkSize<header->used-dataStart;chunk++)
+      if (!mapChunk(chunk))
+         return false;
+
+   // Drop all images that are inconsistent
+   for (unsigned index=0;index<pageCount;index++) {
+      Entry& e=entries[index];
+      if (!e.valid)
+         continue;
+      bool ok;
+      if (e.length) {
+         ok=(e.offset>=dataStart)&&(e.offset+e.length<=header->used);
+      } else {
+         uint64_t end=e.offset+static_cast<uint64_t>(e.bytesPerLine)*e.height;
+         ok=(e.offset>=dataStart)&&(end<=header->used)&&(e.format==QImage::Format_RGB32)&&(e.bytesPerLine>=4*e.width)&&(e.width)&&(e.height);
+      }
+      if (ok)
+         ok=((e.offset-dataStart)%chunkSize)+storedLength(e.length,e.bytesPerLine,e.height)<=chunkSize;
+      if (!ok)
+         e.valid=0;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+void PageCache::collectFreeSpace()
+   // Collect the space that is not used by valid images
+{
+   unique_lock<mutex> guard(freeLock);
+
+   // Find all used blocks, shared images only once
+   vector<pair<uint64_t,uint64_t>> used;
+   for (unsigned index=0;index<pageCount;index++)
+      if (entries[index].valid) {
+         const Entry& e=entries[index];
+         used.push_back(pair<uint64_t,uint64_t>(e.offset,storedLength(e.length,e.bytesPerLine,e.height)));
+      }
+   sort(used.begin(),used.end());
+   used.erase(unique(used.begin(),used.end()),used.end());
+
+   // Everything in between is free
+   freeBlocks.clear();
+   imageSpace=0;
+   uint64_t pos=dataStart;
+   for (auto& u:used) {
+      if (u.first>pos)
+         freeRange(pos,u.first-pos);
+      pos=max(pos,u.first+u.second);
+   }
+   if (header->used>pos)
+      freeRange(pos,header->used-pos);
+
+   // Account the space for images
+   for (auto& f:freeBlocks)
+      imageSpace+=f.second;
+   for (auto& u:used)
+      imageSpace+=u.second;
+}
+//----------------------------------------------------------------------------
+void PageCache::freeBlock(uint64_t offset,uint64_t len)
+   // Release space
+{
+   // Merge with the neighbors within the same chunk
+   auto after=freeBlocks.lower_bound(offset);
+   if ((after!=freeBlocks.end())&&(offset+len==after->first)&&((after->first-dataStart)%chunkSize)) {
+      len+=after->second;
+      after=freeBlocks.erase(after);
+   }
+   if ((after!=freeBlocks.begin())&&((offset-dataStart)%chunkSize)) {
+      auto before=prev(after);
+      if (before->first+before->second==offset) {
+         before->second+=len;
+         return;
+      }
+   }
+   freeBlocks[offset]=len;
+}
+//----------------------------------------------------------------------------
+void PageCache::freeRange(uint64_t offset,uint64_t len)
+   // Release space that may span chunks
+{
+   // Blocks never cross chunk boundaries
+   while (len) {
+      uint64_t chunkEnd=offset-((offset-dataStart)%chunkSize)+chunkSize;
+      uint64_t part=min(len,chunkEnd-offset);
+      freeBlock(offset,part);
+      offset+=part;
+      len-=part;
+   }
+}
+//----------------------------------------------------------------------------
+bool PageCache::mapChunk(unsigned chunk)
+   // Make sure a chunk is mapped
+{
+   if (chunk>=maxChunks)
+      return false;
+   if (chunks[chunk].load(memory_order_acquire))
+      return true;
+
+   unique_lock<mutex> guard(growLock);
+   if (chunks[chunk].load(memory_order_acquire))
+      return true;
+   uint64_t offset=dataStart+(chunk*chunkSize);
+   if (posix_fallocate(fd,offset,chunkSize)) {
+      cerr << "unable to grow the cache by " << (chunkSize/1024/1024) << " MB" << endl;
+      return false;
+   }
+   void* m=mmap(0,chunkSize,PROT_READ|PROT_WRITE,MAP_SHARED,fd,offset);
+   if (m==MAP_FAILED) {
+      cerr << "unable to map cache into memory" << endl;
+      return false;
+   }
+   chunks[chunk].store(static_cast<unsigned char*>(m),memory_order_release);
+   if (chunk>=chunkCount)
+      chunkCount=chunk+1;
+   return true;
+}
+//----------------------------------------------------------------------------
+unsigned char* PageCache::address(uint64_t offset) const
+   // The address of a position in the file
+{
+   uint64_t pos=offset-dataStart;
+   return chunks[pos/chunkSize].load(memory_order_acquire)+(pos%chunkSize);
+}
+//----------------------------------------------------------------------------
+uint64_t PageCache::offsetOf(const unsigned char* data) const
+   // The position of an address in the file
+{
+   for (unsigned chunk=0,limit=chunkCount;chunk<limit;chunk++) {
+      const unsigned char* begin=chunks[chunk].load(memory_order_acquire);
+      if (begin&&(data>=begin)&&(data<begin+chunkSize))
+         return dataStart+(chunk*chunkSize)+(data-begin);
+   }
+   return 0;
+}
+//----------------------------------------------------------------------------
+void PageCache::cleanup()
+   // Close the cache
+{
+   // Images handed out may outlive the cache, the pins unmap the chunks once they are gone
+   if (pins) {
+      unique_lock<mutex> guard(pins->lock);
+      pins->cache=nullptr;
+   }
+   for (unsigned chunk=0,limit=chunkCount;chunk<limit;chunk++)
+      if (unsigned char* c=chunks[chunk].exchange(nullptr)) {
+         if (pins)
+            pins->mappings.push_back(make_pair(c,chunkSize)); else
+            munmap(c,chunkSize);
+      }
+   pins.reset();
+   chunkCount=0;
+   if (directory) {
+      munmap(directory,dataStart);
+      directory=0;
+      header=0;
+      entries=0;
+   }
+   if (file) {
+      fclose(static_cast<FILE*>(file));
+      file=0;
+   } else if (fd>=0) {
+      ::close(fd);
+   }
+   fd=-1;
+   pageCount=0;
+   freeBlocks.clear();
+   imageSpace=0;
+}
+//----------------------------------------------------------------------------
+void PageCache::setImageBudget(uint64_t bytes)
+   // Limit the space used for full size pages
+{
+   imageBudget=bytes;
+}
+//----------------------------------------------------------------------------
+unsigned char* PageCache::allocate(uint64_t len)
+   // Allocate space for an image
+{
+   len=align(len);
+   if ((!len)||(len>chunkSize))
+      return nullptr;
+
+   // Bump the used space, skipping to the next chunk if the space does not fit
+   uint64_t pos=header->used.load(memory_order_relaxed),start;
+   do {
+      uint64_t inChunk=(pos-dataStart)%chunkSize;
+      start=(inChunk+len>chunkSize)?(pos+chunkSize-inChunk):pos;
+   } while (!header->used.compare_exchange_weak(pos,start+len,memory_order_relaxed));
+   bool mapped=mapChunk((start-dataStart)/chunkSize);
+
+   // Keep the skipped tail for full size pages, and the bumped range if the chunk cannot be mapped. It is mapped again when the range is reused
+   bool keepTail=(start!=pos)&&(chunks[(pos-dataStart)/chunkSize].load(memory_order_acquire));
+   if (keepTail||(!mapped)) {
+      unique_lock<mutex> guard(freeLock);
+      if (keepTail) {
+         freeBlock(pos,start-pos);
+         imageSpace+=start-pos;
+      }
+      if (!mapped) {
+         freeRange(start,len);
+         imageSpace+=len;
+      }
+   }
+   return mapped?address(start):nullptr;
+}
+//----------------------------------------------------------------------------
+unsigned char* PageCache::allocateImage(uint64_t len)
+   // Allocate space for a full size page
+{
+   len=align(len);
+   uint64_t offset=0;
+
+   {
+      unique_lock<mutex> guard(freeLock);
+
+      // Reuse released space if possible, smallest fit first
+      auto best=freeBlocks.end();
+      for (auto iter=freeBlocks.begin(),limit=freeBlocks.end();iter!=limit;++iter)
+         if ((iter->second>=len)&&((best==limit)||(iter->second<best->second)))
+            best=iter;
+      if (best!=freeBlocks.end()) {
+         offset=best->first;
+         uint64_t available=best->second;
+         freeBlocks.erase(best);
+         if (available>len)
+            freeBlocks[offset+len]=available-len;
+      } else {
+         // Reserve budget for growing otherwise
+         if (imageBudget&&(imageSpace+len>imageBudget))
+            return nullptr;
+         imageSpace+=len;
+      }
+   }
+
+   // Released space may lie in a chunk that could not be mapped when it was allocated
+   if (offset) {
+      if (mapChunk((offset-dataStart)/chunkSize))
+         return address(offset);
+      unique_lock<mutex> guard(freeLock);
+      freeBlock(offset,len);
+      return nullptr;
+   }
+
+   unsigned char* result=allocate(len);
+   if (!result) {
+      unique_lock<mutex> guard(freeLock);
+      imageSpace-=len;
+   }
+   return result;
+}
+//----------------------------------------------------------------------------
+void PageCache::store(unsigned page,const QImage& image)
+   // Remember an image that was written into allocated space
+{
+   Entry& e=entries[page];
+   e.offset=offsetOf(image.constBits());
+   e.width=image.width();
+   e.height=image.height();
+   e.bytesPerLine=image.bytesPerLine();
+   e.format=image.format();
+   e.length=0;
+}
+//----------------------------------------------------------------------------
+void PageCache::storeCompressed(unsigned page,const unsigned char* data,uint64_t len,const QSize& size)
+   // Remember a compressed image that was written into allocated space
+{
+   Entry& e=entries[page];
+   e.offset=offsetOf(data);
+   e.width=size.width();
+   e.height=size.height();
+   e.bytesPerLine=0;
+   e.format=QImage::Format_Invalid;
+   e.length=len;
+}
+//----------------------------------------------------------------------------
+void PageCache::publish(unsigned page)
+   // Mark an image as complete
+{
+   entries[page].valid.store(1,memory_order_release);
+}
+//----------------------------------------------------------------------------
+void PageCache::release(unsigned page)
+   // Drop an image and release its space
+{
+   Entry& e=entries[page];
+   unique_lock<mutex> pinGuard(pins->lock);
+   unique_lock<mutex> guard(freeLock);
+   if (!e.valid.exchange(0,memory_order_acq_rel))
+      return;
+   if (isShared(page))
+      return;
+
+   // Views may still show the image, keep the space until they let go of it
+   uint64_t len=storedLength(e.length,e.bytesPerLine,e.height);
+   if (pins->counts.count(e.offset))
+      pins->retired[e.offset]=len; else
+      freeBlock(e.offset,len);
+}
+//----------------------------------------------------------------------------
+bool PageCache::isShared(unsigned page) const
+   // Does another page use the same stored image?
+{
+   uint64_t offset=entries[page].offset;
+   for (unsigned index=0;index<pageCount;index++)
+      if ((index!=page)&&entries[index].valid.load(memory_order_acquire)&&(entries[index].offset==offset))
+         return true;
+   return false;
+}
+//----------------------------------------------------------------------------
+bool PageCache::share(unsigned page,unsigned from)
+   // Let a page use the stored image of another page
+{
+   unique_lock<mutex> guard(freeLock);
+   if (!isValid(from))
+      return false;
+   Entry& e=entries[page];
+   const Entry& f=entries[from];
+   e.offset=f.offset;
+   e.width=f.width;
+   e.height=f.height;
+   e.bytesPerLine=f.bytesPerLine;
+   e.format=f.format;
+   e.length=f.length;
+   e.valid.store(1,memory_order_release);
+   return true;
+}
+//----------------------------------------------------------------------------
+bool PageCache::attach(unsigned page)
+   // Map the space of an image that another process stored
+{
+   if (!isValid(page))
+      return false;
+   const Entry& e=entries[page];
+   return mapChunk((e.offset-dataStart)/chunkSize);
+}
+//----------------------------------------------------------------------------
+bool PageCache::isValid(unsigned page) const
+   // Is an image available?
+{
+   return (page<pageCount)&&entries[page].valid.load(memory_order_acquire);
+}
+//----------------------------------------------------------------------------
+bool PageCache::isCompressed(unsigned page) const
+   // Is an image stored compressed?
+{
+   return entries[page].length;
+}
+//----------------------------------------------------------------------------
+bool PageCache::holds(unsigned page,const QImage& image) const
+   // Does a page store exactly these pixels?
+{
+   if ((!isValid(page))||isCompressed(page))
+      return false;
+   const Entry& e=entries[page];
+   if ((static_cast<int>(e.width)!=image.width())||(static_cast<int>(e.height)!=image.height())||(static_cast<int>(e.bytesPerLine)!=image.bytesPerLine())||(static_cast<int>(e.format)!=image.format()))
+      return false;
+   return !memcmp(address(e.offset),image.constBits(),static_cast<uint64_t>(e.bytesPerLine)*e.height);
+}
+//----------------------------------------------------------------------------
+bool PageCache::holds(unsigned page,const unsigned char* data,uint64_t len) const
+   // Does a page store exactly this compressed image?
+{
+   if ((!isValid(page))||(entries[page].length!=len))
+      return false;
+   return !memcmp(address(entries[page].offset),data,len);
+}
+//----------------------------------------------------------------------------
+QSize PageCache::imageSize(unsigned page) const
+   // The size of a stored image
+{
+   if (!isValid(page))
+      return QSize();
+   const Entry& e=entries[page];
+   return QSize(e.width,e.height);
+}
+//----------------------------------------------------------------------------
+QImage PageCache::image(unsigned page,double devicePixelRatio) const
+   // Get a stored image
+{
+   const Entry& e=entries[page];
+   if (e.length)
+      return QImage();
+   {
+      unique_lock<mutex> guard(pins->lock);
+      pins->counts[e.offset]++;
+   }
+   QImage result(address(e.offset),e.width,e.height,e.bytesPerLine,static_cast<QImage::Format>(e.format),unpin,new Pin{pins,e.offset});
+   result.setDevicePixelRatio(devicePixelRatio);
+   return result;
+}
+//----------------------------------------------------------------------------
+void PageCache::unpin(void* pin)
+   // Cleanup function of handed out images
+{
+   unique_ptr<Pin> p(static_cast<Pin*>(pin));
+   Pins& pins=*p->pins;
+   unique_lock<mutex> pinGuard(pins.lock);
+   auto iter=pins.counts.find(p->offset);
+   if ((iter==pins.counts.end())||(--iter->second))
+      return;
+   pins.counts.erase(iter);
+
+   // Released while the image was alive?
+   auto retired=pins.retired.find(p->offset);
+   if (retired==pins.retired.end())
+      return;
+   if (pins.cache) {
+      unique_lock<mutex> guard(pins.cache->freeLock);
+      pins.cache->freeBlock(retired->first,retired->second);
+   }
+   pins.retired.erase(retired);
+}
+//----------------------------------------------------------------------------
+const unsigned char* PageCache::compressedData(unsigned page,uint64_t& len) const
+   // Get a stored compressed image
+{
+   const Entry& e=entries[page];
+   len=e.length;
+   return e.length?address(e.offset):nullptr;
+}
+//----------------------------------------------------------------------------
@@ -0,0 +1,153 @@
+#ifndef H_PageCache
+#define H_PageCache
+//----------------------------------------------------------------------------
+#include <QString>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+//----------------------------------------------------------------------------
+class QImage;
+class QSize;
+//----------------------------------------------------------------------------
+/// A memory mapped file that stores rendered pages. Named cache files are reused across runs.
+/// The image data lives in chunks that are mapped on demand, the file grows as pages are rendered. Pages with identical images may share one copy
+class PageCache
+{
+   public:
+   /// Identifies the content of a cache file
+   struct Key {
+      /// Hash of the PDF file
+      unsigned char hash[20];
+      /// The image size
+      int32_t imageWidth,imageHeight;
+      /// The render hints
+      uint32_t hints;
+      /// The storage flags
+      uint32_t flags;
+   };
+   /// Storage flags
+   enum Flags : uint32_t { CompressedImages = 1 };
+
+   private:
+   struct Header;
+   struct Entry;
+   struct Pins;
+   struct Pin;
+
+   /// The file (if anonymous)
+   void* file;
+   /// The file descriptor
+   int fd;
+   /// The mapping of the page directory
+   unsigned char* directory;
+   /// The begin of the image data
+   uint64_t dataStart;
+   /// The size of a chunk
+   uint64_t chunkSize;
+   /// The mapped chunks
+   std::unique_ptr<std::atomic<unsigned char*>[]> chunks;
+   /// The number of mapped chunks
+   std::atomic<unsigned> chunkCount;
+   /// Protects growing the file
+   std::mutex growLock;
+   /// The header
+   Header* header;
+   /// The page directory
+   Entry* entries;
+   /// The number of pages
+   unsigned pageCount;
+   /// Protects the released space and the image accounting
+   std::mutex freeLock;
+   /// Released space, offset and length
+   std::map<uint64_t,uint64_t> freeBlocks;
+   /// The maximum space for full size pages (0 if unlimited)
+   uint64_t imageBudget;
+   /// The space used for full size pages, including released space
+   uint64_t imageSpace;
+   /// The images handed out. Shared with the images, which may outlive the cache. Owns the chunks of the closed cache until they are gone
+   std::shared_ptr<Pins> pins;
+
+   /// The begin of the image data
+   static uint64_t dataOffset(unsigned pageCount);
+   /// Make sure a chunk is mapped
+   bool mapChunk(unsigned chunk);
+   /// The address of a position in the file
+   unsigned char* address(uint64_t offset) const;
+   /// The position of an address in the file
+   uint64_t offsetOf(const unsigned char* data) const;
+   /// Check if the existing content can be reused
+   bool validate(const Key& key);
+   /// Collect the space that is not used by valid images
+   void collectFreeSpace();
+   /// Release space. Requires the free lock
+   void freeBlock(uint64_t offset,uint64_t len);
+   /// Release space that may span chunks. Requires the free lock
+   void freeRange(uint64_t offset,uint64_t len);
+   /// Does another page use the same stored image? Requires the free lock
+   bool isShared(unsigned page) const;
+   /// Cleanup function of handed out images. Releases retired space once the last image is gone
+   static void unpin(void* pin);
+
+   PageCache(const PageCache&);
+   void operator=(const PageCache&);
+
+   public:
+   /// Constructor
+   PageCache();
+   /// Destructor
+   ~PageCache();
+
+   /// The default file name for a cache. Empty if there is no usable cache directory
+   static QString defaultFileName(const Key& key);
+
+   /// Open a cache file for images of up to largestImage bytes. Without a file name an anonymous file is used
+   bool open(const QString& fileName,const Key& key,unsigned pageCount,uint64_t largestImage);
+   /// Use a cache file that another process opened, e.g., in a worker process. Takes over the file descriptor. Only allocates new space
+   bool adopt(int fd);
+   /// Close the cache
+   void cleanup();
+   /// The file descriptor, e.g., to pass the cache to a worker process
+   int fileDescriptor() const { return fd; }
+
+   /// Limit the space used for full size pages. 0 means unlimited
+   void setImageBudget(uint64_t bytes);
+
+   // The following functions modify the cache. They may be called concurrently, but not for the same image
+
+   /// Allocate space for an image, ignoring the budget. Returns nullptr if the cache cannot grow
+   unsigned char* allocate(uint64_t len);
+   /// Allocate space for a full size page. Returns nullptr if the cache cannot grow or the budget is exhausted
+   unsigned char* allocateImage(uint64_t len);
+   /// Remember an image that was written into allocated space
+   void store(unsigned page,const QImage& image);
+   /// Remember a compressed image that was written into allocated space
+   void storeCompressed(unsigned page,const unsigned char* data,uint64_t len,const QSize& size);
+   /// Mark the image of a page as complete
+   void publish(unsigned page);
+   /// Let a page use the stored image of another page with the same content instead of storing a copy. The page must not hold an image.
+   /// Returns false if the other image is no longer available
+   bool share(unsigned page,unsigned from);
+   /// Drop the image of a page and release its space once no other page shares it and no image handed out for it is alive
+   void release(unsigned page);
+   /// Map the space of an image that another process stored through a shared mapping. Returns false if the image is not available
+   bool attach(unsigned page);
+
+   /// Is an image available?
+   bool isValid(unsigned page) const;
+   /// Does a page store exactly these pixels?
+   bool holds(unsigned page,const QImage& image) const;
+   /// Does a page store exactly this compressed image?
+   bool holds(unsigned page,const unsigned char* data,uint64_t len) const;
+   /// Is an image stored compressed?
+   bool isCompressed(unsigned page) const;
+   /// The size of a stored image
+   QSize imageSize(unsigned page) const;
+   /// Get a stored image. The image points into the cache, its space is not reused while the image or a copy of it is alive. The page must be valid
+   QImage image(unsigned page,double devicePixelRatio=1.0) const;
+   /// Get a stored compressed image. Returns nullptr if the image is not compressed
+   const unsigned char* compressedData(unsigned page,uint64_t& len) const;
+};
+//----------------------------------------------------------------------------
+#endif
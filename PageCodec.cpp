@@ -0,0 +1,172 @@
+#include "PageCodec.hpp"
+#include <QImage>
+#include <algorithm>
+#include <cstring>
+//----------------------------------------------------------------------------
+// The compressed format consists of 32 bit words. A header (width, height,
+// number of stripes) is followed by the end position of each stripe and the
+// stripes themselves. A stripe covers up to stripeRows rows and is encoded
+// independently, which allows for decoding all stripes in parallel. Within a
+// stripe the pixels are a sequence of operations, the upper two bits of each
+// operation word select the operation, the lower bits the number of pixels.
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+/// The operations
+enum : uint32_t { Literal = 0, Run = 1, Above = 2 };
+/// The position of the operation within an operation word
+static const unsigned opShift = 30;
+/// The maximum pixel count of an operation
+static const uint32_t maxCount = (1u<<opShift)-1;
+/// The minimum length of a run or a match with the previous row
+static const unsigned minMatch = 4;
+/// The number of rows per stripe
+static const unsigned stripeRows = 64;
+/// The size of the header
+static const unsigned headerWords = 3;
+//----------------------------------------------------------------------------
+static void flushLiteral(vector<uint32_t>& out,const uint32_t* pixels,unsigned from,unsigned to)
+   // Write pixels that could not be compressed
+{
+   if (from==to)
+      return;
+   out.push_back((Literal<<opShift)|(to-from));
+   out.insert(out.end(),pixels+from,pixels+to);
+}
+//----------------------------------------------------------------------------
+static void compressStripe(const uint32_t* pixels,unsigned count,unsigned width,vector<uint32_t>& out)
+   // Compress a stripe
+{
+   unsigned literalStart=0;
+   for (unsigned pos=0;pos<count;) {
+      // Find the longest run of identical pixels and the longest match with the row above
+      unsigned run=1;
+      while ((pos+run<count)&&(pixels[pos+run]==pixels[pos]))
+         ++run;
+      unsigned above=0;
+      if (pos>=width)
+         while ((pos+above<count)&&(pixels[pos+above]==pixels[pos+above-width]))
+            ++above;
+      if ((run<minMatch)&&(above<minMatch)) {
+         ++pos;
+         continue;
+      }
+
+      // Encode the better one
+      flushLiteral(out,pixels,literalStart,pos);
+      if (above>=run) {
+         out.push_back((Above<<opShift)|above);
+         pos+=above;
+      } else {
+         out.push_back((Run<<opShift)|run);
+         out.push_back(pixels[pos]);
+         pos+=run;
+      }
+      literalStart=pos;
+   }
+   flushLiteral(out,pixels,literalStart,count);
+}
+//----------------------------------------------------------------------------
+static bool decompressStripe(const uint32_t* reader,const uint32_t* limit,uint32_t* pixels,unsigned count,unsigned width)
+   // Decompress a stripe
+{
+   unsigned pos=0;
+   while (reader<limit) {
+      uint32_t op=(*reader)>>opShift,n=(*reader)&maxCount;
+      ++reader;
+      if (n>count-pos)
+         return false;
+      switch (op) {
+         case Literal:
+            if (static_cast<uint64_t>(limit-reader)<n)
+               return false;
+            memcpy(pixels+pos,reader,n*sizeof(uint32_t));
+            reader+=n;
+            break;
+         case Run:
+            if (reader==limit)
+               return false;
+            fill(pixels+pos,pixels+pos+n,*reader);
+            ++reader;
+            break;
+         case Above:
+            if (pos<width)
+               return false;
+            if (n<=width) {
+               memcpy(pixels+pos,pixels+pos-width,n*sizeof(uint32_t));
+            } else {
+               for (unsigned index=0;index<n;index++)
+                  pixels[pos+index]=pixels[pos+index-width];
+            }
+            break;
+         default:
+            return false;
+      }
+      pos+=n;
+   }
+   return pos==count;
+}
+//----------------------------------------------------------------------------
+void PageCodec::compress(const QImage& image,vector<unsigned char>& result)
+   // Compress an RGB32 image
+{
+   unsigned width=image.width(),height=image.height();
+   unsigned stripes=(height+stripeRows-1)/stripeRows;
+
+   vector<uint32_t> out;
+   out.reserve(headerWords+stripes+(static_cast<size_t>(width)*height/8));
+   out.push_back(width);
+   out.push_back(height);
+   out.push_back(stripes);
+   out.resize(headerWords+stripes);
+
+   vector<uint32_t> packed;
+   for (unsigned stripe=0;stripe<stripes;stripe++) {
+      unsigned from=stripe*stripeRows,rows=min(stripeRows,height-from);
+      const uint32_t* pixels;
+      if (static_cast<unsigned>(image.bytesPerLine())==width*sizeof(uint32_t)) {
+         pixels=reinterpret_cast<const uint32_t*>(image.constScanLine(from));
+      } else {
+         packed.resize(static_cast<size_t>(rows)*width);
+         for (unsigned row=0;row<rows;row++)
+            memcpy(packed.data()+(row*width),image.constScanLine(from+row),width*sizeof(uint32_t));
+         pixels=packed.data();
+      }
+      compressStripe(pixels,rows*width,width,out);
+      out[headerWords+stripe]=out.size();
+   }
+
+   result.resize(out.size()*sizeof(uint32_t));
+   memcpy(result.data(),out.data(),result.size());
+}
+//----------------------------------------------------------------------------
+bool PageCodec::decompress(const unsigned char* data,uint64_t len,QImage& image)
+   // Decompress an image
+{
+   if ((len<headerWords*sizeof(uint32_t))||(len%sizeof(uint32_t))||(reinterpret_cast<uintptr_t>(data)%sizeof(uint32_t)))
+      return false;
+   const uint32_t* words=reinterpret_cast<const uint32_t*>(data);
+   uint64_t wordCount=len/sizeof(uint32_t);
+   unsigned width=words[0],height=words[1],stripes=words[2];
+   if ((!width)||(!height)||(stripes!=(height+stripeRows-1)/stripeRows)||(headerWords+stripes>wordCount))
+      return false;
+
+   // Prepare the target
+   if ((static_cast<unsigned>(image.width())!=width)||(static_cast<unsigned>(image.height())!=height)||(image.format()!=QImage::Format_RGB32))
+      image=QImage(width,height,QImage::Format_RGB32);
+   if (image.isNull()||(static_cast<unsigned>(image.bytesPerLine())!=width*sizeof(uint32_t)))
+      return false;
+   uint32_t* pixels=reinterpret_cast<uint32_t*>(image.bits());
+
+   // Decode all stripes in parallel
+   bool ok=true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+   for (unsigned stripe=0;stripe<stripes;stripe++) {
+      uint64_t begin=stripe?words[headerWords+stripe-1]:(headerWords+stripes),end=words[headerWords+stripe];
+      unsigned from=stripe*stripeRows,rows=min(stripeRows,height-from);
+      if ((begin>end)||(end>wordCount)||(!decompressStripe(words+begin,words+end,pixels+(static_cast<size_t>(from)*width),rows*width,width)))
+         ok=false;
+   }
+   return ok;
+}
+//----------------------------------------------------------------------------
@@ -0,0 +1,19 @@
+#ifndef H_PageCodec
+#define H_PageCodec
+//----------------------------------------------------------------------------
+#include <cstdint>
+#include <vector>
+//----------------------------------------------------------------------------
+class QImage;
+//----------------------------------------------------------------------------
+/// A fast lossless codec for rendered slides. Encodes pixel runs and repeated rows
+class PageCodec
+{
+   public:
+   /// Compress an RGB32 image
+   static void compress(const QImage& image,std::vector<unsigned char>& result);
+   /// Decompress an image. Returns false if the data is corrupt
+   static bool decompress(const unsigned char* data,uint64_t len,QImage& image);
+};
+//----------------------------------------------------------------------------
+#endif
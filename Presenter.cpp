@@ -1,27 +1,73 @@
 #include "Presenter.hpp"
+#include "ImageKernels.hpp"
 #include "Renderer.hpp"
+#include "Trace.hpp"
 #include "View.hpp"
+#include <QFont>
+#include <QFile>
+#include <QFileInfo>
+#include <QGuiApplication>
 #include <QPainter>
+#include <QScreen>
+#include <poppler/qt5/poppler-qt5.h>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 //----------------------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------------------
+/// Time to wait for further screen changes before reconfiguring
+static const unsigned screenSettleDelay = 500;
+/// Time to wait for further writes to the document file before reloading it
+static const unsigned fileSettleDelay = 1000;
+/// The maximum magnification level. Each level magnifies by sqrt(2)
+static const unsigned maxZoomLevel = 6;
+/// The number of pages each view keeps converted for the display: the current page and its neighbors
+static const unsigned pixmapsPerView = 3;
+/// The minimum width of overview cells. Larger decks scroll instead of shrinking the thumbnails further
+static const unsigned minThumbWidth = 320;
+/// The number of overview rows above and below the visible ones whose thumbnails are rendered ahead of scrolling
+static const unsigned thumbPrefetchRows = 2;
+/// The number of scaled down pages each view keeps for the presenter console
+static const unsigned consolePixmapsPerView = 4;
+/// The share of the presenter console width that shows the current page
+static const double consoleCurrentShare = 0.62;
+//----------------------------------------------------------------------------
 Presenter::Presenter(Renderer& renderer,unsigned pageCount)
-   : renderer(renderer),lineWidth(3),lineColor(Qt::black),mode(Normal),page(0),showTimer(false)
+   : renderer(renderer),overviewTop(0),standInPage(~0u),lineWidth(3),lineColor(Qt::black),mode(Normal),page(0),zoomLevel(0),zoomCenter(0.5,0.5),showTimer(false),console(false)
    // Constructor
 {
-   // Compute the appropriate thumbnail sizes
-   thumbX=1;
-   while ((thumbX*thumbX)<pageCount)
-      thumbX++;
-   thumbY=thumbX;
-   thumbSize=QSize(screens.common().width()/thumbX-10,screens.common().height()/thumbY-10);
-   thumbSpacing=QSize(screens.common().width()/thumbX,screens.common().height()/thumbY);
+   layoutThumbnails(pageCount);
 
    connect(&renderer, SIGNAL(pageRendered(unsigned)), this, SLOT(pageChanged(unsigned)));
+   connect(&renderer, SIGNAL(tileRendered(unsigned)), this, SLOT(tileChanged(unsigned)));
+   connect(&renderer, SIGNAL(thumbnailRendered(unsigned)), this, SLOT(thumbnailChanged(unsigned)));
+   connect(&renderer, SIGNAL(reloadPrepared()), this, SLOT(finishReload()));
+   connect(&renderer, SIGNAL(fingerprintsReady()), this, SLOT(matchAnnotations()));
    connect(&timer, SIGNAL(timeout()), this, SLOT(tick()));
+
+   // Screens come and go during a talk, e.g. when the projector is plugged in late
+   screenTimer.setSingleShot(true);
+   screenTimer.setInterval(screenSettleDelay);
+   connect(&screenTimer, SIGNAL(timeout()), this, SLOT(reconfigureScreens()));
+   connect(QGuiApplication::instance(), SIGNAL(screenAdded(QScreen*)), this, SLOT(screensChanged()));
+   connect(QGuiApplication::instance(), SIGNAL(screenRemoved(QScreen*)), this, SLOT(screensChanged()));
+   watchScreens();
+
+   // A rebuilt document is written in several steps
+   reloadTimer.setSingleShot(true);
+   reloadTimer.setInterval(fileSettleDelay);
+   connect(&reloadTimer, SIGNAL(timeout()), this, SLOT(reloadDocument()));
+   connect(&watcher, SIGNAL(fileChanged(QString)), this, SLOT(fileChanged()));
+   connect(&watcher, SIGNAL(directoryChanged(QString)), this, SLOT(fileChanged()));
+
+   // The neighbors are converted after the current page is shown
+   pixmapTimer.setSingleShot(true);
+   pixmapTimer.setInterval(0);
+   connect(&pixmapTimer, SIGNAL(timeout()), this, SLOT(preparePixmaps()));
 }
 //----------------------------------------------------------------------------
 static void printMinutes(unsigned seconds)
@@ -33,6 +79,11 @@ static void printMinutes(unsigned seconds)
 Presenter::~Presenter()
    // Destructor
 {
+   // Store strokes that are still being drawn
+   for (auto& s:scribbles)
+      s.second.finishStroke();
+   journal.close();
+
    // Show timing at the end
    if (!slidesLog.empty()) {
       slidesLog.push_back(pair<unsigned,unsigned>(~0u,time(0)));
@@ -52,19 +103,103 @@ Presenter::~Presenter()
    }
 }
 //----------------------------------------------------------------------------
+bool Presenter::setJournal(const QString& fileName)
+   // Store the annotations of pages in a file
+{
+   if (!journal.open(fileName))
+      return false;
+   annotated=journal.getFingerprints();
+   return true;
+}
+//----------------------------------------------------------------------------
+void Presenter::watchFile(const QString& fileName)
+   // Reload the document when its file changes
+{
+   this->fileName=fileName;
+   // Watch the directory, too. Replacing the file ends the watch of the file
+   watcher.addPath(fileName);
+   watcher.addPath(QFileInfo(fileName).absolutePath());
+   renderer.startFingerprints();
+}
+//----------------------------------------------------------------------------
 void Presenter::setProfile(const vector<unsigned>& profile)
    // Set a presentation profile
 {
    this->profile=profile;
 }
 //----------------------------------------------------------------------------
+void Presenter::layoutThumbnails(unsigned pageCount)
+   // Compute the thumbnail layout for the first screen
+{
+   // As many visible rows as columns, the cells keep the aspect ratio of the screen
+   QRect overviewArea=screens.screen(0).target;
+   unsigned maxColumns=max<unsigned>(overviewArea.width()/minThumbWidth,1);
+   thumbX=1;
+   while (((thumbX*thumbX)<pageCount)&&(thumbX<maxColumns))
+      thumbX++;
+   thumbY=thumbX;
+   thumbRows=max<unsigned>((pageCount+thumbX-1)/thumbX,1);
+   thumbSize=QSize(overviewArea.width()/thumbX-10,overviewArea.height()/thumbY-10);
+   thumbSpacing=QSize(overviewArea.width()/thumbX,overviewArea.height()/thumbY);
+   overviewTop=min(overviewTop,thumbRows-min(thumbRows,thumbY));
+   revealPage();
+}
+//----------------------------------------------------------------------------
+QSize Presenter::thumbnailSize() const
+   // The size of thumbnails in device pixels of the first screen
+{
+   qreal ratio=screens.resolution(screens.screen(0).resolution).devicePixelRatio;
+   return QSize(thumbSize.width()*ratio,thumbSize.height()*ratio);
+}
+//----------------------------------------------------------------------------
+bool Presenter::revealPage()
+   // Scroll the overview so that the current page is visible
+{
+   unsigned row=page/thumbX,top=overviewTop;
+   if (row<overviewTop)
+      overviewTop=row;
+   if (row>=overviewTop+thumbY)
+      overviewTop=row-thumbY+1;
+   return overviewTop!=top;
+}
+//----------------------------------------------------------------------------
+void Presenter::requestThumbnails()
+   // Request the thumbnails of the visible overview rows and their neighbors
+{
+   vector<unsigned> pages;
+   if (mode==Overview) {
+      unsigned pageCount=renderer.getPageCount();
+      auto addRow=[&](unsigned row) {
+         for (unsigned index=row*thumbX;(index<(row+1)*thumbX)&&(index<pageCount);index++)
+            pages.push_back(index);
+      };
+      // The visible rows first, then the rows around them, nearest first
+      unsigned bottom=min(overviewTop+thumbY,thumbRows);
+      for (unsigned row=overviewTop;row<bottom;row++)
+         addRow(row);
+      for (unsigned distance=1;distance<=thumbPrefetchRows;distance++) {
+         if (bottom+distance-1<thumbRows)
+            addRow(bottom+distance-1);
+         if (overviewTop>=distance)
+            addRow(overviewTop-distance);
+      }
+   }
+   renderer.requestThumbnails(pages,thumbnailSize());
+}
+//----------------------------------------------------------------------------
+void Presenter::placeView(View* view,unsigned index)
+   // Place a view on its screen
+{
+   view->move(screens.screen(index).geometry.topLeft());
+   view->resize(screens.screen(index).geometry.width(),screens.screen(index).geometry.height());
+}
+//----------------------------------------------------------------------------
 void Presenter::createViews()
    // Create a full screen view on each screen
 {
-   for (unsigned index=0;index<screens.screenCount();index++) {
-      View* v=new View(*this,screens.screen(index).target);
-      v->move(screens.screen(index).geometry.topLeft());
-      v->resize(screens.screen(index).geometry.width(),screens.screen(index).geometry.height());
+   for (unsigned index=views.size();index<screens.screenCount();index++) {
+      View* v=new View(*this,screens.screen(index).target,screens.screen(index).resolution);
+      placeView(v,index);
       if (!index)
          v->activateWindow();
       v->show();
@@ -72,29 +207,279 @@ void Presenter::createViews()
    }
 }
 //----------------------------------------------------------------------------
+void Presenter::watchScreens()
+   // Follow geometry changes of all screens
+{
+   for (auto screen:QGuiApplication::screens())
+      connect(screen, SIGNAL(geometryChanged(QRect)), this, SLOT(screensChanged()), Qt::UniqueConnection);
+}
+//----------------------------------------------------------------------------
+bool Presenter::isConsole(View* view) const
+   // Does a view show the presenter console?
+{
+   // The overview takes precedence, a single screen always shows the slides
+   return console&&(mode!=Overview)&&(views.size()>1)&&(view==views.front());
+}
+//----------------------------------------------------------------------------
+View* Presenter::slideView() const
+   // The view that shows the slides and follows the magnification
+{
+   return isConsole(views.front())?views[1]:views.front();
+}
+//----------------------------------------------------------------------------
 Scribble* Presenter::getCurrentScribble(bool createIfNeeded)
    // Get the current scribble (if any)
 {
    switch (mode) {
       case Overview: return nullptr;
-      case Normal:
-         if (scribbles.count(page)||createIfNeeded) {
-            return &(scribbles[page]);
-         } else return nullptr;
+      case Normal: {
+         auto iter=scribbles.find(page);
+         if (iter==scribbles.end()) {
+            if ((!createIfNeeded)&&(!journal.hasRecords(page)))
+               return nullptr;
+
+            // Restore stored annotations, then store new strokes
+            Scribble& scribble=scribbles[page];
+            journal.replay(page,scribble,journalReference());
+            recordStrokes(page,scribble);
+            return &scribble;
+         }
+         return &(iter->second);
+      }
       case Black: return nullptr;
       case White: return &scratchScribble;
    }
    throw; // unreachable
 }
 //----------------------------------------------------------------------------
+void Presenter::recordStrokes(unsigned index,Scribble& scribble)
+   // Store the strokes drawn on a page
+{
+   scribble.onStrokeFinished([this,index](const Scribble::StrokeData& stroke) { journal.recordStroke(index,journalReference(),stroke); });
+}
+//----------------------------------------------------------------------------
+unsigned Presenter::journalReference() const
+   // The width of the scribble coordinate space
+{
+   return views.empty()?0:fitRect(views.front()).width();
+}
+//----------------------------------------------------------------------------
+QImage Presenter::fallbackPage(unsigned index) const
+   // The best image of a page that is not rendered for a resolution yet
+{
+   QImage img;
+   for (unsigned resolution=0;(resolution<screens.resolutionCount())&&(img.isNull());resolution++)
+      img=renderer.getPage(resolution,index);
+   if (img.isNull()&&(standInPage==index))
+      img=standIn;
+   if (img.isNull())
+      img=renderer.getPreview(index);
+   return img;
+}
+//----------------------------------------------------------------------------
+QSize Presenter::fitSize(View* view,unsigned index) const
+   // The size of a whole page within a view
+{
+   QSize size=renderer.getPageSize(view->resolution,index);
+   if (!size.isEmpty()) {
+      qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+      return QSize(size.width()/ratio,size.height()/ratio);
+   }
+   // Not rendered for this resolution yet, the page is shown scaled to fit like paintPage does
+   QImage img=fallbackPage(index);
+   return img.isNull()?QSize():img.size().scaled(view->target.size(),Qt::KeepAspectRatio);
+}
+//----------------------------------------------------------------------------
+QRect Presenter::fitRect(View* view) const
+   // The area of the whole current page within a view
+{
+   QSize size=fitSize(view,page);
+   if (size.isEmpty())
+      return view->target;
+   return QRect(view->target.left()+(view->target.width()-size.width())/2,view->target.top()+(view->target.height()-size.height())/2,size.width(),size.height());
+}
+//----------------------------------------------------------------------------
+QSize Presenter::zoomedSize(View* view) const
+   // The size of the magnified current page in device pixels
+{
+   QSize size=renderer.getPageSize(view->resolution,page);
+   if ((!zoomLevel)||(size.isEmpty())||isConsole(view))
+      return QSize();
+   double zoom=pow(2.0,zoomLevel/2.0);
+   return QSize(size.width()*zoom,size.height()*zoom);
+}
+//----------------------------------------------------------------------------
+QRect Presenter::pageRect(View* view) const
+   // The area of the current page within a view
+{
+   // The console shows the whole page in its own area
+   if (isConsole(view))
+      return consoleSlideRect(view,page,0);
+   QSize size=zoomedSize(view);
+   if (size.isEmpty())
+      return fitRect(view);
+
+   // Center the zoom center, but do not scroll beyond the page border
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   const QRect& target=view->target;
+   double width=size.width()/ratio,height=size.height()/ratio;
+   double left=target.left()+(target.width()/2.0)-(zoomCenter.x()*width);
+   double top=target.top()+(target.height()/2.0)-(zoomCenter.y()*height);
+   if (width>target.width())
+      left=max(min<double>(left,target.left()),target.left()+target.width()-width); else
+      left=target.left()+(target.width()-width)/2;
+   if (height>target.height())
+      top=max(min<double>(top,target.top()),target.top()+target.height()-height); else
+      top=target.top()+(target.height()-height)/2;
+   return QRect(floor(left),floor(top),width,height);
+}
+//----------------------------------------------------------------------------
+double Presenter::scribbleScale(View* view) const
+   // The scale from scribble coordinates to view coordinates
+{
+   // Scribbles are kept in the coordinates of the whole page in the first view
+   QRect reference=fitRect(views.front()),area=pageRect(view);
+   if (reference.isEmpty())
+      return 1.0;
+   return static_cast<double>(area.width())/reference.width();
+}
+//----------------------------------------------------------------------------
+void Presenter::updateInk(View* view,Scribble& scribble)
+   // Bring the rasterized scribble of a view up to date
+{
+   QRect area=pageRect(view);
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   QSize size(view->target.width()*ratio,view->target.height()*ratio);
+   bool full=(view->ink.size()!=size)||(view->inkScribble!=&scribble)||(view->inkRevision!=scribble.getRevision())||(view->inkArea!=area);
+   if ((!full)&&(view->inkPoints==scribble.fixedCount()))
+      return;
+
+   // Start over if lines were removed or the page moved
+   if (view->ink.size()!=size) {
+      view->ink=QImage(size,QImage::Format_ARGB32_Premultiplied);
+      view->ink.setDevicePixelRatio(ratio);
+   }
+   if (full)
+      view->ink.fill(Qt::transparent);
+
+   // Draw the missing lines. The end of an open stroke still moves, it is drawn directly
+   double scale=scribbleScale(view);
+   QPainter painter(&view->ink);
+   painter.setRenderHint(QPainter::Antialiasing);
+   painter.translate(area.left()-view->target.left(),area.top()-view->target.top());
+   painter.scale(scale,scale);
+   scribble.paint(painter,QRect(0,0,area.width(),area.height()),full?0:view->inkPoints,scribble.fixedCount());
+
+   view->inkScribble=&scribble;
+   view->inkRevision=scribble.getRevision();
+   view->inkPoints=scribble.fixedCount();
+   view->inkArea=area;
+}
+//----------------------------------------------------------------------------
+void Presenter::paintScribble(QPainter& painter,View* view,Scribble& scribble)
+   // Draw a scribble scaled to a view
+{
+   // Only the dirty part of the view is blended, the clip region limits it
+   updateInk(view,scribble);
+   painter.drawImage(view->target.topLeft(),view->ink);
+
+   // The end of the open stroke
+   if (scribble.fixedCount()<scribble.pointCount()) {
+      QRect area=pageRect(view);
+      double scale=scribbleScale(view);
+      painter.save();
+      painter.setRenderHint(QPainter::Antialiasing);
+      painter.translate(area.left(),area.top());
+      painter.scale(scale,scale);
+      scribble.paint(painter,QRect(0,0,area.width(),area.height()),scribble.fixedCount());
+      painter.restore();
+   }
+}
+//----------------------------------------------------------------------------
+QRect Presenter::scribbleToView(View* view,const QRect& rect) const
+   // Map a rectangle in scribble coordinates to view coordinates
+{
+   QRect area=pageRect(view);
+   double scale=scribbleScale(view);
+   return QRect(area.left()+(rect.left()*scale)-1,area.top()+(rect.top()*scale)-1,(rect.width()*scale)+3,(rect.height()*scale)+3);
+}
+//----------------------------------------------------------------------------
+const QPixmap& Presenter::pagePixmap(View* view,unsigned index,const QImage& img)
+   // The display copy of a rendered page of a view
+{
+   // Drawing a QImage converts and uploads it on every paint, a pixmap is converted once
+   auto& cache=view->pixmaps;
+   auto distance=[this](unsigned other) { return (other>page)?(other-page):(page-other); };
+   auto iter=find_if(cache.begin(),cache.end(),[index](const View::PagePixmap& p) { return p.page==index; });
+   if (iter==cache.end()) {
+      if (cache.size()<pixmapsPerView) {
+         iter=cache.insert(cache.end(),View::PagePixmap{index,0,QPixmap()});
+      } else {
+         iter=max_element(cache.begin(),cache.end(),[&distance](const View::PagePixmap& a,const View::PagePixmap& b) { return distance(a.page)<distance(b.page); });
+         iter->page=index;
+         iter->key=0;
+      }
+   }
+   if ((iter->key!=img.cacheKey())||iter->pixmap.isNull()) {
+      Trace::Span span("convert pixmap");
+      iter->pixmap=QPixmap::fromImage(img);
+      iter->key=img.cacheKey();
+      if (index==page)
+         pixmapTimer.start();
+   }
+   return iter->pixmap;
+}
+//----------------------------------------------------------------------------
+void Presenter::preparePixmaps()
+   // Convert the neighbors of the current page for the display
+{
+   // Scale the pages of the presenter console down once the other views are painted
+   for (auto view:views) {
+      if (!isConsole(view))
+         continue;
+      for (unsigned part=0;(part<2)&&(page+part<renderer.getPageCount());part++) {
+         QImage img=consoleSource(view,page+part);
+         QRect area=consoleSlideRect(view,page+part,part);
+         if (img.isNull()||consolePixmap(view,page+part,img,area.size(),false))
+            continue;
+         consolePixmap(view,page+part,img,area.size(),true);
+         view->update(area);
+      }
+   }
+
+   if ((mode!=Normal)||zoomLevel)
+      return;
+   for (auto view:views) {
+      if (isConsole(view))
+         continue;
+      for (unsigned index:{page+1,page-1}) {
+         QImage img=renderer.getPage(view->resolution,index);
+         if (!img.isNull())
+            pagePixmap(view,index,img);
+      }
+   }
+}
+//----------------------------------------------------------------------------
 void Presenter::paintPage(QPainter& painter,View* view)
    // Draw the current page
 {
    // Rendet the PDF page
    painter.fillRect(painter.viewport(),QBrush(Qt::black));
-   QImage* img=renderer.getPage(page);
-   if (img)
-      painter.drawImage(view->target.topLeft(),*img);
+   QImage img=renderer.getPage(view->resolution,page);
+   if ((!img.isNull())&&zoomLevel) {
+      paintZoomed(painter,view);
+   } else if (!img.isNull()) {
+      painter.drawPixmap(pageRect(view).topLeft(),pagePixmap(view,page,img));
+   } else {
+      // Not rendered for this resolution yet. Scale whatever is available instead, down to the preview
+      img=fallbackPage(page);
+      if (!img.isNull()) {
+         QSize size=img.size().scaled(view->target.size(),Qt::KeepAspectRatio);
+         QRect area(view->target.left()+(view->target.width()-size.width())/2,view->target.top()+(view->target.height()-size.height())/2,size.width(),size.height());
+         painter.setRenderHint(QPainter::SmoothPixmapTransform);
+         painter.drawImage(area,img);
+      }
+   }
 
    // Timer functionality
    if (showTimer&&(view==views.front())) {
@@ -126,22 +511,281 @@ void Presenter::paintPage(QPainter& painter,View* view)
    }
 }
 //----------------------------------------------------------------------------
+QRect Presenter::consoleArea(View* view,unsigned part) const
+   // The parts of the presenter console
+{
+   // The current page on the left, the next page and the timer stacked on the right
+   const QRect& target=view->target;
+   int margin=target.height()/40,split=target.width()*consoleCurrentShare;
+   int right=target.left()+split+margin,rightWidth=target.left()+target.width()-margin-right,half=target.height()/2;
+   switch (part) {
+      case 0: return QRect(target.left()+margin,target.top()+margin,split-margin,target.height()-2*margin);
+      case 1: return QRect(right,target.top()+margin,rightWidth,half-2*margin);
+      default: return QRect(right,target.top()+half,rightWidth,half-margin);
+   }
+}
+//----------------------------------------------------------------------------
+QRect Presenter::consoleSlideRect(View* view,unsigned index,unsigned part) const
+   // The area of a page within a part of the presenter console
+{
+   QRect area=consoleArea(view,part);
+   QSize size=renderer.getPageSize(view->resolution,index);
+   if (size.isEmpty())
+      size=consoleSource(view,index).size();
+   if (size.isEmpty())
+      return area;
+   size=size.scaled(area.size(),Qt::KeepAspectRatio);
+   return QRect(area.left()+(area.width()-size.width())/2,area.top()+(area.height()-size.height())/2,size.width(),size.height());
+}
+//----------------------------------------------------------------------------
+QImage Presenter::consoleSource(View* view,unsigned index) const
+   // The best available image of a page for the presenter console
+{
+   // Prefer the page rendered for the screen of the console, then anything else that is already there
+   QImage img=renderer.getPage(view->resolution,index);
+   for (unsigned resolution=0;(resolution<screens.resolutionCount())&&(img.isNull());resolution++)
+      img=renderer.getPage(resolution,index);
+   if (img.isNull()&&(standInPage==index))
+      img=standIn;
+   if (img.isNull())
+      img=renderer.getPreview(index);
+   if (img.isNull())
+      img=renderer.getThumbnail(index,thumbnailSize());
+   return img;
+}
+//----------------------------------------------------------------------------
+const QPixmap* Presenter::consolePixmap(View* view,unsigned index,const QImage& img,const QSize& size,bool create)
+   // The scaled down copy of a page for the presenter console
+{
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   QSize deviceSize(size.width()*ratio,size.height()*ratio);
+   auto& cache=view->consolePixmaps;
+   auto iter=find_if(cache.begin(),cache.end(),[&](const View::PagePixmap& p) { return (p.page==index)&&(p.pixmap.size()==deviceSize); });
+   if ((iter!=cache.end())&&(iter->key==img.cacheKey()))
+      return &(iter->pixmap);
+   if (!create)
+      return nullptr;
+
+   // Replace an outdated copy, or the copy furthest from the current page
+   if (iter==cache.end()) {
+      auto distance=[this](unsigned other) { return (other>page)?(other-page):(page-other); };
+      if (cache.size()<consolePixmapsPerView) {
+         iter=cache.insert(cache.end(),View::PagePixmap{index,0,QPixmap()});
+      } else {
+         iter=max_element(cache.begin(),cache.end(),[&distance](const View::PagePixmap& a,const View::PagePixmap& b) { return distance(a.page)<distance(b.page); });
+      }
+   }
+   Trace::Span span("scale console page");
+   QImage scaled=img.scaled(deviceSize,Qt::IgnoreAspectRatio,Qt::SmoothTransformation);
+   scaled.setDevicePixelRatio(ratio);
+   iter->page=index;
+   iter->key=img.cacheKey();
+   iter->pixmap=QPixmap::fromImage(scaled);
+   return &(iter->pixmap);
+}
+//----------------------------------------------------------------------------
+void Presenter::paintConsole(QPainter& painter,View* view)
+   // Draw the presenter console
+{
+   Trace::Span span("paint console");
+   painter.fillRect(painter.viewport(),QBrush(Qt::black));
+
+   // The current and the next page. Until the scaled copies exist the pages are scaled while drawing, the copies are made once all views are painted
+   unsigned pageCount=renderer.getPageCount();
+   for (unsigned part=0;(part<2)&&(page+part<pageCount);part++) {
+      QImage img=consoleSource(view,page+part);
+      if (img.isNull())
+         continue;
+      QRect area=consoleSlideRect(view,page+part,part);
+      if (const QPixmap* pixmap=consolePixmap(view,page+part,img,area.size(),false)) {
+         painter.drawPixmap(area.topLeft(),*pixmap);
+      } else {
+         painter.drawImage(area,img);
+         pixmapTimer.start();
+      }
+   }
+   if (mode==Normal)
+      if (auto scribble=getCurrentScribble())
+         paintScribble(painter,view,*scribble);
+
+   // The elapsed time and the page
+   QRect info=consoleArea(view,2);
+   unsigned duration=slidesLog.empty()?0:(time(0)-slidesLog.front().second);
+   char buffer[50];
+   QFont font=painter.font();
+   painter.setPen(Qt::white);
+   snprintf(buffer,sizeof(buffer),"%u:%02u",duration/60,duration%60);
+   font.setPixelSize(info.height()/4);
+   painter.setFont(font);
+   painter.drawText(info,Qt::AlignLeft|Qt::AlignTop,buffer);
+   snprintf(buffer,sizeof(buffer),"%u / %u",page+1,pageCount);
+   font.setPixelSize(info.height()/10);
+   painter.setFont(font);
+   painter.drawText(info,Qt::AlignRight|Qt::AlignTop,buffer);
+   if ((mode==Black)||(mode==White))
+      painter.drawText(info,Qt::AlignRight|Qt::AlignVCenter,(mode==Black)?"audience sees black":"audience sees white");
+
+   // The progress against the profile: the expected time at the end of this page, and the elapsed time
+   if (!profile.empty()) {
+      unsigned maxDuration=max(profile.back(),1u);
+      unsigned showDuration=min(duration,maxDuration);
+      unsigned expectedDuration=(page<profile.size())?min(profile[page],maxDuration):maxDuration;
+      int barHeight=info.height()/12;
+      painter.setPen(Qt::black);
+      painter.setBrush(Qt::white);
+      painter.drawRect(info.left(),info.bottom()-3*barHeight,(info.width()*expectedDuration)/maxDuration,barHeight);
+      painter.setBrush((duration>expectedDuration)?Qt::red:Qt::green);
+      painter.drawRect(info.left(),info.bottom()-barHeight,(info.width()*showDuration)/maxDuration,barHeight);
+   }
+}
+//----------------------------------------------------------------------------
+void Presenter::collectTiles(View* view,vector<TileCache::Tile>& tiles)
+   // Collect the tiles of the magnified page that a view needs
+{
+   QSize size=zoomedSize(view);
+   if (size.isEmpty())
+      return;
+
+   // The visible part of the page in device pixels, plus one tile around it
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   QRect area=pageRect(view),visible=view->target.intersected(area).translated(-area.topLeft());
+   int T=TileCache::tileSize;
+   QRect visibleTiles(QPoint((visible.left()*ratio)/T,(visible.top()*ratio)/T),QPoint((visible.right()*ratio)/T,(visible.bottom()*ratio)/T));
+   int fromX=max(visibleTiles.left()-1,0),toX=min(visibleTiles.right()+1,(size.width()-1)/T);
+   int fromY=max(visibleTiles.top()-1,0),toY=min(visibleTiles.bottom()+1,(size.height()-1)/T);
+
+   // Visible tiles first, each group from the center outwards
+   double cx=(visible.center().x()*ratio)/T,cy=(visible.center().y()*ratio)/T;
+   vector<pair<double,TileCache::Tile>> order;
+   for (int y=fromY;y<=toY;y++)
+      for (int x=fromX;x<=toX;x++) {
+         double distance=(x+0.5-cx)*(x+0.5-cx)+(y+0.5-cy)*(y+0.5-cy);
+         if (!visibleTiles.contains(x,y))
+            distance+=1e9;
+         order.push_back({distance,TileCache::Tile{page,size,static_cast<unsigned>(x),static_cast<unsigned>(y)}});
+      }
+   stable_sort(order.begin(),order.end(),[](const pair<double,TileCache::Tile>& a,const pair<double,TileCache::Tile>& b) { return a.first<b.first; });
+   for (auto& o:order)
+      tiles.push_back(o.second);
+}
+//----------------------------------------------------------------------------
+void Presenter::requestTiles()
+   // Request the tiles of all views
+{
+   vector<TileCache::Tile> tiles;
+   if (mode==Normal)
+      for (auto view:views)
+         collectTiles(view,tiles);
+   renderer.requestTiles(tiles);
+}
+//----------------------------------------------------------------------------
+void Presenter::paintZoomed(QPainter& painter,View* view)
+   // Draw the magnified current page
+{
+   Trace::Span span("paint zoomed");
+   QSize size=zoomedSize(view);
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   QRect area=pageRect(view),visible=view->target.intersected(area);
+   if (visible.isEmpty())
+      return;
+   painter.save();
+   painter.setClipRect(visible,Qt::IntersectClip);
+
+   // Show the whole page scaled up until the tiles are there
+   QImage img=renderer.getPage(view->resolution,page);
+   double zoom=static_cast<double>(size.width())/img.width();
+   QRectF source(((visible.left()-area.left())*ratio)/zoom,((visible.top()-area.top())*ratio)/zoom,(visible.width()*ratio)/zoom,(visible.height()*ratio)/zoom);
+   painter.setRenderHint(QPainter::SmoothPixmapTransform);
+   painter.drawImage(QRectF(visible),img,source);
+
+   // Draw all tiles that are available
+   int T=TileCache::tileSize;
+   QRect pixels((visible.left()-area.left())*ratio,(visible.top()-area.top())*ratio,visible.width()*ratio,visible.height()*ratio);
+   for (int y=pixels.top()/T;(y<=pixels.bottom()/T)&&(y*T<size.height());y++)
+      for (int x=pixels.left()/T;(x<=pixels.right()/T)&&(x*T<size.width());x++) {
+         QImage tile=renderer.getTile(TileCache::Tile{page,size,static_cast<unsigned>(x),static_cast<unsigned>(y)});
+         if (!tile.isNull())
+            painter.drawImage(QRectF(area.left()+(x*T)/ratio,area.top()+(y*T)/ratio,tile.width()/ratio,tile.height()/ratio),tile);
+      }
+   painter.restore();
+}
+//----------------------------------------------------------------------------
+QRect Presenter::overviewCell(View* view,unsigned index) const
+   // The area of a page within the overview
+{
+   int x=index%thumbX,y=static_cast<int>(index/thumbX)-static_cast<int>(overviewTop);
+   return QRect(view->target.left()+(x*thumbSpacing.width()),view->target.top()+(y*thumbSpacing.height()),thumbSpacing.width(),thumbSpacing.height());
+}
+//----------------------------------------------------------------------------
+void Presenter::updateOverview(View* view)
+   // Bring the composited overview of a view up to date
+{
+   Trace::Span span("update overview");
+   // Allocate the visible part of the overview in device pixels. Starts over when scrolled
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   unsigned pageCount=renderer.getPageCount(),cells=thumbX*thumbY;
+   if (view->overview.isNull()) {
+      view->overview=QImage(thumbX*thumbSpacing.width()*ratio,thumbY*thumbSpacing.height()*ratio,QImage::Format_RGB32);
+      view->overview.setDevicePixelRatio(ratio);
+      view->overviewCells.clear();
+   }
+   if ((view->overviewCells.size()!=cells)||(view->overviewRow!=overviewTop)) {
+      view->overview.fill(Qt::black);
+      view->overviewCells.assign(cells,EmptyCell);
+      view->overviewRow=overviewTop;
+   }
+
+   // Composite all visible cells that changed. Only the current page is shown at full brightness
+   unsigned width=view->overview.width(),height=view->overview.height();
+   QSize size=thumbnailSize();
+   unsigned first=overviewTop*thumbX;
+   for (unsigned cell=0;(cell<cells)&&(first+cell<pageCount);cell++) {
+      unsigned index=first+cell;
+      OverviewCell wanted=(index==page)?HighlightedCell:DimmedCell;
+      if (view->overviewCells[cell]==wanted)
+         continue;
+      QImage img=renderer.getThumbnail(index,size);
+      if (img.isNull())
+         continue;
+      unsigned px=(cell%thumbX)*thumbSpacing.width()*ratio,py=(cell/thumbX)*thumbSpacing.height()*ratio;
+      if ((px>=width)||(py>=height))
+         continue;
+      unsigned w=min<unsigned>(img.width(),width-px),h=min<unsigned>(img.height(),height-py);
+      for (unsigned row=0;row<h;row++) {
+         const uint32_t* reader=reinterpret_cast<const uint32_t*>(img.constScanLine(row));
+         uint32_t* writer=reinterpret_cast<uint32_t*>(view->overview.scanLine(py+row))+px;
+         if (wanted==HighlightedCell)
+            memcpy(writer,reader,w*sizeof(uint32_t)); else
+            ImageKernels::dim(reader,writer,w);
+      }
+      view->overviewCells[cell]=wanted;
+   }
+}
+//----------------------------------------------------------------------------
+void Presenter::invalidateOverviewCell(unsigned index)
+   // Repaint a single overview cell
+{
+   if (index<renderer.getPageCount())
+      views.front()->update(overviewCell(views.front(),index));
+}
+//----------------------------------------------------------------------------
 void Presenter::paintOverview(QPainter& painter,View* view)
    // Draw the overview page
 {
+   Trace::Span span("paint overview");
+   updateOverview(view);
    painter.fillRect(painter.viewport(),QBrush(Qt::black));
-   for (unsigned index=0;index<renderer.getPageCount();index++) {
-      QImage* img=(index==page)?renderer.getThumbnailPage(index):renderer.getDarkThumbnailPage(index);
-      if (!img) continue;
-      unsigned x=index%thumbX,y=index/thumbX;
-      unsigned px=view->target.left()+(x*thumbSpacing.width()),py=view->target.top()+(y*thumbSpacing.height());
-      painter.drawImage(px,py,*img);
-   }
+   painter.drawImage(view->target.topLeft(),view->overview);
 }
 //----------------------------------------------------------------------------
 void Presenter::paint(QPainter& painter,View* view)
    // Draw the current state
 {
+   Trace::Span span("presenter paint");
+   if (isConsole(view)) {
+      paintConsole(painter,view);
+      return;
+   }
    switch (mode) {
       case Overview:
          if (view==views.front()) {
@@ -151,34 +795,24 @@ void Presenter::paint(QPainter& painter,View* view)
          // fallthrough
       case Normal:
          paintPage(painter,view);
-         if (auto scribble=getCurrentScribble()) {
-            painter.setRenderHint(QPainter::Antialiasing);
-            scribble->paint(painter,view->target);
-         }
+         if (auto scribble=getCurrentScribble())
+            paintScribble(painter,view,*scribble);
          break;
       case Black:
          painter.fillRect(painter.viewport(),QBrush(Qt::black));
          break;
       case White:
          painter.fillRect(painter.viewport(),QBrush(Qt::white));
-         if (auto scribble=getCurrentScribble()) {
-            painter.setRenderHint(QPainter::Antialiasing);
-            scribble->paint(painter,view->target);
-         }
+         if (auto scribble=getCurrentScribble())
+            paintScribble(painter,view,*scribble);
          break;
    }
 }
 //----------------------------------------------------------------------------
-QSize Presenter::presentationSize() const
-   // The size of the presentation area
+const vector<ScreenInfo::Resolution>& Presenter::renderResolutions() const
+   // The resolutions pages must be rendered for
 {
-   return QSize(screens.common().width(),screens.common().height());
-}
-//----------------------------------------------------------------------------
-QSize Presenter::thumbnailSize() const
-   // The size of thumbnails
-{
-   return thumbSize;
+   return screens.allResolutions();
 }
 //----------------------------------------------------------------------------
 void Presenter::invalidateViews()
@@ -192,10 +826,28 @@ void Presenter::goTo(unsigned page)
    // Go to a specific page
 {
    if (page!=this->page) {
+      // In the overview only the old and the new selection change
+      if (mode==Overview) {
+         invalidateOverviewCell(this->page);
+         invalidateOverviewCell(page);
+         for (unsigned index=1;index<views.size();index++)
+            views[index]->update();
+      } else {
+         invalidateViews();
+      }
       this->page=page;
+      if ((mode==Overview)&&revealPage()) {
+         views.front()->update();
+         requestThumbnails();
+      }
+      if (zoomLevel) {
+         zoomLevel=0;
+         zoomCenter=QPointF(0.5,0.5);
+         requestTiles();
+      }
+      renderer.setFocus(page);
       if (!slidesLog.empty())
          slidesLog.push_back(pair<unsigned,unsigned>(page,time(0)));
-      invalidateViews();
    }
 }
 //----------------------------------------------------------------------------
@@ -272,6 +924,7 @@ void Presenter::confirmPage()
 {
    if (mode!=Normal) {
       mode=Normal;
+      requestThumbnails();
       invalidateViews();
    } else {
       incPage(1);
@@ -302,6 +955,8 @@ void Presenter::toggleThumbnails()
    if (mode==Overview)
       mode=Normal; else
       mode=Overview;
+   revealPage();
+   requestThumbnails();
    invalidateViews();
 }
 //----------------------------------------------------------------------------
@@ -311,9 +966,10 @@ void Presenter::clicked(unsigned x,unsigned y)
    if (mode==Overview) {
       unsigned tx=x/thumbSpacing.width();
       unsigned ty=y/thumbSpacing.height();
-      unsigned p=tx+(thumbX*ty);
+      unsigned p=tx+(thumbX*(overviewTop+ty));
       if ((tx<thumbX)&&(ty<thumbY)&&(p<renderer.getPageCount())) {
          mode=Normal;
+         requestThumbnails();
          if (page!=p)
             goTo(p); else
             invalidateViews();
@@ -321,12 +977,107 @@ void Presenter::clicked(unsigned x,unsigned y)
    }
 }
 //----------------------------------------------------------------------------
+void Presenter::scrollOverview(int rows)
+   // Scroll the overview by a number of rows
+{
+   if (mode!=Overview)
+      return;
+   int maxTop=thumbRows-min(thumbRows,thumbY);
+   unsigned top=max(0,min(maxTop,static_cast<int>(overviewTop)+rows));
+   if (top!=overviewTop) {
+      overviewTop=top;
+      requestThumbnails();
+      views.front()->update();
+   }
+}
+//----------------------------------------------------------------------------
+void Presenter::zoomIn()
+   // Magnify the current page
+{
+   if (mode==Normal)
+      zoomAt(slideView(),slideView()->target.center(),1);
+}
+//----------------------------------------------------------------------------
+void Presenter::zoomOut()
+   // Reduce the magnification
+{
+   if (mode==Normal)
+      zoomAt(slideView(),slideView()->target.center(),-1);
+}
+//----------------------------------------------------------------------------
+void Presenter::resetZoom()
+   // Show the whole page again
+{
+   if (zoomLevel) {
+      zoomLevel=0;
+      zoomCenter=QPointF(0.5,0.5);
+      requestTiles();
+      invalidateViews();
+   }
+}
+//----------------------------------------------------------------------------
+void Presenter::zoomAt(View* view,QPoint pos,int steps)
+   // Change the magnification by a number of levels
+{
+   // The console shows the whole page, its wheel magnifies the slides around their center
+   if (isConsole(view)) {
+      view=slideView();
+      pos=view->target.center();
+   }
+   if ((mode!=Normal)||renderer.getPageSize(view->resolution,page).isEmpty())
+      return;
+   int level=max(0,min<int>(maxZoomLevel,static_cast<int>(zoomLevel)+steps));
+   if (static_cast<unsigned>(level)==zoomLevel)
+      return;
+
+   // Keep the page point below the position in place
+   QRect area=pageRect(view);
+   QPointF point((pos.x()-area.left())/static_cast<double>(area.width()),(pos.y()-area.top())/static_cast<double>(area.height()));
+   zoomLevel=level;
+   if (zoomLevel) {
+      area=pageRect(view);
+      zoomCenter=QPointF(point.x()-(pos.x()-(view->target.left()+view->target.width()/2.0))/area.width(),point.y()-(pos.y()-(view->target.top()+view->target.height()/2.0))/area.height());
+      clampZoomCenter();
+   } else {
+      zoomCenter=QPointF(0.5,0.5);
+   }
+   requestTiles();
+   invalidateViews();
+}
+//----------------------------------------------------------------------------
+void Presenter::pan(View* view,int dx,int dy)
+   // Move the magnified page by a distance in view coordinates
+{
+   if ((!isZoomed())||isConsole(view))
+      return;
+   QRect area=pageRect(view);
+   zoomCenter=QPointF(zoomCenter.x()-static_cast<double>(dx)/area.width(),zoomCenter.y()-static_cast<double>(dy)/area.height());
+   clampZoomCenter();
+   requestTiles();
+   invalidateViews();
+}
+//----------------------------------------------------------------------------
+void Presenter::clampZoomCenter()
+   // Keep the magnified page covering the first view
+{
+   // Beyond this the page border would be scrolled into the first view that shows the slides
+   View* view=slideView();
+   QSize size=zoomedSize(view);
+   if (size.isEmpty())
+      return;
+   qreal ratio=screens.resolution(view->resolution).devicePixelRatio;
+   double halfX=min(0.5,(view->target.width()*ratio)/(2.0*size.width()));
+   double halfY=min(0.5,(view->target.height()*ratio)/(2.0*size.height()));
+   zoomCenter=QPointF(max(halfX,min(1.0-halfX,zoomCenter.x())),max(halfY,min(1.0-halfY,zoomCenter.y())));
+}
+//----------------------------------------------------------------------------
 void Presenter::toggleTimer()
    // Toggle the timer display
 {
    if (showTimer) {
       showTimer=false;
-      timer.stop();
+      if (!console)
+         timer.stop();
    } else {
       showTimer=true;
       timer.start(1000);
@@ -336,6 +1087,21 @@ void Presenter::toggleTimer()
    invalidateViews();
 }
 //----------------------------------------------------------------------------
+void Presenter::toggleConsole()
+   // Toggle the presenter console
+{
+   // The console always shows the elapsed time
+   console=!console;
+   if (console) {
+      if (slidesLog.empty())
+         resetTimer();
+      timer.start(1000);
+   } else if (!showTimer) {
+      timer.stop();
+   }
+   invalidateViews();
+}
+//----------------------------------------------------------------------------
 void Presenter::resetTimer()
    // Reset the timer
 {
@@ -347,51 +1113,294 @@ void Presenter::pageChanged(unsigned index)
    // A page changed
 {
    if (mode==Normal) {
-      if (page==index)
+      if (page==index) {
+         if (zoomLevel)
+            requestTiles();
          invalidateViews();
-   } else if (mode==Overview) {
-      invalidateViews();
+      } else if ((index==page+1)||(index+1==page)) {
+         pixmapTimer.start();
+      }
+   } else if ((mode==Overview)&&(page==index)) {
+      for (unsigned view=1;view<views.size();view++)
+         views[view]->update();
    }
+
+   // The console scales the better image down
+   if (((index==page)||(index==page+1))&&isConsole(views.front()))
+      pixmapTimer.start();
+}
+//----------------------------------------------------------------------------
+void Presenter::tileChanged(unsigned index)
+   // A tile of a magnified page changed
+{
+   if (isZoomed()&&(index==page))
+      invalidateViews();
+}
+//----------------------------------------------------------------------------
+void Presenter::thumbnailChanged(unsigned index)
+   // An overview thumbnail changed
+{
+   if (mode==Overview)
+      invalidateOverviewCell(index);
 }
 //----------------------------------------------------------------------------
 void Presenter::tick()
    // A second passed
 {
-   if (showTimer) {
+   if (isConsole(views.front())) {
+      views.front()->update(consoleArea(views.front(),2));
+   } else if (showTimer) {
       View* v=views.front();
       QRect rect=QRect(0,0,v->width(),v->fontMetrics().height());
       v->update(rect);
    }
 }
 //----------------------------------------------------------------------------
+void Presenter::screensChanged()
+   // A screen was added, removed, or changed its geometry
+{
+   // Screens often change in bursts, e.g. when mirroring is switched off
+   screenTimer.start();
+}
+//----------------------------------------------------------------------------
+void Presenter::fileChanged()
+   // The document file or its directory changed
+{
+   if ((!watcher.files().contains(fileName))&&QFileInfo(fileName).exists())
+      watcher.addPath(fileName);
+   reloadTimer.start();
+}
+//----------------------------------------------------------------------------
+static bool isCompletePDF(const QString& fileName)
+   // Check if a PDF file is completely written. It ends with the trailer
+{
+   QFile file(fileName);
+   if (!file.open(QIODevice::ReadOnly))
+      return false;
+   qint64 size=file.size(),tail=min<qint64>(size,1024);
+   const char* data=reinterpret_cast<const char*>(file.map(size-tail,tail));
+   if (!data)
+      return false;
+   const char* eof="%%EOF";
+   bool complete=search(data,data+tail,eof,eof+strlen(eof))!=(data+tail);
+   file.unmap(reinterpret_cast<uchar*>(const_cast<char*>(data)));
+   return complete;
+}
+//----------------------------------------------------------------------------
+void Presenter::reloadDocument()
+   // Reload the changed document
+{
+   // LaTeX rewrites the file while it runs, wait until the next change if it is not complete
+   if (!isCompletePDF(fileName))
+      return;
+   shared_ptr<Poppler::Document> doc(Poppler::Document::load(fileName));
+   if ((!doc)||(!doc->numPages())) {
+      cerr << "unable to reload " << fileName.toLocal8Bit().constData() << endl;
+      return;
+   }
+
+   // The pages are compared in the background, the old version is shown meanwhile
+   renderer.reload(doc);
+}
+//----------------------------------------------------------------------------
+void Presenter::finishReload()
+   // Switch to the reloaded document once its pages are compared
+{
+   // Show the old version of the current page until it is rendered again
+   keepStandIn();
+   if (!renderer.finishReload(renderResolutions()))
+      return;
+
+   // Keep the position, the annotations and the timing. Only the page count may change
+   unsigned pageCount=renderer.getPageCount();
+   if (page>=pageCount) {
+      page=pageCount-1;
+      zoomLevel=0;
+      zoomCenter=QPointF(0.5,0.5);
+   }
+   layoutThumbnails(pageCount);
+   for (auto v:views) {
+      v->overview=QImage();
+      v->overviewCells.clear();
+   }
+   renderer.setFocus(page);
+   requestTiles();
+   requestThumbnails();
+   matchAnnotations();
+   invalidateViews();
+}
+//----------------------------------------------------------------------------
+void Presenter::matchAnnotations()
+   // Move the annotations with their pages when pages were inserted, removed, or reordered
+{
+   vector<QByteArray> updated;
+   if ((!renderer.getFingerprints(updated))||(updated==annotated))
+      return;
+
+   // Annotations written before the fingerprints were stored stay where they are
+   if (!annotated.empty()) {
+      vector<unsigned> reuse;
+      Renderer::matchPages(annotated,updated,reuse);
+
+      // An unchanged page takes its annotations along. A changed page keeps them if it did not move, the annotations of removed pages are dropped
+      vector<unsigned> moved(annotated.size(),~0u);
+      for (unsigned index=0;index<updated.size();index++)
+         if (reuse[index]!=RenderQueue::none) {
+            unsigned old=reuse[index];
+            if ((moved[old]==~0u)||(index==old))
+               moved[old]=index;
+         }
+      for (unsigned index=0;(index<updated.size())&&(index<annotated.size());index++)
+         if ((reuse[index]==RenderQueue::none)&&(moved[index]==~0u))
+            moved[index]=index;
+      bool identity=true;
+      for (unsigned index=0;index<moved.size();index++)
+         identity&=(moved[index]==index);
+
+      if (!identity) {
+         journal.renumber(moved);
+         unordered_map<unsigned,Scribble> remapped;
+         for (auto& s:scribbles)
+            if ((s.first<moved.size())&&(moved[s.first]!=~0u)) {
+               s.second.finishStroke();
+               Scribble& scribble=remapped[moved[s.first]];
+               scribble=s.second;
+               recordStrokes(moved[s.first],scribble);
+            }
+         scribbles.swap(remapped);
+         // The cached ink may belong to a scribble that no longer exists
+         for (auto v:views)
+            v->inkScribble=nullptr;
+         invalidateViews();
+      }
+   }
+   annotated=updated;
+   journal.recordFingerprints(updated);
+}
+//----------------------------------------------------------------------------
+void Presenter::keepStandIn()
+   // Keep a copy of the current page until it is rendered again
+{
+   // The copy must not share the cache memory
+   standIn=QImage();
+   for (unsigned index=0;index<screens.resolutionCount();index++) {
+      QImage img=renderer.getPage(index,page);
+      if (img.width()>standIn.width())
+         standIn=img;
+   }
+   standIn=standIn.copy();
+   standInPage=page;
+}
+//----------------------------------------------------------------------------
+void Presenter::reconfigureScreens()
+   // Adapt the views and the renderer to the current screens
+{
+   ScreenInfo updated;
+   if (!updated.screenCount())
+      return;
+
+   // Keep the current page visible until it is rendered for the new resolutions
+   keepStandIn();
+
+   // Scribbles are kept in the coordinates of the whole page in the first view. Remember their page sizes to rescale them for the new first view
+   vector<pair<Scribble*,QSize>> scribbleSizes;
+   for (auto& s:scribbles)
+      scribbleSizes.push_back(make_pair(&s.second,fitSize(views.front(),s.first)));
+   scribbleSizes.push_back(make_pair(&scratchScribble,fitSize(views.front(),page)));
+   for (auto& s:scribbleSizes)
+      s.first->finishStroke();
+
+   screens=updated;
+   layoutThumbnails(renderer.getPageCount());
+
+   // Move the existing views, drop the ones without a screen, and create the missing ones
+   while (views.size()>screens.screenCount()) {
+      views.back()->deleteLater();
+      views.pop_back();
+   }
+   for (unsigned index=0;index<views.size();index++) {
+      View* v=views[index];
+      v->target=screens.screen(index).target;
+      v->resolution=screens.screen(index).resolution;
+      v->overview=QImage();
+      v->overviewCells.clear();
+      v->showNormal();
+      placeView(v,index);
+      v->delayedFullScreen=true;
+   }
+   createViews();
+   watchScreens();
+
+   // The pages are not rendered for the new first view yet, but keep their shape
+   for (auto& s:scribbleSizes) {
+      if (s.second.isEmpty())
+         continue;
+      QSize fitted=s.second.scaled(views.front()->target.size(),Qt::KeepAspectRatio);
+      if (fitted.width()!=s.second.width())
+         s.first->scale(static_cast<double>(fitted.width())/s.second.width());
+   }
+
+   // Only resolutions that did not exist before are rendered
+   renderer.setResolutions(renderResolutions());
+   renderer.setFocus(page);
+   requestTiles();
+   requestThumbnails();
+   invalidateViews();
+}
+//----------------------------------------------------------------------------
 void Presenter::clearScribble()
    // Clear the scribble
 {
    if (auto scribble=getCurrentScribble()) {
       scribble->clear();
+      if (scribble!=&scratchScribble)
+         journal.recordClear(page);
       invalidateViews();
    }
 }
 //----------------------------------------------------------------------------
-void Presenter::drawLine(int x1,int y1,int x2,int y2,double intensity)
+void Presenter::drawLine(View* view,int x1,int y1,int x2,int y2,double intensity)
    // Add a line
 {
    if (auto scribble=getCurrentScribble(true)) {
-      QRect bb=scribble->drawLine(x1,y1,x2,y2,lineWidth*intensity,lineColor);
+      // Convert into scribble coordinates
+      QRect area=pageRect(view);
+      double scale=scribbleScale(view);
+      x1=(x1-area.left())/scale; y1=(y1-area.top())/scale;
+      x2=(x2-area.left())/scale; y2=(y2-area.top())/scale;
+
+      QRect bb=scribble->drawLine(x1,y1,x2,y2,(lineWidth*intensity)/scale,lineColor);
       if (!bb.isEmpty())
-         for (auto view:views)
-            view->update(bb.translated(view->target.topLeft()));
+         for (auto v:views)
+            v->update(scribbleToView(v,bb));
    }
 }
 //----------------------------------------------------------------------------
-void Presenter::eraseLine(int x1,int y1,int x2,int y2,double intensity)
+void Presenter::finishStroke()
+   // Finish the current pen stroke
+{
+   if (auto scribble=getCurrentScribble())
+      scribble->finishStroke();
+}
+//----------------------------------------------------------------------------
+void Presenter::eraseLine(View* view,int x1,int y1,int x2,int y2,double intensity)
    // Erase a previously drawn line
 {
    if (auto scribble=getCurrentScribble()) {
-      QRect bb=scribble->eraseLine(x1,y1,x2,y2,2*lineWidth*intensity);
-      if (!bb.isEmpty())
-         for (auto view:views)
-            view->update(bb.translated(view->target.topLeft()));
+      // Convert into scribble coordinates
+      QRect area=pageRect(view);
+      double scale=scribbleScale(view);
+      x1=(x1-area.left())/scale; y1=(y1-area.top())/scale;
+      x2=(x2-area.left())/scale; y2=(y2-area.top())/scale;
+
+      unsigned width=2*(lineWidth*intensity)/scale;
+      QRect bb=scribble->eraseLine(x1,y1,x2,y2,width);
+      if (!bb.isEmpty()) {
+         if (scribble!=&scratchScribble)
+            journal.recordErase(page,journalReference(),x1,y1,x2,y2,width);
+         for (auto v:views)
+            v->update(scribbleToView(v,bb));
+      }
    }
 }
 //----------------------------------------------------------------------------
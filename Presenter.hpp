@@ -1,9 +1,14 @@
 #ifndef H_Presenter
 #define H_Presenter
 //----------------------------------------------------------------------------
+#include "Journal.hpp"
 #include "ScreenInfo.hpp"
 #include "Scribble.hpp"
+#include "TileCache.hpp"
+#include <QFileSystemWatcher>
+#include <QImage>
 #include <QObject>
+#include <QString>
 #include <QTimer>
 #include <unordered_map>
 //----------------------------------------------------------------------------
@@ -22,14 +27,36 @@ class Presenter : public QObject
    ScreenInfo screens;
    /// The renderer
    Renderer& renderer;
-   /// Thumbnails layout
+   /// Thumbnails layout: the columns and the visible rows
    unsigned thumbX,thumbY;
+   /// The number of rows of the whole overview
+   unsigned thumbRows;
+   /// The first visible row of the overview
+   unsigned overviewTop;
    /// Thumbnail size
    QSize thumbSize,thumbSpacing;
    /// The views
    std::vector<View*> views;
    /// Timer
    QTimer timer;
+   /// Delays reacting to screen changes until the configuration settled
+   QTimer screenTimer;
+   /// Converts the neighbors of the current page for the display once the views are idle
+   QTimer pixmapTimer;
+   /// The document file
+   QString fileName;
+   /// Watches the document file and its directory
+   QFileSystemWatcher watcher;
+   /// Delays reloading the document until the file is written completely
+   QTimer reloadTimer;
+   /// A copy of the current page from before the last screen change or reload, shown until the page is rendered again
+   QImage standIn;
+   /// The page of the stand-in image
+   unsigned standInPage;
+   /// The stored annotations
+   Journal journal;
+   /// The page fingerprints of the document the annotations belong to. Empty if unknown
+   std::vector<QByteArray> annotated;
    /// Scribbles associated with pages
    std::unordered_map<unsigned,Scribble> scribbles;
    /// The current scratch-scribble
@@ -45,15 +72,35 @@ class Presenter : public QObject
    Mode mode;
    /// The current page
    unsigned page;
+   /// The magnification level, 0 shows the whole page
+   unsigned zoomLevel;
+   /// The point of the page shown in the center of the views, relative to the page size
+   QPointF zoomCenter;
    /// Show the timer?
    bool showTimer;
+   /// Show the presenter console on the first screen while the other screens show the slides?
+   bool console;
    /// Timing log (if any)
    std::vector<std::pair<unsigned,unsigned> > slidesLog;
    /// Transition profile (if any)
    std::vector<unsigned> profile;
 
+   /// Compute the thumbnail layout for the first screen
+   void layoutThumbnails(unsigned pageCount);
+   /// The size of thumbnails in device pixels of the first screen
+   QSize thumbnailSize() const;
+   /// Scroll the overview so that the current page is visible. Returns true if it moved
+   bool revealPage();
+   /// Request the thumbnails of the visible overview rows and their neighbors. Cancels the requests outside the overview
+   void requestThumbnails();
+   /// Place a view on its screen
+   void placeView(View* view,unsigned index);
+   /// Follow geometry changes of all screens
+   void watchScreens();
    /// Invalidate all views
    void invalidateViews();
+   /// Keep a copy of the current page until it is rendered again
+   void keepStandIn();
    /// Go to a specific page
    void goTo(unsigned page);
    /// Increment the current page
@@ -61,10 +108,65 @@ class Presenter : public QObject
    /// Decrement the current page
    void decPage(unsigned steps);
 
+   /// Does a view show the presenter console?
+   bool isConsole(View* view) const;
+   /// The view that shows the slides and follows the magnification
+   View* slideView() const;
+
    /// Get the current scribble (if any)
    Scribble* getCurrentScribble(bool createIfNeeded=false);
+   /// Store the strokes drawn on a page
+   void recordStrokes(unsigned index,Scribble& scribble);
+   /// The width of the scribble coordinate space, stored with annotations
+   unsigned journalReference() const;
+   /// The best image of a page that is not rendered for a resolution yet: another resolution, the stand-in, or the preview
+   QImage fallbackPage(unsigned index) const;
+   /// The size of a whole page within a view, ignoring the magnification. Empty if nothing of the page is available yet
+   QSize fitSize(View* view,unsigned index) const;
+   /// The area of the whole current page within a view, ignoring the magnification
+   QRect fitRect(View* view) const;
+   /// The area of the current page within a view. Extends beyond the view when magnified
+   QRect pageRect(View* view) const;
+   /// The size of the magnified current page in device pixels. Empty if not magnified
+   QSize zoomedSize(View* view) const;
+   /// Keep the magnified page covering the first view
+   void clampZoomCenter();
+   /// Collect the tiles of the magnified page that a view needs, visible ones first
+   void collectTiles(View* view,std::vector<TileCache::Tile>& tiles);
+   /// Request the tiles of all views
+   void requestTiles();
+   /// Draw the magnified current page
+   void paintZoomed(QPainter& painter,View* view);
+   /// The scale from scribble coordinates to view coordinates
+   double scribbleScale(View* view) const;
+   /// Map a rectangle in scribble coordinates to view coordinates
+   QRect scribbleToView(View* view,const QRect& rect) const;
+   /// Bring the rasterized scribble of a view up to date. Only new lines are drawn unless lines were removed or the page moved
+   void updateInk(View* view,Scribble& scribble);
+   /// Draw a scribble scaled to a view
+   void paintScribble(QPainter& painter,View* view,Scribble& scribble);
+   /// The display copy of a rendered page of a view. Converted when the image changed
+   const QPixmap& pagePixmap(View* view,unsigned index,const QImage& img);
    /// Draw the current page
    void paintPage(QPainter& painter,View* view);
+   /// The parts of the presenter console: 0 for the current page, 1 for the next page, 2 for the timer
+   QRect consoleArea(View* view,unsigned part) const;
+   /// The area of a page within a part of the presenter console
+   QRect consoleSlideRect(View* view,unsigned index,unsigned part) const;
+   /// The best available image of a page for the presenter console. Never renders
+   QImage consoleSource(View* view,unsigned index) const;
+   /// The scaled down copy of a page for the presenter console. Scales it only if create is set, returns nullptr if there is none
+   const QPixmap* consolePixmap(View* view,unsigned index,const QImage& img,const QSize& size,bool create);
+   /// Draw the presenter console
+   void paintConsole(QPainter& painter,View* view);
+   /// The content of an overview cell
+   enum OverviewCell : unsigned char { EmptyCell, DimmedCell, HighlightedCell };
+   /// The area of a page within the overview
+   QRect overviewCell(View* view,unsigned index) const;
+   /// Bring the composited overview of a view up to date
+   void updateOverview(View* view);
+   /// Repaint a single overview cell
+   void invalidateOverviewCell(unsigned index);
    /// Draw the overview page
    void paintOverview(QPainter& painter,View* view);
 
@@ -76,15 +178,17 @@ class Presenter : public QObject
 
    /// Set a presentation profile
    void setProfile(const std::vector<unsigned>& profile);
+   /// Store the annotations of pages in a file and restore them from it
+   bool setJournal(const QString& fileName);
+   /// Reload the document when its file changes. Only the changed pages are rendered again
+   void watchFile(const QString& fileName);
    /// Create a full screen view on each screen
    void createViews();
    /// Draw the current state
    void paint(QPainter& painter,View* view);
 
-   /// The size of the presentation area
-   QSize presentationSize() const;
-   /// The size of thumbnails
-   QSize thumbnailSize() const;
+   /// The resolutions pages must be rendered for
+   const std::vector<ScreenInfo::Resolution>& renderResolutions() const;
 
    /// Go to the first page
    void firstPage();
@@ -108,17 +212,38 @@ class Presenter : public QObject
    void toggleThumbnails();
    /// Toggle the timer display
    void toggleTimer();
+   /// Toggle the presenter console. Only shown with more than one screen
+   void toggleConsole();
    /// Reset the timer
    void resetTimer();
    /// Handle a mouse click
    void clicked(unsigned x,unsigned y);
+   /// Is the overview shown?
+   bool isOverview() const { return mode==Overview; }
+   /// Scroll the overview by a number of rows
+   void scrollOverview(int rows);
+
+   /// Is the current page magnified?
+   bool isZoomed() const { return (mode==Normal)&&zoomLevel; }
+   /// Magnify the current page
+   void zoomIn();
+   /// Reduce the magnification
+   void zoomOut();
+   /// Show the whole page again
+   void resetZoom();
+   /// Change the magnification by a number of levels, keeping a point of a view in place
+   void zoomAt(View* view,QPoint pos,int steps);
+   /// Move the magnified page by a distance in view coordinates
+   void pan(View* view,int dx,int dy);
 
    /// Clear the scribble
    void clearScribble();
-   /// Add a line
-   void drawLine(int x1,int y1,int x2,int y2,double intensity=1.0);
-   /// Erase a previously drawn line
-   void eraseLine(int x1,int y1,int x2,int y2,double intensity=1.0);
+   /// Add a line. The coordinates are relative to the view
+   void drawLine(View* view,int x1,int y1,int x2,int y2,double intensity=1.0);
+   /// Finish the current pen stroke
+   void finishStroke();
+   /// Erase a previously drawn line. The coordinates are relative to the view
+   void eraseLine(View* view,int x1,int y1,int x2,int y2,double intensity=1.0);
    /// Set the line width
    void setLineWidth(unsigned width);
    /// Set the line color
@@ -127,8 +252,26 @@ class Presenter : public QObject
    public slots:
    /// A page changed
    void pageChanged(unsigned index);
+   /// A tile of a magnified page changed
+   void tileChanged(unsigned index);
+   /// An overview thumbnail changed
+   void thumbnailChanged(unsigned index);
    /// Another second passed
    void tick();
+   /// A screen was added, removed, or changed its geometry
+   void screensChanged();
+   /// Adapt the views and the renderer to the current screens
+   void reconfigureScreens();
+   /// Convert the neighbors of the current page for the display
+   void preparePixmaps();
+   /// The document file or its directory changed
+   void fileChanged();
+   /// Reload the changed document
+   void reloadDocument();
+   /// Switch to the reloaded document once its pages are compared
+   void finishReload();
+   /// Move the annotations with their pages when pages were inserted, removed, or reordered
+   void matchAnnotations();
 };
 //----------------------------------------------------------------------------
 #endif
@@ -0,0 +1,143 @@
+#include "RenderQueue.hpp"
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+RenderQueue::RenderQueue()
+   : pending(0),running(0),focus(0),direction(1),persistent(false),closed(false)
+   // Constructor
+{
+}
+//----------------------------------------------------------------------------
+RenderQueue::~RenderQueue()
+   // Destructor
+{
+}
+//----------------------------------------------------------------------------
+void RenderQueue::reset(unsigned pageCount)
+   // Schedule all pages of a document
+{
+   unique_lock<mutex> guard(lock);
+   states.assign(pageCount,Pending);
+   pending=pageCount;
+   running=0;
+   closed=false;
+   if (focus>=pageCount)
+      focus=0;
+}
+//----------------------------------------------------------------------------
+void RenderQueue::setPersistent(bool persistent)
+   // Keep the workers waiting for pages that are scheduled again
+{
+   unique_lock<mutex> guard(lock);
+   this->persistent=persistent;
+}
+//----------------------------------------------------------------------------
+void RenderQueue::close()
+   // Wake up all waiting workers and hand out no more pages
+{
+   {
+      unique_lock<mutex> guard(lock);
+      closed=true;
+   }
+   available.notify_all();
+}
+//----------------------------------------------------------------------------
+void RenderQueue::skip(unsigned page)
+   // Remove a page that is already available
+{
+   unique_lock<mutex> guard(lock);
+   if (take(page)) {
+      states[page]=Done;
+      --running;
+   }
+}
+//----------------------------------------------------------------------------
+void RenderQueue::requeue(unsigned page)
+   // Schedule a finished page again
+{
+   {
+      unique_lock<mutex> guard(lock);
+      if ((page>=states.size())||(states[page]!=Done))
+         return;
+      states[page]=Pending;
+      ++pending;
+   }
+   available.notify_one();
+}
+//----------------------------------------------------------------------------
+void RenderQueue::setFocus(unsigned page)
+   // Prioritize the pages around a page
+{
+   unique_lock<mutex> guard(lock);
+   if (page>focus)
+      direction=1; else if (page<focus)
+      direction=-1;
+   focus=page;
+}
+//----------------------------------------------------------------------------
+bool RenderQueue::take(long page)
+   // Take a page if it is still pending
+{
+   if ((page<0)||(page>=static_cast<long>(states.size())))
+      return false;
+   if (states[page]!=Pending)
+      return false;
+   states[page]=Running;
+   --pending;
+   ++running;
+   return true;
+}
+//----------------------------------------------------------------------------
+unsigned RenderQueue::next()
+   // Get the next page to render
+{
+   unique_lock<mutex> guard(lock);
+   while (!pending) {
+      if (closed||(!persistent))
+         return none;
+      available.wait(guard);
+   }
+   if (closed)
+      return none;
+
+   // The current page and a window in navigation direction come first
+   long f=focus;
+   if (take(f))
+      return f;
+   for (long step=1;step<=static_cast<long>(lookAhead);step++)
+      if (take(f+direction*step))
+         return f+direction*step;
+   for (long step=1;step<=static_cast<long>(lookBehind);step++)
+      if (take(f-direction*step))
+         return f-direction*step;
+
+   // Then fill up with the remaining pages, closest first
+   for (long step=1,limit=states.size();step<limit;step++) {
+      if (take(f+direction*step))
+         return f+direction*step;
+      if (take(f-direction*step))
+         return f-direction*step;
+   }
+   return none;
+}
+//----------------------------------------------------------------------------
+void RenderQueue::finished(unsigned page)
+   // A page handed out by next is finished
+{
+   {
+      unique_lock<mutex> guard(lock);
+      if ((page>=states.size())||(states[page]!=Running))
+         return;
+      states[page]=Done;
+      --running;
+   }
+   idle.notify_all();
+}
+//----------------------------------------------------------------------------
+void RenderQueue::waitIdle()
+   // Wait until no page is rendered anymore
+{
+   unique_lock<mutex> guard(lock);
+   idle.wait(guard,[this]() { return !running; });
+}
+//----------------------------------------------------------------------------
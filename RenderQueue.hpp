@@ -0,0 +1,75 @@
+#ifndef H_RenderQueue
+#define H_RenderQueue
+//----------------------------------------------------------------------------
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+//----------------------------------------------------------------------------
+/// Decides in which order pages are rendered. Pages around the current page come first
+class RenderQueue
+{
+   private:
+   /// The state of a page
+   enum State : unsigned char { Pending, Running, Done };
+
+   /// The lock
+   std::mutex lock;
+   /// Signals new work
+   std::condition_variable available;
+   /// Signals finished pages
+   std::condition_variable idle;
+   /// The page states
+   std::vector<State> states;
+   /// The number of pending pages
+   unsigned pending;
+   /// The number of pages that are rendered right now
+   unsigned running;
+   /// The page that is currently shown
+   unsigned focus;
+   /// The navigation direction (+1 or -1)
+   int direction;
+   /// Wait for pages that are scheduled again?
+   bool persistent;
+   /// No more work will be handed out
+   bool closed;
+
+   /// Take a page if it is still pending
+   bool take(long page);
+
+   RenderQueue(const RenderQueue&);
+   void operator=(const RenderQueue&);
+
+   public:
+   /// No more pages
+   static const unsigned none = ~0u;
+   /// The number of pages rendered ahead in navigation direction before everything else
+   static const unsigned lookAhead = 4;
+   /// The number of pages rendered behind before everything else
+   static const unsigned lookBehind = 1;
+
+   /// Constructor
+   RenderQueue();
+   /// Destructor
+   ~RenderQueue();
+
+   /// Schedule all pages of a document
+   void reset(unsigned pageCount);
+   /// Keep the workers waiting for pages that are scheduled again
+   void setPersistent(bool persistent);
+   /// Wake up all waiting workers and hand out no more pages
+   void close();
+   /// Remove a page that is already available
+   void skip(unsigned page);
+   /// Schedule a finished page again
+   void requeue(unsigned page);
+   /// Prioritize the pages around a page
+   void setFocus(unsigned page);
+   /// Get the next page to render. Returns none if all pages are taken
+   unsigned next();
+   /// A page handed out by next is finished
+   void finished(unsigned page);
+   /// Wait until no page is rendered anymore. Only useful after close
+   void waitIdle();
+};
+//----------------------------------------------------------------------------
+#endif
@@ -0,0 +1,98 @@
+#ifndef H_RenderStats
+#define H_RenderStats
+//----------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+//----------------------------------------------------------------------------
+/// Time spent in the stages of the render pipeline. Updated concurrently by all workers
+class RenderStats
+{
+   public:
+   /// The stages
+   enum Stage { Render, Convert, Dim, Compress, Copy, Hash };
+   /// The number of stages
+   static const unsigned stageCount = 6;
+
+   /// Measures a stage for the lifetime of the object
+   class Timer {
+      /// The statistics
+      RenderStats& stats;
+      /// The stage
+      Stage stage;
+      /// The start time
+      std::chrono::steady_clock::time_point start;
+
+      public:
+      /// Constructor
+      Timer(RenderStats& stats,Stage stage) : stats(stats),stage(stage),start(std::chrono::steady_clock::now()) {}
+      /// Destructor
+      ~Timer() { stats.add(stage,std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count()); }
+   };
+
+   private:
+   /// The time spent per stage in nanoseconds
+   std::atomic<uint64_t> nanoseconds[stageCount];
+   /// The number of calls per stage
+   std::atomic<uint64_t> calls[stageCount];
+   /// The number of finished pages, failed pages, and previews
+   std::atomic<uint64_t> pages,failures,previews;
+   /// The number of images stored by sharing the copy of an identical page, and the bytes that saved
+   std::atomic<uint64_t> shared,sharedSpace;
+   /// The time of the first and of the latest page and of the first preview, in nanoseconds since the reset
+   std::atomic<uint64_t> firstPage,lastPage,firstPreview;
+   /// The start of the measurement
+   std::chrono::steady_clock::time_point origin;
+
+   /// The time since the reset
+   uint64_t elapsed() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-origin).count(); }
+
+   public:
+   /// Constructor
+   RenderStats() { reset(); }
+
+   /// Start a new measurement
+   void reset() {
+      for (unsigned index=0;index<stageCount;index++) { nanoseconds[index]=0; calls[index]=0; }
+      pages=0; failures=0; previews=0; shared=0; sharedSpace=0; firstPage=0; lastPage=0; firstPreview=0;
+      origin=std::chrono::steady_clock::now();
+   }
+   /// Account time for a stage
+   void add(Stage stage,uint64_t ns) { nanoseconds[stage]+=ns; ++calls[stage]; }
+   /// A page is finished
+   void pageDone() { uint64_t now=elapsed(),none=0; firstPage.compare_exchange_strong(none,now); lastPage=now; ++pages; }
+   /// A page could not be rendered
+   void pageFailed() { ++failures; }
+   /// An image shares the stored copy of an identical page
+   void imageShared(uint64_t bytes) { ++shared; sharedSpace+=bytes; }
+   /// A preview is finished
+   void previewDone() { uint64_t none=0; firstPreview.compare_exchange_strong(none,elapsed()); ++previews; }
+
+   /// The name of a stage
+   static const char* stageName(Stage stage) {
+      static const char* names[stageCount]={"render","convert","dim","compress","copy","hash"};
+      return names[stage];
+   }
+   /// The time spent in a stage in nanoseconds
+   uint64_t stageTime(Stage stage) const { return nanoseconds[stage]; }
+   /// The number of calls of a stage
+   uint64_t stageCalls(Stage stage) const { return calls[stage]; }
+   /// The number of finished pages
+   uint64_t pageCount() const { return pages; }
+   /// The number of pages that could not be rendered
+   uint64_t failureCount() const { return failures; }
+   /// The number of finished previews
+   uint64_t previewCount() const { return previews; }
+   /// The number of images that share the stored copy of an identical page
+   uint64_t sharedCount() const { return shared; }
+   /// The bytes saved by sharing images
+   uint64_t sharedBytes() const { return sharedSpace; }
+   /// The time until the first page was finished in nanoseconds
+   uint64_t timeToFirstPage() const { return firstPage; }
+   /// The time until the latest page was finished in nanoseconds
+   uint64_t timeToLastPage() const { return lastPage; }
+   /// The time until the first preview was finished in nanoseconds
+   uint64_t timeToFirstPreview() const { return firstPreview; }
+};
+//----------------------------------------------------------------------------
+#endif
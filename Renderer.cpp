@@ -1,15 +1,51 @@
 #include "Renderer.hpp"
+#include "ImageKernels.hpp"
+#include "PageCodec.hpp"
+#include "Trace.hpp"
+#include <QCryptographicHash>
+#include <QFile>
 #include <QImage>
+#include <QVariant>
 #include <poppler/qt5/poppler-qt5.h>
+#include <omp.h>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <cstdio>
+#include <map>
+#include <cstring>
+#include <thread>
 //----------------------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------------------
+/// The tile size of overview thumbnails. Larger than any thumbnail, each one is a single tile
+static const unsigned thumbTileSize = 4096;
+/// The space for overview thumbnails. Enough for several screens full of them
+static const uint64_t thumbBudget = 64ull<<20;
+/// The number of threads rendering overview thumbnails
+static const unsigned thumbThreads = 2;
+//----------------------------------------------------------------------------
+Renderer::Generation::Generation()
+   : pageCount(0),useClock(0),focus(0)
+   // Constructor
+{
+}
+//----------------------------------------------------------------------------
+Renderer::Generation::~Generation()
+   // Destructor
+{
+   for (auto& set:sets) {
+      if (!set)
+         continue;
+      set->frames.stop();
+      for (auto& image:set->images) {
+         delete image; image=0;
+      }
+   }
+}
+//----------------------------------------------------------------------------
 Renderer::Renderer()
-   : doc(0),file(0),cacheStart(0),cacheEnd(0),stopped(false),mustStop(false)
+   : thumbs(thumbTileSize),fingerprinted(false),threads(0),privateDocuments(false),workerProcesses(0),compressed(false),cacheBudget(0),persistentCache(true),running(false),stopping(false)
    // Constructor
 {
 }
@@ -17,9 +53,18 @@ Renderer::Renderer()
 Renderer::~Renderer()
    // Destructor
 {
-   cleanup();
+   stop();
 }
 //----------------------------------------------------------------------------
+/// The number of decompressed pages kept in memory
+static const unsigned hotFrames = 6;
+/// The space for tiles of magnified pages
+static const uint64_t tileBudget = 256ull<<20;
+/// The reduction of the preview size relative to the first resolution
+static const unsigned previewDivisor = 4;
+/// The longer side of the renderings that fingerprint the pages
+static const unsigned fingerprintSize = 512;
+//----------------------------------------------------------------------------
 static unsigned long maxSizeBytes(const QSize& size)
    // Estimate the maximum space consumpton in bytes
 {
@@ -30,160 +75,1020 @@ static unsigned long maxSizeBytes(const QSize& size)
    return bytes+100+(bytes/8);
 }
 //----------------------------------------------------------------------------
-bool Renderer::prepare(Poppler::Document& doc,const QSize& imageSize,const QSize& thumbSize)
-   // Prepare the rendering. Must be called before run or starting a thread
+static bool hashFile(const QString& fileName,QByteArray& result)
+   // Compute the hash of the PDF file
+{
+   QFile file(fileName);
+   if (!file.open(QIODevice::ReadOnly))
+      return false;
+   QCryptographicHash hash(QCryptographicHash::Sha1);
+   if (!hash.addData(&file))
+      return false;
+   result=hash.result();
+   return true;
+}
+//----------------------------------------------------------------------------
+static void configureDocument(Poppler::Document& doc)
+   // Set the render hints of a document
 {
-   cleanup();
-
-   this->doc=&doc;
-   this->imageSize=imageSize;
-   this->thumbSize=thumbSize;
-   images.resize(doc.numPages());
-   thumbnails.resize(doc.numPages());
-   darkThumbnails.resize(doc.numPages());
    //doc.setRenderBackend(Poppler::Document::ArthurBackend);
    doc.setRenderHint(Poppler::Document::Antialiasing);
    doc.setRenderHint(Poppler::Document::TextAntialiasing);
-
-   // Allocate a cache file
-   unsigned long reservedSpace=(maxSizeBytes(imageSize)+2*maxSizeBytes(thumbSize))*(images.size()+1);
-   file=tmpfile();
-   int fd=fileno(static_cast<FILE*>(file));
-   if (posix_fallocate(fd,0,reservedSpace)) {
-      cerr << "unable to allocate " << (reservedSpace/1024/1024) << " MB for caching." << endl;
-      fclose(static_cast<FILE*>(file));
-      file=0;
+}
+//----------------------------------------------------------------------------
+static void computeKey(const QByteArray& fileHash,Poppler::Document& doc,const QSize& imageSize,bool compressed,PageCache::Key& key)
+   // Compute the cache key of a document
+{
+   memset(&key,0,sizeof(key));
+   if (compressed)
+      key.flags|=PageCache::CompressedImages;
+   key.imageWidth=imageSize.width();
+   key.imageHeight=imageSize.height();
+   key.hints=doc.renderHints();
+   memcpy(key.hash,fileHash.constData(),min<size_t>(fileHash.size(),sizeof(key.hash)));
+}
+//----------------------------------------------------------------------------
+static bool copyImage(PageCache& from,unsigned fromPage,PageCache& to,unsigned toPage,map<const unsigned char*,unsigned>& copies)
+   // Copy a stored page into another cache. An image that several pages share is copied once
+{
+   if (!from.attach(fromPage))
       return false;
+   uint64_t len;
+   QImage img;
+   const unsigned char* data=from.compressedData(fromPage,len);
+   if (!data) {
+      img=from.image(fromPage);
+      data=img.constBits();
+      len=img.byteCount();
    }
-   void* mapping=mmap(0,reservedSpace,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
-   if (mapping==MAP_FAILED) {
-      cerr << "unable to map cache into memory" << endl;
-      fclose(static_cast<FILE*>(file));
-      file=0;
+   auto iter=copies.find(data);
+   if ((iter!=copies.end())&&to.share(toPage,iter->second))
+      return true;
+
+   unsigned char* writer=to.allocateImage(len);
+   if (!writer)
       return false;
+   memcpy(writer,data,len);
+   if (img.isNull())
+      to.storeCompressed(toPage,writer,len,from.imageSize(fromPage)); else
+      to.store(toPage,QImage(writer,img.width(),img.height(),img.bytesPerLine(),img.format()));
+   to.publish(toPage);
+   copies[data]=toPage;
+   return true;
+}
+//----------------------------------------------------------------------------
+static QByteArray pageFingerprint(Poppler::Page& page)
+   // Compute a hash of what a page shows: its geometry, the placed words, and the pixels of a small rendering
+{
+   QCryptographicHash hash(QCryptographicHash::Sha1);
+   QSizeF size=page.pageSizeF();
+   double header[3]={size.width(),size.height(),static_cast<double>(page.orientation())};
+   hash.addData(reinterpret_cast<const char*>(header),sizeof(header));
+   for (Poppler::TextBox* box:page.textList()) {
+      QRectF bb=box->boundingBox();
+      double coords[4]={bb.left(),bb.top(),bb.width(),bb.height()};
+      hash.addData(reinterpret_cast<const char*>(coords),sizeof(coords));
+      hash.addData(box->text().toUtf8());
+      delete box;
    }
-   cacheStart=static_cast<unsigned char*>(mapping);
-   cacheEnd=cacheStart+reservedSpace;
 
+   // Figures and drawings only show up in the pixels. A page that cannot be rendered gets no fingerprint and counts as changed
+   double DPI=72.0*fingerprintSize/max(max(size.width(),size.height()),1.0);
+   QImage img=page.renderToImage(DPI,DPI);
+   if (img.isNull())
+      return QByteArray();
+   ImageKernels::toRGB32(img);
+   uint64_t pixels=ImageKernels::hash(img);
+   hash.addData(reinterpret_cast<const char*>(&pixels),sizeof(pixels));
+   return hash.result();
+}
+//----------------------------------------------------------------------------
+static bool computeFingerprints(Poppler::Document& doc,vector<QByteArray>& fingerprints,const CancelToken& token)
+   // Compute the fingerprints of all pages. Returns false if cancelled
+{
+   Trace::Span span("fingerprint pages");
+   fingerprints.assign(doc.numPages(),QByteArray());
+   for (unsigned index=0;index<fingerprints.size();index++) {
+      if (token.isCancelled())
+         return false;
+      unique_ptr<Poppler::Page> page(doc.page(index));
+      if (page)
+         fingerprints[index]=pageFingerprint(*page);
+   }
    return true;
 }
 //----------------------------------------------------------------------------
-void Renderer::cleanup()
-   // Cleanup
+bool Renderer::prepare(const shared_ptr<Poppler::Document>& doc,const QString& fileName,const vector<ScreenInfo::Resolution>& resolutions)
+   // Prepare the rendering
+{
+   QByteArray fileHash;
+   if ((!current)||(current->doc!=doc))
+      hashFile(fileName,fileHash);
+   return prepare(doc,fileName,resolutions,vector<unsigned>(),fileHash);
+}
+//----------------------------------------------------------------------------
+bool Renderer::prepare(const shared_ptr<Poppler::Document>& doc,const QString& fileName,const vector<ScreenInfo::Resolution>& resolutions,const vector<unsigned>& reuse,const QByteArray& fileHash)
+   // Prepare the rendering, taking over unchanged pages of a previous version of the document
 {
-   for (unsigned index=0;index<images.size();index++) {
-      delete images[index]; images[index]=0;
-      delete thumbnails[index]; thumbnails[index]=0;
-      delete darkThumbnails[index]; darkThumbnails[index]=0;
+   shared_ptr<Generation> gen=make_shared<Generation>(),old=current;
+   bool sameDocument=old&&(old->doc==doc);
+   bool changedDocument=old&&(!sameDocument)&&(!reuse.empty());
+   if (workerProcesses&&cacheBudget) {
+      cerr << "the cache budget is ignored when rendering in worker processes" << endl;
+      cacheBudget=0;
    }
-   images.clear();
-   thumbnails.clear();
-   if (cacheStart) {
-      munmap(cacheStart,cacheEnd-cacheStart);
-      cacheStart=cacheEnd=0;
+   gen->doc=doc;
+   gen->fileName=fileName;
+   unsigned pageCount=gen->pageCount=doc->numPages();
+   gen->previews.assign(pageCount,QImage());
+   gen->lastUse.assign(pageCount,0);
+   gen->queue.reset(pageCount);
+   gen->queue.setPersistent(cacheBudget!=0);
+   configureDocument(*doc);
+
+   // For the same document the render sets of unchanged resolutions are taken over, for a changed one the unchanged pages.
+   // The old generation must be idle for that
+   if (sameDocument||changedDocument) {
+      old->token.cancel();
+      old->previewQueue.close();
+      old->queue.close();
+      if (old->processes)
+         old->processes->stop();
+      old->previewQueue.waitIdle();
+      old->queue.waitIdle();
+      gen->focus=min(old->focus,pageCount?(pageCount-1):0);
+      gen->queue.setFocus(gen->focus);
+      gen->previewQueue.setFocus(gen->focus);
    }
-   if (file) {
-      fclose(static_cast<FILE*>(file));
-      file=0;
+   if (sameDocument) {
+      gen->fileHash=old->fileHash;
+      gen->documentFile=old->documentFile;
+      gen->documentData=old->documentData;
+      unique_lock<mutex> guard(old->residency);
+      gen->workerDocs=move(old->workerDocs);
+      gen->lastUse=old->lastUse;
+      gen->useClock=old->useClock;
+   } else {
+      gen->fileHash=fileHash;
+      if (!changedDocument) {
+         stopFingerprints();
+         fingerprinted=false;
+      }
+      tiles.start(doc,thread::hardware_concurrency(),tileBudget,[this](unsigned index) { QMetaObject::invokeMethod(this,"tileRendered",Qt::QueuedConnection,Q_ARG(unsigned,index)); });
+      thumbs.start(doc,thumbThreads,thumbBudget,[this](unsigned index) { QMetaObject::invokeMethod(this,"thumbnailRendered",Qt::QueuedConnection,Q_ARG(unsigned,index)); });
    }
+
+   // Private documents are opened by each worker on first use
+   if (privateDocuments&&gen->documentData.isEmpty()&&(!mapDocument(*gen)))
+      cerr << "unable to map " << fileName.toLocal8Bit().constData() << ", sharing one document" << endl;
+   gen->workerDocs.resize(max<unsigned>(threads,omp_get_max_threads()));
+
+   // Open a cache file per resolution. Use a temporary file if the persistent cache is not usable
+   vector<bool> adopted;
+   for (unsigned index=0;index<resolutions.size();index++) {
+      QSize imageSize=resolutions[index].size;
+      double devicePixelRatio=resolutions[index].devicePixelRatio;
+
+      // Already rendered?
+      bool found=false;
+      if (sameDocument)
+         for (auto& set:old->sets)
+            if (set&&(set->imageSize==imageSize)&&(set->devicePixelRatio==devicePixelRatio)) {
+               gen->sets.push_back(move(set));
+               found=true;
+               break;
+            }
+      adopted.push_back(found);
+      if (found)
+         continue;
+
+      gen->sets.push_back(unique_ptr<RenderSet>(new RenderSet()));
+      RenderSet& set=*gen->sets.back();
+      set.imageSize=imageSize;
+      set.devicePixelRatio=devicePixelRatio;
+      set.images.assign(pageCount,nullptr);
+      unsigned long largestImage=maxSizeBytes(set.imageSize);
+
+      PageCache::Key key;
+      computeKey(gen->fileHash,*doc,set.imageSize,compressed,key);
+      QString cacheFile=(gen->fileHash.isEmpty()||(!persistentCache))?QString():PageCache::defaultFileName(key);
+      if (cacheFile.isEmpty()||(!set.cache.open(cacheFile,key,pageCount,largestImage))) {
+         if (!set.cache.open(QString(),key,pageCount,largestImage))
+            return false;
+      }
+      set.cache.setImageBudget(cacheBudget/resolutions.size());
+   }
+
+   // A fresh document gets a quick preview pass first, the pages are shown upscaled until they are refined.
+   // For the same document the views fall back to the images of the other resolutions instead.
+   // Worker processes skip it, a broken page must not be touched in process
+   gen->previewQueue.reset((sameDocument||changedDocument||workerProcesses)?0:pageCount);
+
+   // Copy the unchanged pages of the previous version. Pages that do not fit into the budget are rendered again on demand
+   if (changedDocument) {
+      Trace::Span span("copy unchanged pages");
+      for (auto& set:gen->sets)
+         for (auto& from:old->sets) {
+            if ((!from)||(from->imageSize!=set->imageSize)||(from->devicePixelRatio!=set->devicePixelRatio))
+               continue;
+            map<const unsigned char*,unsigned> copies;
+            for (unsigned index=0;index<pageCount;index++) {
+               unsigned source=(index<reuse.size())?reuse[index]:RenderQueue::none;
+               if ((source<old->pageCount)&&(!set->cache.isValid(index)))
+                  copyImage(from->cache,source,set->cache,index,copies);
+            }
+            break;
+         }
+   }
+
+   // Reuse the pages rendered by previous runs
+   for (unsigned index=0;index<pageCount;index++) {
+      if (gen->sets.front()->cache.isValid(index))
+         gen->previewQueue.skip(index);
+      bool complete=true;
+      for (auto& set:gen->sets) {
+         if (!set->cache.isValid(index)) {
+            complete=false;
+         } else if ((!compressed)&&(!set->images[index])) {
+            set->images[index]=new QImage(set->cache.image(index,set->devicePixelRatio));
+         }
+      }
+      if (complete)
+         gen->queue.skip(index);
+   }
+   if (compressed)
+      for (unsigned index=0;index<gen->sets.size();index++)
+         if (!adopted[index])
+            gen->sets[index]->frames.start(gen->sets[index]->cache,hotFrames,gen->sets[index]->devicePixelRatio);
+
+   // Start the worker processes once the caches are set up. They map the cache files themselves.
+   // The description is the storage flag and the image sizes, followed by the file name
+   if (workerProcesses) {
+      vector<int32_t> fields={compressed,static_cast<int32_t>(gen->sets.size())};
+      vector<int> files;
+      for (auto& set:gen->sets) {
+         fields.push_back(set->imageSize.width());
+         fields.push_back(set->imageSize.height());
+         files.push_back(set->cache.fileDescriptor());
+      }
+      QByteArray name=gen->fileName.toUtf8();
+      string description(reinterpret_cast<const char*>(fields.data()),sizeof(int32_t)*fields.size());
+      description.append(name.constData(),name.size());
+      gen->processes.reset(new WorkerPool());
+      if (!gen->processes->start(workerProcesses,description,files)) {
+         cerr << "unable to start the render workers, rendering in process" << endl;
+         gen->processes.reset();
+      }
+   }
+
+   // Switch over. The workers drop the old generation once their current pages are abandoned
+   {
+      unique_lock<mutex> guard(lifecycle);
+      current=gen;
+   }
+   if (old) {
+      old->token.cancel();
+      old->previewQueue.close();
+      old->queue.close();
+      if (old->processes)
+         old->processes->stop();
+   }
+   lifecycleChanged.notify_all();
+   return true;
 }
 //----------------------------------------------------------------------------
-void Renderer::run()
-   // Render the images
+bool Renderer::setResolutions(const vector<ScreenInfo::Resolution>& resolutions)
+   // Switch the current document to other resolutions
 {
-   // Render all pages
-   unsigned char* writer=cacheStart;
-#pragma omp parallel for schedule(dynamic)
-   for (unsigned index=0;index<images.size();index++) {
-      if (mustStop) { // break
-         index=images.size();
-         continue;
+   if (!current)
+      return false;
+   shared_ptr<Generation> gen=current;
+   return prepare(gen->doc,gen->fileName,resolutions);
+}
+//----------------------------------------------------------------------------
+void Renderer::reload(const shared_ptr<Poppler::Document>& doc)
+   // Start switching to a changed version of the current document
+{
+   if (!current)
+      return;
+
+   // A comparison that is still running belongs to an outdated version
+   stopFingerprints();
+   {
+      unique_lock<mutex> guard(reloadLock);
+      pendingReload.reset();
+   }
+
+   // The old version can only be compared if its fingerprints were computed before the file changed
+   shared_ptr<Generation> old=current;
+   vector<QByteArray> before;
+   if (fingerprinted.load(memory_order_acquire)&&(fingerprints.size()==old->pageCount))
+      before=fingerprints;
+   configureDocument(*doc);
+
+   // Hashing the file and rendering the fingerprints takes a while for large documents, the old version is shown meanwhile
+   fingerprintToken=CancelToken();
+   CancelToken token=fingerprintToken;
+   shared_ptr<Poppler::Document> previous=old->doc;
+   QString fileName=old->fileName;
+   QByteArray oldHash=old->fileHash;
+   fingerprinter=thread([this,doc,previous,fileName,oldHash,before,token]() {
+      Trace::nameThread("reload");
+      unique_ptr<PendingReload> result(new PendingReload());
+      result->doc=doc;
+      result->previous=previous;
+      if (hashFile(fileName,result->fileHash)&&(result->fileHash==oldHash))
+         return;
+      if (!computeFingerprints(*doc,result->fingerprints,token))
+         return;
+
+      // Match the pages by content
+      vector<QByteArray>& updated=result->fingerprints;
+      unsigned changed=updated.size();
+      if (!before.empty())
+         changed=matchPages(before,updated,result->reuse);
+      cerr << "reloading " << fileName.toLocal8Bit().constData() << ", " << changed << " of " << updated.size() << " pages changed" << endl;
+
+      {
+         unique_lock<mutex> guard(reloadLock);
+         if (token.isCancelled())
+            return;
+         pendingReload=move(result);
+      }
+      QMetaObject::invokeMethod(this,"reloadPrepared",Qt::QueuedConnection);
+   });
+}
+//----------------------------------------------------------------------------
+unsigned Renderer::matchPages(const vector<QByteArray>& before,const vector<QByteArray>& after,vector<unsigned>& reuse)
+   // Find the old page with the same content for every new page
+{
+   // The same position first, then anywhere else, e.g., if slides were inserted
+   reuse.assign(after.size(),RenderQueue::none);
+   map<QByteArray,unsigned> oldPages;
+   for (unsigned index=before.size();index>0;index--)
+      if (!before[index-1].isEmpty())
+         oldPages[before[index-1]]=index-1;
+   unsigned changed=0;
+   for (unsigned index=0;index<after.size();index++) {
+      if (after[index].isEmpty()) {
+         changed++;
+      } else if ((index<before.size())&&(after[index]==before[index])) {
+         reuse[index]=index;
+      } else {
+         auto iter=oldPages.find(after[index]);
+         if (iter!=oldPages.end())
+            reuse[index]=iter->second; else
+            changed++;
       }
-      delete images[index]; images[index]=0;
-      delete thumbnails[index]; thumbnails[index]=0;
-      delete darkThumbnails[index]; darkThumbnails[index]=0;
+   }
+   return changed;
+}
+//----------------------------------------------------------------------------
+bool Renderer::getFingerprints(vector<QByteArray>& result) const
+   // Get the page fingerprints of the current document
+{
+   if (!fingerprinted.load(memory_order_acquire))
+      return false;
+   result=fingerprints;
+   return true;
+}
+//----------------------------------------------------------------------------
+bool Renderer::finishReload(const vector<ScreenInfo::Resolution>& resolutions)
+   // Switch to the compared version
+{
+   unique_ptr<PendingReload> pending;
+   {
+      unique_lock<mutex> guard(reloadLock);
+      pending=move(pendingReload);
+   }
+   // The comparison only holds for the version it was made against
+   if ((!pending)||(!current)||(current->doc!=pending->previous))
+      return false;
+   stopFingerprints();
 
-      // Compute the desired DPI
-      Poppler::Page* page=doc->page(index);
-      double DPIx=static_cast<double>(imageSize.width())/(page->pageSizeF().width()/72.0);
-      double DPIy=static_cast<double>(imageSize.height())/(page->pageSizeF().height()/72.0);
-      double DPI=(DPIx<DPIy)?DPIx:DPIy;
+   if (!prepare(pending->doc,current->fileName,resolutions,pending->reuse,pending->fileHash))
+      return false;
+   fingerprints.swap(pending->fingerprints);
+   fingerprinted=true;
+   return true;
+}
+//----------------------------------------------------------------------------
+void Renderer::startFingerprints()
+   // Fingerprint the pages of the current document in the background
+{
+   stopFingerprints();
+   fingerprinted=false;
+   if (!current)
+      return;
+   fingerprintToken=CancelToken();
+   CancelToken token=fingerprintToken;
+   shared_ptr<Poppler::Document> doc=current->doc;
+   fingerprinter=thread([this,doc,token]() {
+      Trace::nameThread("fingerprints");
+      vector<QByteArray> result;
+      if (computeFingerprints(*doc,result,token)) {
+         fingerprints.swap(result);
+         fingerprinted.store(true,memory_order_release);
+         QMetaObject::invokeMethod(this,"fingerprintsReady",Qt::QueuedConnection);
+      }
+   });
+}
+//----------------------------------------------------------------------------
+void Renderer::stopFingerprints()
+   // Stop computing the fingerprints
+{
+   fingerprintToken.cancel();
+   if (fingerprinter.joinable())
+      fingerprinter.join();
+}
+//----------------------------------------------------------------------------
+shared_ptr<Renderer::Generation> Renderer::nextGeneration(const shared_ptr<Generation>& previous)
+   // Wait for a generation other than the given one
+{
+   unique_lock<mutex> guard(lifecycle);
+   lifecycleChanged.wait(guard,[&]() { return stopping||(current&&(current!=previous)); });
+   return stopping?nullptr:current;
+}
+//----------------------------------------------------------------------------
+unsigned Renderer::findVictim(Generation& gen,RenderSet& set,unsigned index)
+   // Find the least recently used page that may be evicted
+{
+   // Never evict the pages around the current page
+   unsigned focus=gen.focus;
+   unsigned protectFrom=(focus>RenderQueue::lookBehind)?(focus-RenderQueue::lookBehind):0;
+   unsigned protectTo=focus+RenderQueue::lookAhead;
 
-      // Render
-      QImage rawImg=page->renderToImage(DPI,DPI);
-      if (rawImg.isNull()) {
-         cerr << "unable to render page " << (index+1) << endl;
+   unsigned victim=RenderQueue::none,victimDistance=0;
+   for (unsigned page=0;page<gen.pageCount;page++) {
+      if ((page==index)||((page>=protectFrom)&&(page<=protectTo))||(!set.cache.isValid(page)))
          continue;
+      unsigned distance=(page<focus)?(focus-page):(page-focus);
+      if ((victim==RenderQueue::none)||(gen.lastUse[page]<gen.lastUse[victim])||((gen.lastUse[page]==gen.lastUse[victim])&&(distance>victimDistance))) {
+         victim=page;
+         victimDistance=distance;
       }
-      QImage img=rawImg.convertToFormat(QImage::Format_RGB32);
+   }
+   return victim;
+}
+//----------------------------------------------------------------------------
+void Renderer::evict(RenderSet& set,unsigned index)
+   // Drop the full size image of a page
+{
+   delete set.images[index]; set.images[index]=0;
+   set.cache.release(index);
+   set.frames.invalidate(index);
+}
+//----------------------------------------------------------------------------
+unsigned char* Renderer::allocateImage(Generation& gen,RenderSet& set,unsigned index,uint64_t len)
+   // Allocate space for a full size page, evicting other pages if needed
+{
+   unique_lock<mutex> guard(gen.residency);
+   while (true) {
+      if (unsigned char* result=set.cache.allocateImage(len))
+         return result;
 
-      // Store in cache file
-      unsigned len=img.byteCount();
-      unsigned char* imgWriter;
-#pragma omp critical(writer)
+      // Make room
+      unsigned victim=findVictim(gen,set,index);
+      if (victim==RenderQueue::none)
+         return nullptr;
+      evict(set,victim);
+   }
+}
+//----------------------------------------------------------------------------
+static bool shouldAbort(const QVariant& closure)
+   // Poppler callback, checks if a render job was cancelled
+{
+   return static_cast<const atomic<bool>*>(closure.value<void*>())->load(memory_order_acquire);
+}
+//----------------------------------------------------------------------------
+QImage Renderer::renderImage(Poppler::Page* page,const QSize& size,const CancelToken& token,RenderStats& stats)
+   // Render a page to fit into a size
+{
+   // Compute the desired DPI
+   double DPIx=static_cast<double>(size.width())/(page->pageSizeF().width()/72.0);
+   double DPIy=static_cast<double>(size.height())/(page->pageSizeF().height()/72.0);
+   double DPI=(DPIx<DPIy)?DPIx:DPIy;
+
+   // Render, Poppler checks the token while rendering
+   QVariant closure=QVariant::fromValue(const_cast<void*>(static_cast<const void*>(token.get())));
+   QImage img;
+   {
+      Trace::Span span("poppler render");
+      RenderStats::Timer timer(stats,RenderStats::Render);
+      img=page->renderToImage(DPI,DPI,-1,-1,-1,-1,Poppler::Page::Rotate0,nullptr,nullptr,shouldAbort,closure);
+   }
+   if (img.isNull()||token.isCancelled())
+      return QImage();
+
+   // Convert
+   Trace::Span span("convert");
+   RenderStats::Timer timer(stats,RenderStats::Convert);
+   ImageKernels::toRGB32(img);
+   return img;
+}
+//----------------------------------------------------------------------------
+bool Renderer::shareImage(Generation& gen,RenderSet& set,unsigned index,uint64_t hash,const QImage& img,const unsigned char* packed,uint64_t packedLen)
+   // Let a page use the stored copy of an identical page
+{
+   unique_lock<mutex> guard(gen.residency);
+   auto iter=set.contents.find(hash);
+   if (iter==set.contents.end())
+      return false;
+
+   // Hashes may collide, only identical bytes are shared
+   unsigned other=iter->second;
+   {
+      RenderStats::Timer timer(stats,RenderStats::Hash);
+      if (!(packed?set.cache.holds(other,packed,packedLen):set.cache.holds(other,img)))
+         return false;
+   }
+   if (!set.cache.share(index,other))
+      return false;
+   stats.imageShared(packed?packedLen:img.byteCount());
+   if (!compressed)
+      set.images[index]=new QImage(set.cache.image(index,set.devicePixelRatio));
+   return true;
+}
+//----------------------------------------------------------------------------
+bool Renderer::storeImage(Generation& gen,RenderSet& set,unsigned index,const QImage& img)
+   // Store a full size page in the cache
+{
+   Trace::Span span("store image");
+   uint64_t hash;
+   {
+      RenderStats::Timer timer(stats,RenderStats::Hash);
+      hash=ImageKernels::hash(img);
+   }
+   unsigned len;
+   unsigned char* imgWriter;
+   if (compressed) {
+      vector<unsigned char> packed;
       {
-         if (writer+len>cacheEnd) {
-           cerr << "out of cache space, stopping rendering!" << endl;
-           throw;
-         }
-         imgWriter=writer;
-         writer+=len;
+         RenderStats::Timer timer(stats,RenderStats::Compress);
+         PageCodec::compress(img,packed);
+      }
+      len=packed.size();
+      if (shareImage(gen,set,index,hash,img,packed.data(),len)) {
+         set.frames.offer(index,img);
+         return true;
+      }
+      if (!(imgWriter=allocateImage(gen,set,index,len))) {
+         cerr << "out of cache space for page " << (index+1) << endl;
+         return false;
       }
 
+      RenderStats::Timer timer(stats,RenderStats::Copy);
+      memcpy(imgWriter,packed.data(),len);
+      set.cache.storeCompressed(index,imgWriter,len,img.size());
+      set.frames.offer(index,img);
+   } else {
+      if (shareImage(gen,set,index,hash,img,nullptr,0))
+         return true;
+      len=img.byteCount();
+      if (!(imgWriter=allocateImage(gen,set,index,len))) {
+         cerr << "out of cache space for page " << (index+1) << endl;
+         return false;
+      }
+
+      RenderStats::Timer timer(stats,RenderStats::Copy);
       memcpy(imgWriter,img.bits(),len);
-      images[index]=new QImage(imgWriter,img.width(),img.height(),img.bytesPerLine(),img.format());
+      set.cache.store(index,QImage(imgWriter,img.width(),img.height(),img.bytesPerLine(),img.format()));
+   }
 
-      // Create a thumbnail
-      QImage thumb=img.scaled(thumbSize,Qt::KeepAspectRatio,Qt::SmoothTransformation);
-      len=thumb.byteCount();
+   unique_lock<mutex> guard(gen.residency);
+   set.cache.publish(index);
+   set.contents[hash]=index;
+   if (!compressed)
+      set.images[index]=new QImage(set.cache.image(index,set.devicePixelRatio));
+   return true;
+}
+//----------------------------------------------------------------------------
+bool Renderer::mapDocument(Generation& gen)
+   // Map the document file so that workers can open their own documents
+{
+   shared_ptr<QFile> file=make_shared<QFile>(gen.fileName);
+   if (!file->open(QIODevice::ReadOnly))
+      return false;
+   uchar* data=file->map(0,file->size());
+   if (!data)
+      return false;
+   gen.documentFile=file;
+   gen.documentData=QByteArray::fromRawData(reinterpret_cast<const char*>(data),file->size());
+   return true;
+}
+//----------------------------------------------------------------------------
+Poppler::Document& Renderer::workerDocument(Generation& gen)
+   // The document the calling worker should use
+{
+   unsigned slot=omp_get_thread_num();
+   if (gen.documentData.isEmpty()||(slot>=gen.workerDocs.size()))
+      return *gen.doc;
 
-      unsigned char* thumbWriter;
-#pragma omp critical(writer)
-      {
-         if (writer+len>cacheEnd) {
-            cerr << "out of cache space, stopping rendering!" << endl;
-            throw;
-         }
-         thumbWriter=writer;
-         writer+=len;
+   auto& doc=gen.workerDocs[slot];
+   if (!doc) {
+      doc.reset(Poppler::Document::loadFromData(gen.documentData));
+      if (!doc)
+         return *gen.doc;
+      configureDocument(*doc);
+   }
+   return *doc;
+}
+//----------------------------------------------------------------------------
+void Renderer::renderPreview(Generation& gen,unsigned index)
+   // Render a quick low resolution preview of a page
+{
+   Trace::Span span("render preview");
+   // A broken page is reported when the full size page fails
+   unique_ptr<Poppler::Page> page(workerDocument(gen).page(index));
+   if (!page)
+      return;
+   RenderSet& set=*gen.sets.front();
+   QImage img=renderImage(page.get(),QSize(set.imageSize.width()/previewDivisor,set.imageSize.height()/previewDivisor),gen.token,stats);
+   if (img.isNull())
+      return;
+
+   // The full size page may have overtaken the preview
+   {
+      unique_lock<mutex> guard(gen.residency);
+      if (set.cache.isValid(index))
+         return;
+      gen.previews[index]=img;
+   }
+   if (!gen.token.isCancelled()) {
+      stats.previewDone();
+      QMetaObject::invokeMethod(this,"pageRendered",Qt::QueuedConnection,Q_ARG(unsigned,index));
+   }
+}
+//----------------------------------------------------------------------------
+static bool storeShared(PageCache& cache,unsigned index,const QImage& img,bool compressed)
+   // Store an image in a cache without touching any process local state
+{
+   unsigned char* writer;
+   if (compressed) {
+      vector<unsigned char> packed;
+      PageCodec::compress(img,packed);
+      if (!(writer=cache.allocate(packed.size())))
+         return false;
+      memcpy(writer,packed.data(),packed.size());
+      cache.storeCompressed(index,writer,packed.size(),img.size());
+   } else {
+      if (!(writer=cache.allocate(img.byteCount())))
+         return false;
+      memcpy(writer,img.bits(),img.byteCount());
+      cache.store(index,QImage(writer,img.width(),img.height(),img.bytesPerLine(),img.format()));
+   }
+   cache.publish(index);
+   return true;
+}
+//----------------------------------------------------------------------------
+WorkerPool::Job Renderer::workerJob(const string& description,const vector<int>& files)
+   // Set up the job of a render worker process
+{
+   auto state=make_shared<WorkerState>();
+   int32_t fields[2];
+   if (description.size()<sizeof(fields))
+      return WorkerPool::Job();
+   memcpy(fields,description.data(),sizeof(fields));
+   unsigned setCount=fields[1];
+   uint64_t headerSize=sizeof(fields)+sizeof(int32_t)*2*static_cast<uint64_t>(setCount);
+   if ((files.size()!=setCount)||(description.size()<headerSize))
+      return WorkerPool::Job();
+
+   state->compressed=fields[0];
+   for (unsigned index=0;index<setCount;index++) {
+      int32_t size[2];
+      memcpy(size,description.data()+sizeof(fields)+sizeof(size)*index,sizeof(size));
+      state->imageSizes.push_back(QSize(size[0],size[1]));
+      state->caches.emplace_back(new PageCache());
+      if (!state->caches.back()->adopt(files[index]))
+         return WorkerPool::Job();
+   }
+   state->fileName=QString::fromUtf8(description.data()+headerSize,description.size()-headerSize);
+   return [state](unsigned index) { return renderShared(*state,index); };
+}
+//----------------------------------------------------------------------------
+bool Renderer::renderShared(WorkerState& state,unsigned index)
+   // Render a single page into the shared caches
+{
+   // Each worker process opens the document itself
+   if (!state.doc) {
+      state.doc.reset(Poppler::Document::load(state.fileName));
+      if (!state.doc)
+         return false;
+      configureDocument(*state.doc);
+   }
+   unique_ptr<Poppler::Page> page(state.doc->page(index));
+   if (!page)
+      return false;
+
+   for (unsigned set=0;set<state.caches.size();set++) {
+      if (state.caches[set]->isValid(index))
+         continue;
+      QImage img=renderImage(page.get(),state.imageSizes[set],state.token,state.stats);
+      if (img.isNull()||(!storeShared(*state.caches[set],index,img,state.compressed)))
+         return false;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+void Renderer::adoptPage(Generation& gen,unsigned index)
+   // Pick up a page that a worker process rendered
+{
+   unique_lock<mutex> guard(gen.residency);
+   for (auto& set:gen.sets)
+      if (set->cache.attach(index)&&(!compressed)&&(!set->images[index]))
+         set->images[index]=new QImage(set->cache.image(index,set->devicePixelRatio));
+}
+//----------------------------------------------------------------------------
+void Renderer::renderPage(Generation& gen,unsigned index)
+   // Render a single page
+{
+   Trace::Span span("render page");
+   // Let a worker process render the page, we only pick up the result
+   if (gen.processes) {
+      WorkerPool::Result result=gen.processes->run(index);
+      if (gen.token.isCancelled())
+         return;
+      if (result!=WorkerPool::Done) {
+         cerr << ((result==WorkerPool::Crashed)?"render worker crashed on page ":(result==WorkerPool::TimedOut)?"render worker hung on page ":"unable to render page ") << (index+1) << endl;
+         stats.pageFailed();
+         return;
       }
+      adoptPage(gen,index);
+      stats.pageDone();
+      QMetaObject::invokeMethod(this,"pageRendered",Qt::QueuedConnection,Q_ARG(unsigned,index));
+      return;
+   }
 
-      memcpy(thumbWriter,thumb.bits(),len);
-      thumbnails[index]=new QImage(thumbWriter,thumb.width(),thumb.height(),thumb.bytesPerLine(),thumb.format());
-      thumbWriter+=len;
+   unique_ptr<Poppler::Page> page(workerDocument(gen).page(index));
+   if (!page) {
+      cerr << "unable to parse page " << (index+1) << endl;
+      stats.pageFailed();
+      return;
+   }
 
-      unsigned char* darkThumbWriter;
-#pragma omp critical(writer)
-      {
-         if (writer+len>cacheEnd) {
-            cerr << "out of cache space, stopping rendering!" << endl;
-            throw;
+   // Render all missing resolutions
+   for (auto& set:gen.sets) {
+      if (set->cache.isValid(index))
+         continue;
+      if (gen.token.isCancelled())
+         return;
+
+      QImage img=renderImage(page.get(),set->imageSize,gen.token,stats);
+      if (img.isNull()) {
+         if (!gen.token.isCancelled()) {
+            cerr << "unable to render page " << (index+1) << endl;
+            stats.pageFailed();
          }
-         darkThumbWriter=writer;
-         writer+=len;
+         return;
       }
-      // Create a grayed thumnail
-      unsigned char* reader=thumb.bits();
-      for (unsigned index2=0;index2<len;index2++)
-         darkThumbWriter[index2]=reader[index2]/2;
-      darkThumbnails[index]=new QImage(darkThumbWriter,thumb.width(),thumb.height(),thumb.bytesPerLine(),thumb.format());
-      darkThumbWriter+=len;
+      img.setDevicePixelRatio(set->devicePixelRatio);
+      if (!storeImage(gen,*set,index,img)) {
+         stats.pageFailed();
+         return;
+      }
+   }
+
+   // The preview is no longer needed
+   {
+      unique_lock<mutex> guard(gen.residency);
+      gen.previews[index]=QImage();
+   }
 
-      /// Notify
+   /// Notify
+   if (!gen.token.isCancelled()) {
+      stats.pageDone();
       QMetaObject::invokeMethod(this,"pageRendered",Qt::QueuedConnection,Q_ARG(unsigned,index));
    }
-   stopped=true;
 }
 //----------------------------------------------------------------------------
-void Renderer::stop()
-   // Stop the rendered
+void Renderer::run()
+   // Render the images
 {
-   if (!stopped) {
-      mustStop=true;
-      while (!stopped)
-         QThread::msleep(10);
+   {
+      unique_lock<mutex> guard(lifecycle);
+      if (stopping)
+         return;
+      running=true;
+   }
+
+   // Render previews of all pages, then all pages at full size, the pages around the current page first.
+   // Move on to the next generation when prepare is called again
+#pragma omp parallel num_threads(workerProcesses?workerProcesses:(threads?threads:omp_get_max_threads()))
+   {
+      Trace::nameThread("render worker");
+      shared_ptr<Generation> gen;
+      while ((gen=nextGeneration(gen))) {
+         unsigned index;
+         while ((index=gen->previewQueue.next())!=RenderQueue::none) {
+            renderPreview(*gen,index);
+            gen->previewQueue.finished(index);
+         }
+         while ((index=gen->queue.next())!=RenderQueue::none) {
+            renderPage(*gen,index);
+            gen->queue.finished(index);
+         }
+      }
    }
+
+   {
+      unique_lock<mutex> guard(lifecycle);
+      running=false;
+   }
+   lifecycleChanged.notify_all();
+}
+//----------------------------------------------------------------------------
+void Renderer::requestThumbnails(const vector<unsigned>& pages,const QSize& size)
+   // Render thumbnails of pages
+{
+   vector<TileCache::Tile> request;
+   request.reserve(pages.size());
+   for (unsigned index:pages)
+      request.push_back(TileCache::Tile{index,size,0,0});
+   thumbs.request(request);
+}
+//----------------------------------------------------------------------------
+void Renderer::setFocus(unsigned page)
+   // Render the pages around a page first
+{
+   if (!current)
+      return;
+   Generation& gen=*current;
+   gen.previewQueue.setFocus(page);
+   gen.queue.setFocus(page);
+
+   // Bring back evicted pages before they are needed
+   {
+      unique_lock<mutex> guard(gen.residency);
+      gen.focus=page;
+      if (page<gen.lastUse.size())
+         gen.lastUse[page]=++gen.useClock;
+   }
+   if (cacheBudget) {
+      unsigned from=(page>RenderQueue::lookBehind)?(page-RenderQueue::lookBehind):0;
+      for (unsigned index=from;(index<=page+RenderQueue::lookAhead)&&(index<gen.pageCount);index++)
+         for (auto& set:gen.sets)
+            if (!set->cache.isValid(index))
+               gen.queue.requeue(index);
+   }
+
+   // Decode the neighboring pages ahead of time
+   if (compressed) {
+      vector<unsigned> pages;
+      for (int delta:{0,1,-1,2})
+         if ((static_cast<int>(page)+delta>=0)&&(page+delta<gen.pageCount))
+            pages.push_back(page+delta);
+      for (auto& set:gen.sets)
+         set->frames.request(pages);
+   }
+}
+//----------------------------------------------------------------------------
+void Renderer::setCompression(bool compressed)
+   // Store the full size pages compressed
+{
+   this->compressed=compressed;
+}
+//----------------------------------------------------------------------------
+void Renderer::setCacheBudget(uint64_t bytes)
+   // Limit the space for full size pages
+{
+   cacheBudget=bytes;
+}
+//----------------------------------------------------------------------------
+void Renderer::setPersistentCache(bool persistent)
+   // Keep the rendered pages in cache files that are reused by later runs
+{
+   persistentCache=persistent;
+}
+//----------------------------------------------------------------------------
+void Renderer::setThreads(unsigned threads)
+   // Set the number of worker threads
+{
+   this->threads=threads;
 }
 //----------------------------------------------------------------------------
+void Renderer::setWorkerProcesses(unsigned count)
+   // Render in a number of forked worker processes
+{
+   workerProcesses=count;
+}
+//----------------------------------------------------------------------------
+void Renderer::setPrivateDocuments(bool privateDocuments)
+   // Let every worker open its own document
+{
+   this->privateDocuments=privateDocuments;
+}
+//----------------------------------------------------------------------------
+bool Renderer::measureScaling(const shared_ptr<Poppler::Document>& doc,const QString& fileName,const QSize& size,unsigned maxThreads)
+   // Measure how rendering all pages scales with the number of threads
+{
+   Generation gen;
+   gen.doc=doc;
+   gen.fileName=fileName;
+   configureDocument(*doc);
+   if (!mapDocument(gen)) {
+      cerr << "unable to map " << fileName.toLocal8Bit().constData() << endl;
+      return false;
+   }
+   unsigned pageCount=doc->numPages();
+   if (!maxThreads)
+      maxThreads=omp_get_max_threads();
 
+   cout << setw(8) << "threads" << " " << setw(10) << "shared" << " " << setw(8) << "speedup" << " " << setw(10) << "private" << " " << setw(8) << "speedup" << endl;
+   double base[2]={0,0};
+   for (unsigned threadCount=1;;threadCount=min(2*threadCount,maxThreads)) {
+      cout << setw(8) << threadCount;
+      for (unsigned variant=0;variant<2;variant++) {
+         // The private documents are opened before the clock starts
+         gen.workerDocs.clear();
+         gen.workerDocs.resize(threadCount);
+         if (variant)
+            for (auto& d:gen.workerDocs) {
+               d.reset(Poppler::Document::loadFromData(gen.documentData));
+               if (!d) {
+                  cerr << "unable to load " << fileName.toLocal8Bit().constData() << " from memory" << endl;
+                  return false;
+               }
+               configureDocument(*d);
+            }
 
+         // Render all pages once, handing them out dynamically
+         atomic<unsigned> next(0);
+         auto start=chrono::steady_clock::now();
+#pragma omp parallel num_threads(threadCount)
+         {
+            Poppler::Document& d=variant?*gen.workerDocs[omp_get_thread_num()]:*doc;
+            unsigned index;
+            while ((index=next++)<pageCount) {
+               unique_ptr<Poppler::Page> page(d.page(index));
+               if (page)
+                  renderImage(page.get(),size,gen.token,stats);
+            }
+         }
+         double seconds=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+         if (threadCount==1)
+            base[variant]=seconds;
+         cout << " " << setw(9) << fixed << setprecision(2) << seconds << "s" << " " << setw(7) << setprecision(2) << (base[variant]/seconds) << "x";
+      }
+      cout << endl;
+      if (threadCount==maxThreads)
+         break;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+QImage Renderer::getPage(unsigned resolution,unsigned index)
+   // Get a specific page for a resolution
+{
+   if ((!current)||(index>=current->pageCount)||(resolution>=current->sets.size()))
+      return QImage();
+   Generation& gen=*current;
+   RenderSet& set=*gen.sets[resolution];
+   unique_lock<mutex> guard(gen.residency);
+   gen.lastUse[index]=++gen.useClock;
+   if (compressed) {
+      guard.unlock();
+      return set.frames.get(index);
+   }
+   return set.images[index]?*set.images[index]:QImage();
+}
+//----------------------------------------------------------------------------
+QImage Renderer::getPreview(unsigned index)
+   // Get the preview of a page
+{
+   if ((!current)||(index>=current->pageCount))
+      return QImage();
+   Generation& gen=*current;
+   unique_lock<mutex> guard(gen.residency);
+   return gen.previews[index];
+}
+//----------------------------------------------------------------------------
+QSize Renderer::getPageSize(unsigned resolution,unsigned index) const
+   // The size of a page for a resolution in device pixels
+{
+   if ((!current)||(index>=current->pageCount)||(resolution>=current->sets.size()))
+      return QSize();
+   return current->sets[resolution]->cache.imageSize(index);
+}
+//----------------------------------------------------------------------------
+void Renderer::stop()
+   // Stop the rendered
+{
+   unique_lock<mutex> guard(lifecycle);
+   stopping=true;
+   if (current) {
+      current->token.cancel();
+      current->previewQueue.close();
+      current->queue.close();
+   }
+   lifecycleChanged.notify_all();
+   lifecycleChanged.wait(guard,[this]() { return !running; });
+
+   // Let the thread itself finish, too
+   guard.unlock();
+   wait();
+   tiles.stop();
+   thumbs.stop();
+   stopFingerprints();
+}
+//----------------------------------------------------------------------------
@@ -1,12 +1,29 @@
 #ifndef H_BackgroundRenderer
 #define H_BackgroundRenderer
 //----------------------------------------------------------------------------
+#include "CancelToken.hpp"
+#include "FrameCache.hpp"
+#include "PageCache.hpp"
+#include "RenderQueue.hpp"
+#include "RenderStats.hpp"
+#include "ScreenInfo.hpp"
+#include "TileCache.hpp"
+#include "WorkerPool.hpp"
+#include <QByteArray>
+#include <QString>
 #include <QThread>
 #include <QSize>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 //----------------------------------------------------------------------------
-namespace Poppler { class Document; }
+namespace Poppler { class Document; class Page; }
 //----------------------------------------------------------------------------
+class QFile;
 class QImage;
 //----------------------------------------------------------------------------
 /// Renders PDF files to images in a background thread
@@ -15,27 +32,167 @@ class Renderer  : public QThread
    Q_OBJECT
 
    private:
-   /// The document
-   Poppler::Document* doc;
-   /// The desired image size
-   QSize imageSize;
-   /// The desired thumbnail size
-   QSize thumbSize;
+   /// The images for one resolution
+   struct RenderSet {
+      /// The desired image size in device pixels
+      QSize imageSize;
+      /// The device pixel ratio of the images
+      double devicePixelRatio;
+      /// The cache
+      PageCache cache;
+      /// The images
+      std::vector<QImage*> images;
+      /// The decompressed pages (if compressed)
+      FrameCache frames;
+      /// A page holding the full size image with a given content hash. Identical pages share that image. Protected by the residency lock
+      std::unordered_map<uint64_t,unsigned> contents;
+   };
+   /// Everything rendered for one prepare call. Kept alive by the workers until they are done with it
+   struct Generation {
+      /// The document
+      std::shared_ptr<Poppler::Document> doc;
+      /// The mapped document file if every worker opens its own document
+      std::shared_ptr<QFile> documentFile;
+      /// The bytes of the mapped document file
+      QByteArray documentData;
+      /// The documents of the workers, indexed by thread number. Each one is only touched by its own thread
+      std::vector<std::unique_ptr<Poppler::Document>> workerDocs;
+      /// The file name of the document
+      QString fileName;
+      /// The hash of the document, empty if the persistent cache is not usable
+      QByteArray fileHash;
+      /// The number of pages
+      unsigned pageCount;
+      /// The images for each resolution
+      std::vector<std::unique_ptr<RenderSet>> sets;
+      /// Low resolution previews of the pages that are not fully rendered yet
+      std::vector<QImage> previews;
+      /// The render order of the previews. Drained before the full size pages
+      RenderQueue previewQueue;
+      /// The render order
+      RenderQueue queue;
+      /// Cancels all render jobs of this generation
+      CancelToken token;
+      /// Protects the images and the residency information
+      std::mutex residency;
+      /// The last use of each page
+      std::vector<uint64_t> lastUse;
+      /// The use counter
+      uint64_t useClock;
+      /// The current page
+      unsigned focus;
+      /// The worker processes, if pages are rendered out of process
+      std::unique_ptr<WorkerPool> processes;
 
-   /// The images
-   std::vector<QImage*> images;
-   /// The thumbnails
-   std::vector<QImage*> thumbnails,darkThumbnails;
+      /// Constructor
+      Generation();
+      /// Destructor
+      ~Generation();
+   };
 
-   /// The cache file
-   void* file;
-   /// The cache
-   unsigned char* cacheStart,*cacheEnd;
-   /// Done?
-   bool stopped,mustStop;
+   /// A changed version of the current document whose pages were compared in the background
+   struct PendingReload {
+      /// The new version
+      std::shared_ptr<Poppler::Document> doc;
+      /// The version it was compared with
+      std::shared_ptr<Poppler::Document> previous;
+      /// The hash of the new file, empty if the persistent cache is not usable
+      QByteArray fileHash;
+      /// The fingerprints of the new version
+      std::vector<QByteArray> fingerprints;
+      /// The old page with the same content for each page, or RenderQueue::none. Empty if nothing can be reused
+      std::vector<unsigned> reuse;
+   };
+   /// The state of a render worker process
+   struct WorkerState {
+      /// The file name of the document
+      QString fileName;
+      /// Store the pages compressed?
+      bool compressed;
+      /// The image size of each cache
+      std::vector<QSize> imageSizes;
+      /// The caches, shared with the renderer
+      std::vector<std::unique_ptr<PageCache>> caches;
+      /// The document, opened on the first page
+      std::unique_ptr<Poppler::Document> doc;
+      /// Never cancelled, the renderer kills the worker instead
+      CancelToken token;
+      /// The time spent in the render stages. Not reported
+      RenderStats stats;
+   };
 
-   /// Cleanup
-   void cleanup();
+   /// The current generation. Only replaced by the thread that calls prepare
+   std::shared_ptr<Generation> current;
+   /// The tiles of magnified pages
+   TileCache tiles;
+   /// The thumbnails of the overview, rendered on demand at the layout size. Each one is a single tile
+   TileCache thumbs;
+   /// Computes the page fingerprints of the current document in the background, while its file is still intact, or compares a changed version
+   std::thread fingerprinter;
+   /// Cancels computing the fingerprints
+   CancelToken fingerprintToken;
+   /// The content fingerprint of each page of the current document. Complete once fingerprinted is set
+   std::vector<QByteArray> fingerprints;
+   /// Are the fingerprints complete?
+   std::atomic<bool> fingerprinted;
+   /// Protects the pending reload
+   std::mutex reloadLock;
+   /// A compared version waiting for finishReload
+   std::unique_ptr<PendingReload> pendingReload;
+   /// The number of worker threads (0 for the OpenMP default)
+   unsigned threads;
+   /// Does every worker open its own document?
+   bool privateDocuments;
+   /// The number of worker processes (0 to render in process)
+   unsigned workerProcesses;
+   /// Store the full size pages compressed?
+   bool compressed;
+   /// The maximum space for full size pages (0 if unlimited)
+   uint64_t cacheBudget;
+   /// Reuse the cache files of previous runs?
+   bool persistentCache;
+   /// The time spent in the render stages
+   RenderStats stats;
+   /// Protects the current generation and the worker state
+   std::mutex lifecycle;
+   /// Signals a new generation, a stop request, or finished workers
+   std::condition_variable lifecycleChanged;
+   /// Are the workers running?
+   bool running;
+   /// Must the workers stop?
+   bool stopping;
+
+   /// Prepare the rendering. For a changed version of the current document, reuse holds the old page with the same content for each page,
+   /// or RenderQueue::none if the page changed. Those pages are copied instead of rendered. The file hash is only used for another document
+   bool prepare(const std::shared_ptr<Poppler::Document>& doc,const QString& fileName,const std::vector<ScreenInfo::Resolution>& resolutions,const std::vector<unsigned>& reuse,const QByteArray& fileHash);
+   /// Wait for a generation other than the given one. Returns nullptr if the workers must stop
+   std::shared_ptr<Generation> nextGeneration(const std::shared_ptr<Generation>& previous);
+   /// Stop computing the fingerprints
+   void stopFingerprints();
+   /// Map the document file so that workers can open their own documents
+   bool mapDocument(Generation& gen);
+   /// The document the calling worker should use
+   Poppler::Document& workerDocument(Generation& gen);
+   /// Render a quick low resolution preview of a page
+   void renderPreview(Generation& gen,unsigned index);
+   /// Render a single page
+   void renderPage(Generation& gen,unsigned index);
+   /// Render a single page into the shared caches. Runs in a worker process
+   static bool renderShared(WorkerState& state,unsigned index);
+   /// Pick up a page that a worker process rendered
+   void adoptPage(Generation& gen,unsigned index);
+   /// Render a page to fit into a size. Returns a null image if cancelled
+   static QImage renderImage(Poppler::Page* page,const QSize& size,const CancelToken& token,RenderStats& stats);
+   /// Let a full size page use the stored copy of an identical page instead of storing its own. The packed data is the compressed image, if any
+   bool shareImage(Generation& gen,RenderSet& set,unsigned index,uint64_t hash,const QImage& img,const unsigned char* packed,uint64_t packedLen);
+   /// Store a full size page in the cache. Identical pages are stored once
+   bool storeImage(Generation& gen,RenderSet& set,unsigned index,const QImage& img);
+   /// Allocate space for a full size page, evicting other pages if needed
+   unsigned char* allocateImage(Generation& gen,RenderSet& set,unsigned index,uint64_t len);
+   /// Find the least recently used page that may be evicted. Requires the residency lock
+   unsigned findVictim(Generation& gen,RenderSet& set,unsigned index);
+   /// Drop the full size image of a page. Requires the residency lock
+   void evict(RenderSet& set,unsigned index);
 
    Renderer(const Renderer&);
    void operator=(const Renderer&);
@@ -46,26 +203,78 @@ class Renderer  : public QThread
    /// Destructor
    ~Renderer();
 
-   /// Prepare the rendering. Must be called before run or starting a thread
-   bool prepare(Poppler::Document& doc,const QSize& imageSize,const QSize& thumbSize);
+   /// Prepare the rendering for a number of resolutions. May be called again while the workers run, the previous generation is cancelled and winds down in the background.
+   /// For the same document the images of unchanged resolutions are kept
+   bool prepare(const std::shared_ptr<Poppler::Document>& doc,const QString& fileName,const std::vector<ScreenInfo::Resolution>& resolutions);
+   /// Switch the current document to other resolutions. Only the new resolutions are rendered
+   bool setResolutions(const std::vector<ScreenInfo::Resolution>& resolutions);
+   /// Start switching to a changed version of the current document file. The file is hashed and the pages are compared in the background,
+   /// reloadPrepared is signalled once finishReload can switch. Nothing is signalled if the file did not change
+   void reload(const std::shared_ptr<Poppler::Document>& doc);
+   /// Switch to the version compared by reload. Only pages whose content changed are rendered again, the focus first.
+   /// Returns false if there is no compared version or it cannot be prepared
+   bool finishReload(const std::vector<ScreenInfo::Resolution>& resolutions);
+   /// Fingerprint the pages of the current document in the background, so that a later reload finds the unchanged pages. Must be called before the file changes
+   void startFingerprints();
+   /// Get the page fingerprints of the current document. Returns false if they are not computed yet
+   bool getFingerprints(std::vector<QByteArray>& result) const;
+   /// Find the old page with the same content for every new page, or RenderQueue::none. Returns the number of new pages without a match
+   static unsigned matchPages(const std::vector<QByteArray>& before,const std::vector<QByteArray>& after,std::vector<unsigned>& reuse);
 
    /// Run the renderer. Usually called by starting the thread, but can be called directly, too.
    void run();
-   /// Stop the rendered
+   /// Stop the rendered. Cancels the running render jobs and waits for the workers
    void stop();
+   /// Render the pages around a page first
+   void setFocus(unsigned page);
+   /// Store the full size pages compressed. Must be called before prepare
+   void setCompression(bool compressed);
+   /// Limit the space for full size pages, evicting pages as needed. 0 means unlimited. Must be called before prepare
+   void setCacheBudget(uint64_t bytes);
+   /// Keep the rendered pages in cache files that are reused by later runs (the default). Otherwise anonymous files are used. Must be called before prepare
+   void setPersistentCache(bool persistent);
+   /// Set the number of worker threads, 0 for the OpenMP default. Must be called before run
+   void setThreads(unsigned threads);
+   /// Let every worker open its own document from the mapped file instead of sharing one. Must be called before prepare
+   void setPrivateDocuments(bool privateDocuments);
+   /// Render in a number of forked worker processes that write straight into the cache files. A crashing page only kills its worker.
+   /// The cache budget is ignored with worker processes. Must be called before prepare, WorkerPool::startServer must have been called with workerJob
+   void setWorkerProcesses(unsigned count);
+   /// Set up the job of a render worker process from the description the renderer passes to its worker pool. Runs in the worker process
+   static WorkerPool::Job workerJob(const std::string& description,const std::vector<int>& files);
+   /// Measure how rendering all pages scales with the number of threads, with a shared and with private documents
+   bool measureScaling(const std::shared_ptr<Poppler::Document>& doc,const QString& fileName,const QSize& size,unsigned maxThreads);
 
+   /// The time spent in the render stages. Worker processes are not included
+   RenderStats& getStats() { return stats; }
    /// The number of pages
-   unsigned getPageCount() const { return images.size(); }
-   /// Get a specific page
-   QImage* getPage(unsigned index) const { return (index<images.size())?images[index]:0; }
-   /// Get a specific thumbnail page
-   QImage* getThumbnailPage(unsigned index) const { return (index<images.size())?thumbnails[index]:0; }
-   /// Get a specific thumbnail page
-   QImage* getDarkThumbnailPage(unsigned index) const { return (index<images.size())?darkThumbnails[index]:0; }
+   unsigned getPageCount() const { return current?current->pageCount:0; }
+   /// Get a specific page for a resolution. Returns a null image if the page is not available yet
+   QImage getPage(unsigned resolution,unsigned index);
+   /// Get the preview of a page. Returns a null image if there is none or the page is already rendered
+   QImage getPreview(unsigned index);
+   /// The size of a page for a resolution in device pixels. Empty if the page is not available yet
+   QSize getPageSize(unsigned resolution,unsigned index) const;
+   /// Get a tile of a magnified page. Returns a null image if the tile is not available yet
+   QImage getTile(const TileCache::Tile& tile) { return tiles.get(tile); }
+   /// Render tiles of magnified pages, most important first. Replaces all previous tile requests
+   void requestTiles(const std::vector<TileCache::Tile>& request) { tiles.request(request); }
+   /// Get the thumbnail of a page rendered to fit into a size in device pixels. Returns a null image if it is not available yet
+   QImage getThumbnail(unsigned index,const QSize& size) { return thumbs.get(TileCache::Tile{index,size,0,0}); }
+   /// Render thumbnails of pages to fit into a size in device pixels, most important first. Replaces all previous thumbnail requests
+   void requestThumbnails(const std::vector<unsigned>& pages,const QSize& size);
 
    signals:
    /// A page was rendered
    void pageRendered(unsigned index);
+   /// A tile of a page was rendered
+   void tileRendered(unsigned index);
+   /// A thumbnail of a page was rendered
+   void thumbnailRendered(unsigned index);
+   /// The pages of a reloaded document were compared, see finishReload
+   void reloadPrepared();
+   /// The page fingerprints of the current document were computed in the background
+   void fingerprintsReady();
 };
 //----------------------------------------------------------------------------
 #endif
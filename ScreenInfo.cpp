@@ -1,46 +1,34 @@
 #include "ScreenInfo.hpp"
-#include <QApplication>
-#include <QDesktopWidget>
+#include <QGuiApplication>
+#include <QScreen>
 //----------------------------------------------------------------------------
 ScreenInfo::ScreenInfo()
    // Constructor
 {
-   QDesktopWidget* desktop=QApplication::desktop();
-
-   // Collect all screens
-   unsigned count=desktop->numScreens(),primary=desktop->primaryScreen();
-   screens.resize(count);
-   for (unsigned index=0;index<count;index++)
-      screens[index].geometry=desktop->screenGeometry(index);
-   if (primary)
-      std::swap(screens[primary],screens[0]);
-
-   // Compute the common part
-   // XXX currently just the large display, should pick reasonable rectangle based upon common resolutions, aspect ratio etc.
-   commonRect=QRect(0,0,screens[0].geometry.width(),screens[0].geometry.height());
-   for (unsigned index=1;index<count;index++) {
-      if (screens[index].geometry.width()<commonRect.width())
-         commonRect=QRect(0,0,screens[index].geometry.width(),commonRect.height());
-      if (screens[index].geometry.height()<commonRect.height())
-         commonRect=QRect(0,0,commonRect.width(),screens[index].geometry.height());
+   // Collect all screens, the primary screen first
+   QScreen* primary=QGuiApplication::primaryScreen();
+   for (QScreen* s:QGuiApplication::screens()) {
+      Screen screen;
+      screen.geometry=s->geometry();
+      screen.target=QRect(0,0,screen.geometry.width(),screen.geometry.height());
+      screen.devicePixelRatio=s->devicePixelRatio();
+      screen.resolution=0;
+      if (s==primary)
+         screens.insert(screens.begin(),screen); else
+         screens.push_back(screen);
    }
 
-   // Build the target rectangles
-   for (unsigned index=0;index<count;index++) {
-      unsigned w,h;
-      if ((commonRect.width()>screens[index].geometry.width())||(commonRect.height()>screens[index].geometry.height())) {
-         double cx=static_cast<double>(screens[index].geometry.width())/static_cast<double>(commonRect.width());
-         double cy=static_cast<double>(screens[index].geometry.height())/static_cast<double>(commonRect.height());
-         double c=(cx<cy)?cx:cy;
-         w=commonRect.width()*c;
-         h=commonRect.height()*c;
-      } else {
-         w=commonRect.width();
-         h=commonRect.height();
-      }
-      unsigned x=(screens[index].geometry.width()-w)/2;
-      unsigned y=(screens[index].geometry.height()-h)/2;
-      screens[index].target=QRect(x,y,w,h);
+   // Each screen gets pages rendered at its native resolution. Screens with the same resolution share them
+   for (auto& s:screens) {
+      QSize size(s.target.width()*s.devicePixelRatio+0.5,s.target.height()*s.devicePixelRatio+0.5);
+      s.resolution=resolutions.size();
+      for (unsigned index=0;index<resolutions.size();index++)
+         if ((resolutions[index].size==size)&&(resolutions[index].devicePixelRatio==s.devicePixelRatio)) {
+            s.resolution=index;
+            break;
+         }
+      if (s.resolution==resolutions.size())
+         resolutions.push_back(Resolution{size,s.devicePixelRatio});
    }
 }
 //----------------------------------------------------------------------------
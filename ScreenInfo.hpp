@@ -4,24 +4,33 @@
 #include <QRect>
 #include <vector>
 //----------------------------------------------------------------------------
-class QApplication;
-//----------------------------------------------------------------------------
 /// Information about all attached screens
 class ScreenInfo
 {
    public:
+   /// A resolution pages are rendered for
+   struct Resolution {
+      /// The size in device pixels
+      QSize size;
+      /// The device pixel ratio
+      qreal devicePixelRatio;
+   };
    /// A screen
    struct Screen {
       /// The total geometry
       QRect geometry;
-      /// The (relative) target for the common rectangle
+      /// The (relative) target for the presentation
       QRect target;
+      /// The device pixel ratio
+      qreal devicePixelRatio;
+      /// The index of the resolution
+      unsigned resolution;
    };
    private:
    /// All screens
    std::vector<Screen> screens;
-   /// The common rectangle
-   QRect commonRect;
+   /// All distinct resolutions
+   std::vector<Resolution> resolutions;
 
    public:
    /// Constructor
@@ -33,8 +42,12 @@ class ScreenInfo
    unsigned screenCount() const { return screens.size(); }
    /// A specfic screen
    const Screen& screen(unsigned index) const { return screens[index]; }
-   /// The common rectangle
-   const QRect& common() const { return commonRect; }
+   /// The number of distinct resolutions
+   unsigned resolutionCount() const { return resolutions.size(); }
+   /// A specific resolution
+   const Resolution& resolution(unsigned index) const { return resolutions[index]; }
+   /// All distinct resolutions
+   const std::vector<Resolution>& allResolutions() const { return resolutions; }
 };
 //----------------------------------------------------------------------------
 #endif
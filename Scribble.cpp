@@ -1,38 +1,176 @@
 #include "Scribble.hpp"
+#include "Trace.hpp"
 #include <QPainter>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 //----------------------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------------------
-QRect Scribble::Line::getBB() const
-   // Get the bounding box
+static int16_t clampCoordinate(int v)
+   // Clamp a coordinate to the stored range
 {
-   int minx=min(x1,x2),maxx=max(x1,x2);
-   int miny=min(y1,y2),maxy=max(y1,y2);
-   return QRect(QPoint(minx-2*width,miny-2*width),QPoint(maxx+2*width,maxy+2*width));
+   return max<int>(numeric_limits<int16_t>::min(),min<int>(numeric_limits<int16_t>::max(),v));
 }
 //----------------------------------------------------------------------------
-double Scribble::Line::distanceToSquared(int x,int y) const
+static double distanceToSquared(int x1,int y1,int x2,int y2,int x,int y)
+   // Compute the distance of a point to a segment
 {
    // Length squared
    double len=(x2-x1)*(x2-x1)+(y2-y1)*(y2-y1);
 
    // Just a point?
    if (!len)
-      return (x1-x)*(x1-x)+(y1-y)*(y1-1);
+      return (x1-x)*(x1-x)+(y1-y)*(y1-y);
 
    // Find the projection on the line
-   double t=((x-x1)*(x2-x1)+(y-x1)*(y2-y1))/len;
+   double t=((x-x1)*(x2-x1)+(y-y1)*(y2-y1))/len;
    if (t<=0.0)
-      return (x1-x)*(x1-x)+(y1-y)*(y1-1);
+      return (x1-x)*(x1-x)+(y1-y)*(y1-y);
    if (t>=1.0)
-      return (x2-x)*(x2-x)+(y2-y)*(y2-1);
+      return (x2-x)*(x2-x)+(y2-y)*(y2-y);
 
    // Compute the projection
    double px=x1+(t*(x2-x1)),py=y1+(t*(y2-y1));
    return (px-x)*(px-x)+(py-y)*(py-y);
 }
 //----------------------------------------------------------------------------
+static QRect lineBB(int x1,int y1,int x2,int y2,unsigned width)
+   // Get the bounding box of a line
+{
+   int minx=min(x1,x2),maxx=max(x1,x2);
+   int miny=min(y1,y2),maxy=max(y1,y2);
+   return QRect(QPoint(minx-2*width,miny-2*width),QPoint(maxx+2*width,maxy+2*width));
+}
+//----------------------------------------------------------------------------
+template <class T> void Scribble::forCells(const QRect& bb,const T& callback)
+   // Call a function for every cell a rectangle touches
+{
+   // Round towards negative infinity, coordinates can be negative
+   auto cell=[](int v) { return (v>=0)?(v/cellSize):(-((-v+cellSize-1)/cellSize)); };
+   for (int y=cell(bb.top()),maxY=cell(bb.bottom());y<=maxY;y++)
+      for (int x=cell(bb.left()),maxX=cell(bb.right());x<=maxX;x++)
+         callback(cellKey(x,y));
+}
+//----------------------------------------------------------------------------
+unsigned Scribble::strokeOf(unsigned point) const
+   // The stroke that contains a point
+{
+   auto iter=upper_bound(strokes.begin(),strokes.end(),point,[](unsigned p,const Stroke& s) { return p<s.first; });
+   return (iter-strokes.begin())-1;
+}
+//----------------------------------------------------------------------------
+QRect Scribble::segmentBB(unsigned point,unsigned width) const
+   // Get the bounding box of a segment
+{
+   return lineBB(xs[point],ys[point],xs[point+1],ys[point+1],width);
+}
+//----------------------------------------------------------------------------
+double Scribble::distanceToSquared(unsigned point,int x,int y) const
+   // Compute the distance of a point to a segment
+{
+   return ::distanceToSquared(xs[point],ys[point],xs[point+1],ys[point+1],x,y);
+}
+//----------------------------------------------------------------------------
+unsigned Scribble::findStyle(unsigned width,QColor color)
+   // Find or add a style
+{
+   // Usually the latest style
+   for (unsigned index=styles.size();index>0;--index)
+      if ((styles[index-1].width==width)&&(styles[index-1].color==color))
+         return index-1;
+   styles.push_back(Style{color,width});
+   return styles.size()-1;
+}
+//----------------------------------------------------------------------------
+void Scribble::indexSegment(unsigned point,unsigned width)
+   // Add a segment to the grid
+{
+   forCells(segmentBB(point,width),[this,point](uint64_t key) { grid[key].push_back(point); });
+}
+//----------------------------------------------------------------------------
+void Scribble::unindexSegment(unsigned point,unsigned width)
+   // Remove a segment from the grid
+{
+   forCells(segmentBB(point,width),[this,point](uint64_t key) {
+      auto iter=grid.find(key);
+      if (iter==grid.end())
+         return;
+      // Search from the back, recent segments change most often
+      auto& cell=iter->second;
+      auto pos=find(cell.rbegin(),cell.rend(),point);
+      if (pos==cell.rend())
+         return;
+      *pos=cell.back();
+      cell.pop_back();
+      if (cell.empty())
+         grid.erase(iter);
+   });
+}
+//----------------------------------------------------------------------------
+QRect Scribble::addPoint(int x,int y)
+   // Add a point to the open stroke
+{
+   unsigned last=xs.size()-1,width=styles[strokes.back().style].width;
+   int fx=xs[last-1],fy=ys[last-1];
+
+   // Can the last segment be stretched to the new point without moving away from any input point?
+   pending.emplace_back(x,y);
+   bool fits=pending.size()<=maxPending;
+   for (unsigned index=0;fits&&(index<pending.size());index++)
+      fits=::distanceToSquared(fx,fy,x,y,pending[index].first,pending[index].second)<=tolerance*tolerance;
+
+   if (fits) {
+      QRect bb=segmentBB(last-1,width);
+      unindexSegment(last-1,width);
+      xs[last]=x; ys[last]=y;
+      indexSegment(last-1,width);
+      return bb|segmentBB(last-1,width);
+   }
+
+   // No, the last point becomes fixed
+   pending.assign(1,make_pair(x,y));
+   xs.push_back(x); ys.push_back(y); cut.push_back(0);
+   strokes.back().count++;
+   indexSegment(last,width);
+   return segmentBB(last,width);
+}
+//----------------------------------------------------------------------------
+void Scribble::compact()
+   // Drop erased segments and rebuild the grid
+{
+   vector<Stroke> newStrokes;
+   vector<int16_t> newXs,newYs;
+   for (auto& s:strokes) {
+      // Every run of remaining segments becomes a stroke
+      unsigned end=s.first+s.count;
+      for (unsigned start=s.first;start+1<end;) {
+         if (cut[start]) {
+            ++start;
+            continue;
+         }
+         unsigned stop=start;
+         while ((stop+1<end)&&(!cut[stop]))
+            ++stop;
+         newStrokes.push_back(Stroke{static_cast<unsigned>(newXs.size()),stop-start+1,s.style});
+         newXs.insert(newXs.end(),xs.begin()+start,xs.begin()+stop+1);
+         newYs.insert(newYs.end(),ys.begin()+start,ys.begin()+stop+1);
+         start=stop;
+      }
+   }
+   strokes.swap(newStrokes);
+   xs.swap(newXs); ys.swap(newYs);
+   cut.assign(xs.size(),0);
+   cutCount=0;
+
+   grid.clear();
+   for (auto& s:strokes)
+      for (unsigned index=s.first,limit=s.first+s.count-1;index<limit;index++)
+         indexSegment(index,styles[s.style].width);
+}
+//----------------------------------------------------------------------------
 Scribble::Scribble()
+  : cutCount(0),open(false),revision(0)
   // Constructor
 {
 }
@@ -42,89 +180,214 @@ Scribble::~Scribble()
 {
 }
 //----------------------------------------------------------------------------
-void Scribble::paint(QPainter& painter,const QRect& target)
+void Scribble::paint(QPainter& painter,const QRect& target,unsigned from,unsigned to)
    // Draw the scribble
 {
-   if (lines.empty())
+   Trace::Span span("scribble paint");
+   to=min<unsigned>(to,xs.size());
+   if ((from>=to)||strokes.empty())
       return;
 
-   // Initialize
+   // Initialize. Round ends, so that lines drawn one at a time look like whole strokes
    int dx=target.left(),dy=target.top();
-   unsigned lastStyle=0;
+   unsigned lastStyle=~0u;
    QPen pen;
-   pen.setColor(lines[lastStyle].color);
-   pen.setWidth(lines[lastStyle].width);
-   painter.setPen(pen);
+   pen.setCapStyle(Qt::RoundCap);
+   pen.setJoinStyle(Qt::RoundJoin);
+
+   // Draw every run of segments that were not erased as one polyline
+   vector<QPoint> run;
+   for (unsigned index=strokeOf(from);index<strokes.size();index++) {
+      auto& s=strokes[index];
+      if (s.first>=to)
+         break;
+      unsigned begin=max(s.first,from),end=min(s.first+s.count-1,to);
+      if (begin>=end)
+         continue;
 
-   // Find segments
-   for (unsigned index=0,limit=lines.size();index!=limit;) {
       // Update the pen if needed
-      if ((lines[index].width!=lines[lastStyle].width)||(lines[index].color!=lines[lastStyle].color)) {
-         lastStyle=index;
-         pen.setColor(lines[lastStyle].color);
-         pen.setWidth(lines[lastStyle].width);
+      if (s.style!=lastStyle) {
+         lastStyle=s.style;
+         pen.setColor(styles[lastStyle].color);
+         pen.setWidth(styles[lastStyle].width);
          painter.setPen(pen);
       }
 
-
-      // Can we continue the line?
-      unsigned step=index+1;
-      while ((step!=limit)&&(lines[step].x1==lines[step-1].x2)&&(lines[step].y1==lines[step-1].y2)&&(lines[step].color==lines[step-1].color)&&(lines[step].width==lines[step-1].width))
-         ++step;
-
-      // Construct the line segment
-      vector<QPoint> segment;
-      for (;index!=step;++index)
-         segment.push_back(QPoint(lines[index].x1+dx,lines[index].y1+dy));
-      segment.push_back(QPoint(lines[index-1].x2+dx,lines[index-1].y2+dy));
-      painter.drawPolyline(segment.data(),segment.size());
+      for (unsigned point=begin;point<end;) {
+         if (cut[point]) {
+            ++point;
+            continue;
+         }
+         run.clear();
+         run.push_back(QPoint(xs[point]+dx,ys[point]+dy));
+         for (;(point<end)&&(!cut[point]);++point)
+            run.push_back(QPoint(xs[point+1]+dx,ys[point+1]+dy));
+         painter.drawPolyline(run.data(),run.size());
+      }
    }
 }
 //----------------------------------------------------------------------------
+size_t Scribble::memoryUsage() const
+   // The approximate memory usage in bytes
+{
+   size_t result=sizeof(Scribble)+styles.capacity()*sizeof(Style)+strokes.capacity()*sizeof(Stroke);
+   result+=(xs.capacity()+ys.capacity())*sizeof(int16_t)+cut.capacity()+pending.capacity()*sizeof(pending[0]);
+   result+=grid.bucket_count()*sizeof(void*);
+   for (auto& cell:grid)
+      result+=sizeof(cell)+2*sizeof(void*)+cell.second.capacity()*sizeof(unsigned);
+   return result;
+}
+//----------------------------------------------------------------------------
 void Scribble::clear()
-   // Delete all lines
+   // Delete all lines. An open stroke is dropped without being reported
 {
-   lines.clear();
+   styles.clear();
+   strokes.clear();
+   xs.clear(); ys.clear(); cut.clear();
+   pending.clear();
+   grid.clear();
+   cutCount=0;
+   open=false;
+   ++revision;
+}
+//----------------------------------------------------------------------------
+void Scribble::scale(double factor)
+   // Scale all lines
+{
+   finishStroke();
+   if (xs.empty())
+      return;
+   for (auto& x:xs)
+      x=clampCoordinate(lround(x*factor));
+   for (auto& y:ys)
+      y=clampCoordinate(lround(y*factor));
+   for (auto& s:styles)
+      s.width=max<long>(1,lround(s.width*factor));
+
+   // The grid covers the old coordinates
+   compact();
+   ++revision;
 }
 //----------------------------------------------------------------------------
 QRect Scribble::drawLine(int x1,int y1,int x2,int y2,unsigned width,QColor color)
    // Add a line
 {
-   lines.push_back(Line{x1,y1,x2,y2,color,width});
+   x1=clampCoordinate(x1); y1=clampCoordinate(y1);
+   x2=clampCoordinate(x2); y2=clampCoordinate(y2);
+   unsigned style=findStyle(width,color);
+
+   // Continue the open stroke?
+   if (open&&(strokes.back().style==style)&&(xs.back()==x1)&&(ys.back()==y1)) {
+      if ((x2==x1)&&(y2==y1))
+         return QRect();
+      return addPoint(x2,y2);
+   }
+
+   // No, start a new one
+   finishStroke();
+   unsigned first=xs.size();
+   strokes.push_back(Stroke{first,2,style});
+   xs.push_back(x1); ys.push_back(y1);
+   xs.push_back(x2); ys.push_back(y2);
+   cut.push_back(0); cut.push_back(0);
+   open=true;
+   pending.assign(1,make_pair(x2,y2));
+   indexSegment(first,width);
+
+   return segmentBB(first,width);
+}
+//----------------------------------------------------------------------------
+void Scribble::finishStroke()
+   // Finish the open stroke
+{
+   if (!open)
+      return;
+   open=false;
+   pending.clear();
 
-   return lines.back().getBB();
+   if (strokeFinished) {
+      auto& s=strokes.back();
+      strokeFinished(StrokeData{styles[s.style].color,styles[s.style].width,xs.data()+s.first,ys.data()+s.first,s.count});
+   }
+}
+//----------------------------------------------------------------------------
+void Scribble::addStroke(unsigned width,QColor color,const int16_t* xs,const int16_t* ys,unsigned count)
+   // Add a finished stroke
+{
+   if (count<2)
+      return;
+   finishStroke();
+
+   unsigned first=this->xs.size();
+   strokes.push_back(Stroke{first,count,findStyle(width,color)});
+   this->xs.insert(this->xs.end(),xs,xs+count);
+   this->ys.insert(this->ys.end(),ys,ys+count);
+   cut.resize(this->xs.size(),0);
+   for (unsigned index=first;index<first+count-1;index++)
+      indexSegment(index,width);
 }
 //----------------------------------------------------------------------------
 QRect Scribble::eraseLine(int x1,int y1,int x2,int y2,unsigned width)
    // Erase a previously drawn line
 {
+   // Erasing ends the open stroke, it is reported as it was drawn
+   finishStroke();
+
    unsigned widthSq=width*width;
-   Line l{x1,y1,x2,y2,Qt::black,width};
-   QRect lineBB=l.getBB();
+   QRect eraserBB=lineBB(x1,y1,x2,y2,width);
+
+   // Only look at segments in nearby cells
+   vector<unsigned> candidates;
+   forCells(eraserBB,[this,&candidates](uint64_t key) {
+      auto iter=grid.find(key);
+      if (iter!=grid.end())
+         candidates.insert(candidates.end(),iter->second.begin(),iter->second.end());
+   });
+   sort(candidates.begin(),candidates.end());
+   candidates.erase(unique(candidates.begin(),candidates.end()),candidates.end());
 
    QRect bb;
    bool first=true;
-   for (unsigned index=0,limit=lines.size();index!=limit;++index) {
+   for (unsigned point:candidates) {
       // Plausibility check
-      if (!lineBB.intersects(lines[index].getBB()))
+      unsigned stroke=strokeOf(point),segmentWidth=styles[strokes[stroke].style].width;
+      QRect segment=segmentBB(point,segmentWidth);
+      if (!eraserBB.intersects(segment))
          continue;
 
       // Compute the distance
-      double d=min(lines[index].distanceToSquared(x1,y1),lines[index].distanceToSquared(x2,y2));
+      double d=min(distanceToSquared(point,x1,y1),distanceToSquared(point,x2,y2));
       if (d<=widthSq) {
          // Update bounding box
          if (first) {
-            bb=lines[index].getBB();
+            bb=segment;
             first=false;
-         } else bb|=lines[index].getBB();
+         } else bb|=segment;
 
          // Remove
-         swap(lines[index],lines[limit-1]);
-         lines.pop_back();
-         --limit; --index;
+         ++revision;
+         unindexSegment(point,segmentWidth);
+         cut[point]=1;
+         ++cutCount;
       }
    }
 
+   // Drop the erased segments once they are the majority
+   if (cutCount>xs.size()/2)
+      compact();
+
    return bb;
 }
 //----------------------------------------------------------------------------
+void Scribble::exportStrokes(const function<void(const StrokeData&)>& callback)
+   // Report every stroke that was not erased
+{
+   finishStroke();
+   if (cutCount) {
+      compact();
+      ++revision;
+   }
+   for (auto& s:strokes)
+      callback(StrokeData{styles[s.style].color,styles[s.style].width,xs.data()+s.first,ys.data()+s.first,s.count});
+}
+//----------------------------------------------------------------------------
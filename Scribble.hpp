@@ -2,31 +2,95 @@
 #define H_Scribble
 //----------------------------------------------------------------------------
 #include <QColor>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
 #include <vector>
 //----------------------------------------------------------------------------
 class QPainter;
 class QRect;
 //----------------------------------------------------------------------------
-/// A simple line drawing
+/// A simple line drawing. Consists of strokes, whose points are stored in packed arrays
 class Scribble
 {
-   private:
-   /// A line
-   struct Line {
-      /// The coordinates
-      int x1,y1,x2,y2;
+   public:
+   /// A finished stroke
+   struct StrokeData {
       /// Line color
       QColor color;
       /// Line width
       unsigned width;
+      /// The coordinates
+      const int16_t* xs,*ys;
+      /// The number of points
+      unsigned count;
+   };
+
+   private:
+   /// The size of a grid cell
+   static const int cellSize = 64;
+   /// The maximum distance of an input point from the simplified stroke
+   static constexpr double tolerance = 1.0;
+   /// The maximum number of input points replaced by one segment
+   static const unsigned maxPending = 64;
 
-      /// Get the bounding box
-      QRect getBB() const;
-      /// Compute distance
-      double distanceToSquared(int x,int y) const;
+   /// A line style
+   struct Style {
+      /// Line color
+      QColor color;
+      /// Line width
+      unsigned width;
+   };
+   /// A stroke. Consists of the points first to first+count-1
+   struct Stroke {
+      /// The first point
+      unsigned first;
+      /// The number of points
+      unsigned count;
+      /// The style
+      unsigned style;
    };
-   /// The lines
-   std::vector<Line> lines;
+   /// The styles
+   std::vector<Style> styles;
+   /// The strokes, ordered by their first point
+   std::vector<Stroke> strokes;
+   /// The point coordinates
+   std::vector<int16_t> xs,ys;
+   /// Erased segments. Non-zero if the segment starting at a point was erased
+   std::vector<uint8_t> cut;
+   /// The number of erased segments
+   unsigned cutCount;
+   /// Is the last stroke still being drawn? Then its last point may move
+   bool open;
+   /// The input points since the last fixed point of the open stroke
+   std::vector<std::pair<int,int>> pending;
+   /// A uniform grid over the segment bounding boxes. Maps cells to the first points of the segments that touch them
+   std::unordered_map<uint64_t,std::vector<unsigned>> grid;
+   /// Changes whenever lines are removed
+   unsigned revision;
+   /// Called for every finished stroke
+   std::function<void(const StrokeData&)> strokeFinished;
+
+   /// The cell key
+   static uint64_t cellKey(int x,int y) { return (static_cast<uint64_t>(static_cast<uint32_t>(x))<<32)|static_cast<uint32_t>(y); }
+   /// Call a function for every cell a rectangle touches
+   template <class T> static void forCells(const QRect& bb,const T& callback);
+   /// The stroke that contains a point
+   unsigned strokeOf(unsigned point) const;
+   /// Get the bounding box of a segment
+   QRect segmentBB(unsigned point,unsigned width) const;
+   /// Compute the distance of a point to a segment
+   double distanceToSquared(unsigned point,int x,int y) const;
+   /// Find or add a style
+   unsigned findStyle(unsigned width,QColor color);
+   /// Add a point to the open stroke
+   QRect addPoint(int x,int y);
+   /// Add a segment to the grid
+   void indexSegment(unsigned point,unsigned width);
+   /// Remove a segment from the grid
+   void unindexSegment(unsigned point,unsigned width);
+   /// Drop erased segments and rebuild the grid
+   void compact();
 
    public:
    /// Constructor
@@ -34,15 +98,33 @@ class Scribble
    /// Destructor
    ~Scribble();
 
-   /// Draw the scribble
-   void paint(QPainter& painter,const QRect& target);
+   /// Draw the segments starting at the points from to to-1
+   void paint(QPainter& painter,const QRect& target,unsigned from=0,unsigned to=~0u);
+   /// The number of points. Segments starting before fixedCount never change until the revision changes
+   unsigned pointCount() const { return xs.size(); }
+   /// The segments starting before this point never change until the revision changes. Only the last segment of the open stroke can
+   unsigned fixedCount() const { return (open&&(xs.size()>=2))?(xs.size()-2):xs.size(); }
+   /// The revision. Changes whenever lines are removed
+   unsigned getRevision() const { return revision; }
+   /// The approximate memory usage in bytes
+   size_t memoryUsage() const;
 
    /// Delete all lines
    void clear();
-   /// Add a line
+   /// Scale all lines, e.g., when the coordinate space changes. Finishes the open stroke first
+   void scale(double factor);
+   /// Add a line. Continues the open stroke if it ends at the start of the line and has the same style
    QRect drawLine(int x1,int y1,int x2,int y2,unsigned width,QColor color);
+   /// Finish the open stroke
+   void finishStroke();
+   /// Add a finished stroke, e.g., from a journal
+   void addStroke(unsigned width,QColor color,const int16_t* xs,const int16_t* ys,unsigned count);
+   /// Set a function that is called for every stroke that is finished by drawing. Strokes added by addStroke are not reported
+   void onStrokeFinished(const std::function<void(const StrokeData&)>& callback) { strokeFinished=callback; }
    /// Erase a previously drawn line
    QRect eraseLine(int x1,int y1,int x2,int y2,unsigned width);
+   /// Report every stroke that was not erased, e.g., to store the drawing compactly. Finishes the open stroke first
+   void exportStrokes(const std::function<void(const StrokeData&)>& callback);
 };
 //----------------------------------------------------------------------------
 #endif
@@ -0,0 +1,157 @@
+#include "TileCache.hpp"
+#include "ImageKernels.hpp"
+#include "Trace.hpp"
+#include <poppler/qt5/poppler-qt5.h>
+#include <algorithm>
+#include <cmath>
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+size_t TileCache::TileHash::operator()(const Tile& tile) const
+   // Hash function for tiles
+{
+   size_t result=tile.page;
+   for (unsigned v:{static_cast<unsigned>(tile.pageSize.width()),static_cast<unsigned>(tile.pageSize.height()),tile.x,tile.y})
+      result=(result*0x9E3779B97F4A7C15ull)^v;
+   return result;
+}
+//----------------------------------------------------------------------------
+TileCache::TileCache(unsigned edge)
+   : edge(edge),budget(0),used(0),done(true)
+   // Constructor
+{
+}
+//----------------------------------------------------------------------------
+TileCache::~TileCache()
+   // Destructor
+{
+   stop();
+}
+//----------------------------------------------------------------------------
+void TileCache::start(const shared_ptr<Poppler::Document>& doc,unsigned threads,uint64_t budget,const function<void(unsigned)>& rendered)
+   // Start rendering tiles of a document
+{
+   stop();
+
+   this->doc=doc;
+   this->rendered=rendered;
+   this->budget=budget;
+   done=false;
+   for (unsigned index=0;index<max(threads,1u);index++)
+      workers.push_back(thread(&TileCache::work,this));
+}
+//----------------------------------------------------------------------------
+void TileCache::stop()
+   // Stop rendering and drop all tiles
+{
+   {
+      unique_lock<mutex> guard(lock);
+      done=true;
+      requests.clear();
+   }
+   changed.notify_all();
+   for (auto& worker:workers)
+      worker.join();
+   workers.clear();
+
+   unique_lock<mutex> guard(lock);
+   tiles.clear();
+   index.clear();
+   used=0;
+   doc.reset();
+}
+//----------------------------------------------------------------------------
+void TileCache::insert(const Tile& tile,const QImage& image)
+   // Remember a rendered tile
+{
+   tiles.push_front(Entry{tile,image});
+   index[tile]=tiles.begin();
+   used+=image.byteCount();
+
+   // Drop the least recently used tiles
+   while ((used>budget)&&(tiles.size()>1)) {
+      used-=tiles.back().image.byteCount();
+      index.erase(tiles.back().tile);
+      tiles.pop_back();
+   }
+}
+//----------------------------------------------------------------------------
+QImage TileCache::render(const Tile& tile)
+   // Render a tile
+{
+   Trace::Span span("render tile");
+   unique_ptr<Poppler::Page> page(doc->page(tile.page));
+   if (!page)
+      return QImage();
+
+   // Compute the DPI that produces the requested page size
+   double DPIx=static_cast<double>(tile.pageSize.width())/(page->pageSizeF().width()/72.0);
+   double DPIy=static_cast<double>(tile.pageSize.height())/(page->pageSizeF().height()/72.0);
+   double DPI=(DPIx<DPIy)?DPIx:DPIy;
+
+   // Render only the area of the tile. The page may be narrower than the requested size if the aspect ratio differs
+   int pageWidth=min<int>(tile.pageSize.width(),ceil(page->pageSizeF().width()/72.0*DPI));
+   int pageHeight=min<int>(tile.pageSize.height(),ceil(page->pageSizeF().height()/72.0*DPI));
+   int x=tile.x*edge,y=tile.y*edge;
+   int w=min<int>(edge,pageWidth-x),h=min<int>(edge,pageHeight-y);
+   if ((w<=0)||(h<=0))
+      return QImage();
+   QImage img=page->renderToImage(DPI,DPI,x,y,w,h);
+   if (!img.isNull())
+      ImageKernels::toRGB32(img);
+   return img;
+}
+//----------------------------------------------------------------------------
+QImage TileCache::get(const Tile& tile)
+   // Get a tile
+{
+   unique_lock<mutex> guard(lock);
+   auto iter=index.find(tile);
+   if (iter==index.end())
+      return QImage();
+   tiles.splice(tiles.begin(),tiles,iter->second);
+   return iter->second->image;
+}
+//----------------------------------------------------------------------------
+void TileCache::request(const vector<Tile>& tiles)
+   // Render tiles in the background
+{
+   {
+      unique_lock<mutex> guard(lock);
+      requests=tiles;
+   }
+   changed.notify_all();
+}
+//----------------------------------------------------------------------------
+void TileCache::work()
+   // The render loop
+{
+   Trace::nameThread("tile worker");
+   unique_lock<mutex> guard(lock);
+   while (true) {
+      while ((!done)&&(requests.empty()))
+         changed.wait(guard);
+      if (done)
+         return;
+
+      // Take the most important request
+      Tile tile=requests.front();
+      requests.erase(requests.begin());
+      if (index.count(tile)||(find(rendering.begin(),rendering.end(),tile)!=rendering.end()))
+         continue;
+
+      // And render it
+      rendering.push_back(tile);
+      guard.unlock();
+      QImage image=render(tile);
+      guard.lock();
+      rendering.erase(find(rendering.begin(),rendering.end(),tile));
+      if (image.isNull())
+         continue;
+      insert(tile,image);
+      guard.unlock();
+      rendered(tile.page);
+      guard.lock();
+   }
+}
+//----------------------------------------------------------------------------
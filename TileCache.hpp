@@ -0,0 +1,105 @@
+#ifndef H_TileCache
+#define H_TileCache
+//----------------------------------------------------------------------------
+#include <QImage>
+#include <QSize>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+//----------------------------------------------------------------------------
+namespace Poppler { class Document; }
+//----------------------------------------------------------------------------
+/// Parts of magnified pages. Renders only the requested tiles, in a number of background threads
+class TileCache
+{
+   public:
+   /// The default edge length of a tile in device pixels
+   static const unsigned tileSize = 256;
+
+   /// A tile of a page rendered at a certain size
+   struct Tile {
+      /// The page
+      unsigned page;
+      /// The size of the whole page in device pixels
+      QSize pageSize;
+      /// The tile position in tiles
+      unsigned x,y;
+
+      /// Comparison
+      bool operator==(const Tile& other) const { return (page==other.page)&&(pageSize==other.pageSize)&&(x==other.x)&&(y==other.y); }
+   };
+
+   private:
+   /// Hash function for tiles
+   struct TileHash { size_t operator()(const Tile& tile) const; };
+   /// A rendered tile
+   struct Entry {
+      /// The tile
+      Tile tile;
+      /// The image
+      QImage image;
+   };
+
+   /// The edge length of the tiles in device pixels
+   unsigned edge;
+   /// The document
+   std::shared_ptr<Poppler::Document> doc;
+   /// Called after a tile was rendered, from the rendering thread
+   std::function<void(unsigned)> rendered;
+   /// The maximum space for tiles in bytes
+   uint64_t budget;
+   /// The space used by tiles
+   uint64_t used;
+   /// The lock
+   std::mutex lock;
+   /// Signals new requests
+   std::condition_variable changed;
+   /// The tiles, most recently used first
+   std::list<Entry> tiles;
+   /// The position of each tile
+   std::unordered_map<Tile,std::list<Entry>::iterator,TileHash> index;
+   /// Tiles that should be rendered, most important first
+   std::vector<Tile> requests;
+   /// Tiles that are rendered right now
+   std::vector<Tile> rendering;
+   /// The render threads
+   std::vector<std::thread> workers;
+   /// Stop the render threads?
+   bool done;
+
+   /// Remember a rendered tile. Requires the lock
+   void insert(const Tile& tile,const QImage& image);
+   /// Render a tile
+   QImage render(const Tile& tile);
+   /// The render loop
+   void work();
+
+   TileCache(const TileCache&);
+   void operator=(const TileCache&);
+
+   public:
+   /// Constructor. A large edge length renders small pages, e.g. thumbnails, as one tile
+   explicit TileCache(unsigned edge=tileSize);
+   /// Destructor
+   ~TileCache();
+
+   /// The edge length of the tiles in device pixels
+   unsigned getTileSize() const { return edge; }
+
+   /// Start rendering tiles of a document
+   void start(const std::shared_ptr<Poppler::Document>& doc,unsigned threads,uint64_t budget,const std::function<void(unsigned)>& rendered);
+   /// Stop rendering and drop all tiles
+   void stop();
+
+   /// Get a tile. Returns a null image if the tile is not rendered yet
+   QImage get(const Tile& tile);
+   /// Render tiles in the background, most important first. Replaces all previous requests
+   void request(const std::vector<Tile>& tiles);
+};
+//----------------------------------------------------------------------------
+#endif
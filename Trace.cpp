@@ -0,0 +1,136 @@
+#include "Trace.hpp"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+/// The number of spans kept per thread, older spans are overwritten
+static const unsigned bufferSize = 1u<<16;
+//----------------------------------------------------------------------------
+/// A recorded span
+struct Event {
+   /// The name
+   const char* name;
+   /// The start and end time in nanoseconds
+   uint64_t start,end;
+};
+//----------------------------------------------------------------------------
+struct Trace::Buffer {
+   /// The thread id in the trace
+   unsigned tid;
+   /// The thread name
+   const char* name;
+   /// The spans
+   vector<Event> events;
+   /// The number of spans recorded so far
+   uint64_t count;
+};
+//----------------------------------------------------------------------------
+atomic<bool> Trace::enabled(false);
+//----------------------------------------------------------------------------
+/// The trace state
+static struct {
+   /// Protects the list of buffers
+   mutex lock;
+   /// The buffers of all threads that recorded spans. Kept alive until the end, threads may be gone
+   vector<unique_ptr<Trace::Buffer>> buffers;
+   /// The output file
+   QString fileName;
+   /// The start of the trace
+   chrono::steady_clock::time_point origin;
+} state;
+//----------------------------------------------------------------------------
+Trace::Buffer& Trace::buffer()
+   // The buffer of the calling thread
+{
+   thread_local Buffer* local=nullptr;
+   if (!local) {
+      unique_lock<mutex> guard(state.lock);
+      state.buffers.push_back(unique_ptr<Buffer>(new Buffer{static_cast<unsigned>(state.buffers.size()+1),nullptr,vector<Event>(bufferSize),0}));
+      local=state.buffers.back().get();
+   }
+   return *local;
+}
+//----------------------------------------------------------------------------
+uint64_t Trace::now()
+   // The current time in nanoseconds since tracing started
+{
+   // Never 0, that marks disabled spans
+   return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-state.origin).count()+1;
+}
+//----------------------------------------------------------------------------
+void Trace::record(const char* name,uint64_t start,uint64_t end)
+   // Record a finished span
+{
+   Buffer& b=buffer();
+   b.events[b.count%bufferSize]=Event{name,start,end};
+   ++b.count;
+}
+//----------------------------------------------------------------------------
+void Trace::start(const QString& fileName)
+   // Start tracing
+{
+   state.fileName=fileName;
+   state.origin=chrono::steady_clock::now();
+   enabled=true;
+}
+//----------------------------------------------------------------------------
+void Trace::nameThread(const char* name)
+   // Name the calling thread in the trace
+{
+   if (enabled.load(memory_order_relaxed))
+      buffer().name=name;
+}
+//----------------------------------------------------------------------------
+static void writeString(ostream& out,const char* text)
+   // Write a JSON string
+{
+   out << '"';
+   for (const char* iter=text;*iter;++iter) {
+      if ((*iter=='"')||(*iter=='\\'))
+         out << '\\';
+      out << *iter;
+   }
+   out << '"';
+}
+//----------------------------------------------------------------------------
+bool Trace::finish()
+   // Stop tracing and write all recorded spans
+{
+   if (!enabled.exchange(false))
+      return true;
+
+   ofstream out(state.fileName.toLocal8Bit().constData());
+   if (!out.is_open()) {
+      cerr << "unable to write " << state.fileName.toLocal8Bit().constData() << endl;
+      return false;
+   }
+
+   // Complete events in microseconds, one track per thread
+   unique_lock<mutex> guard(state.lock);
+   out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+   bool first=true;
+   for (auto& b:state.buffers) {
+      if (b->name) {
+         out << (first?"":",") << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << b->tid << ",\"args\":{\"name\":";
+         writeString(out,b->name);
+         out << "}}";
+         first=false;
+      }
+      uint64_t from=(b->count>bufferSize)?(b->count-bufferSize):0;
+      for (uint64_t index=from;index<b->count;index++) {
+         const Event& e=b->events[index%bufferSize];
+         out << (first?"":",") << "\n{\"ph\":\"X\",\"name\":";
+         writeString(out,e.name);
+         out << ",\"pid\":1,\"tid\":" << b->tid << ",\"ts\":" << (e.start/1000) << "." << ((e.start/100)%10) << ",\"dur\":" << ((e.end-e.start)/1000) << "." << (((e.end-e.start)/100)%10) << "}";
+         first=false;
+      }
+   }
+   out << "\n]}" << endl;
+   return true;
+}
+//----------------------------------------------------------------------------
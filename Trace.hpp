@@ -0,0 +1,49 @@
+#ifndef H_Trace
+#define H_Trace
+//----------------------------------------------------------------------------
+#include <QString>
+#include <atomic>
+#include <cstdint>
+//----------------------------------------------------------------------------
+/// Opt-in recording of timed spans. Each thread writes into its own ring buffer, the spans are written as Chrome trace JSON at the end
+class Trace
+{
+   public:
+   /// The spans of one thread
+   struct Buffer;
+
+   private:
+   /// Is tracing enabled?
+   static std::atomic<bool> enabled;
+
+   /// The buffer of the calling thread
+   static Buffer& buffer();
+   /// The current time in nanoseconds since tracing started
+   static uint64_t now();
+   /// Record a finished span
+   static void record(const char* name,uint64_t start,uint64_t end);
+
+   public:
+   /// A span that lasts for the lifetime of the object. The name must be a string literal
+   class Span {
+      /// The name
+      const char* name;
+      /// The start time, 0 if tracing is disabled
+      uint64_t start;
+
+      public:
+      /// Constructor
+      explicit Span(const char* name) : name(name),start(enabled.load(std::memory_order_relaxed)?now():0) {}
+      /// Destructor
+      ~Span() { if (start) record(name,start,now()); }
+   };
+
+   /// Start tracing. The spans are written to a file by finish
+   static void start(const QString& fileName);
+   /// Name the calling thread in the trace. The name must be a string literal
+   static void nameThread(const char* name);
+   /// Stop tracing and write all recorded spans. The traced threads must be idle
+   static bool finish();
+};
+//----------------------------------------------------------------------------
+#endif
@@ -1,14 +1,16 @@
 #include "View.hpp"
 #include "Presenter.hpp"
+#include "Trace.hpp"
 #include <QPainter>
 #include <QKeyEvent>
+#include <QWheelEvent>
 #include <QApplication>
 //----------------------------------------------------------------------------
 /// Time before the cursor is hidden
 static const unsigned cursorHideDelay = 3000;
 //----------------------------------------------------------------------------
-View::View(Presenter& presenter,const QRect& target)
-   : presenter(presenter),target(target),cursorTimeout(this),delayedFullScreen(true),hiddenCursor(true),tabletDown(false),tabletPressureSensitiveness(true),mouseDrawing(false),mouseDown(false)
+View::View(Presenter& presenter,const QRect& target,unsigned resolution)
+   : presenter(presenter),target(target),resolution(resolution),overviewRow(0),inkScribble(nullptr),inkRevision(0),inkPoints(0),cursorTimeout(this),delayedFullScreen(true),hiddenCursor(true),tabletDown(false),tabletPressureSensitiveness(true),mouseDrawing(false),mouseDown(false),panning(false)
    // Constructor
 {
    setFocusPolicy(Qt::StrongFocus);
@@ -27,6 +29,7 @@ View::~View()
 void View::paintEvent(QPaintEvent* event)
    // Paint the view
 {
+   Trace::Span span("paint event");
    QPainter painter(this);
    painter.setClipRegion(event->region());
    presenter.paint(painter,this);
@@ -40,6 +43,7 @@ void View::paintEvent(QPaintEvent* event)
 void View::keyPressEvent(QKeyEvent* event)
    // Handle input
 {
+   Trace::Span span("key press");
    switch (event->key()) {
       case Qt::Key_Left:
          presenter.previousPage();
@@ -84,12 +88,24 @@ void View::keyPressEvent(QKeyEvent* event)
       case Qt::Key_T:
          presenter.toggleTimer();
          break;
+      case Qt::Key_S:
+         presenter.toggleConsole();
+         break;
       case Qt::Key_R:
          presenter.resetTimer();
          break;
       case Qt::Key_Tab:
          presenter.toggleThumbnails();
          break;
+      case Qt::Key_Plus: case Qt::Key_Equal:
+         presenter.zoomIn();
+         break;
+      case Qt::Key_Minus:
+         presenter.zoomOut();
+         break;
+      case Qt::Key_Z:
+         presenter.resetZoom();
+         break;
       case Qt::Key_1: presenter.setLineWidth(1); break;
       case Qt::Key_2: presenter.setLineWidth(3); break;
       case Qt::Key_3: presenter.setLineWidth(5); break;
@@ -108,20 +124,24 @@ void View::keyPressEvent(QKeyEvent* event)
 void View::mouseMoveEvent(QMouseEvent* event)
    // Handle mouse movement
 {
+   Trace::Span span("mouse move");
    QWidget::mouseMoveEvent(event);
 
    if (mouseDrawing) {
       if (mouseDown&&target.contains(event->pos())) {
-         int x1=mousePos.x()-target.left(),y1=mousePos.y()-target.top();
-         int x2=event->x()-target.left(),y2=event->y()-target.top();
+         int x1=mousePos.x(),y1=mousePos.y();
+         int x2=event->x(),y2=event->y();
 
          if (event->buttons()&Qt::LeftButton) {
-            presenter.drawLine(x1,y1,x2,y2);
+            presenter.drawLine(this,x1,y1,x2,y2);
          } else if (event->buttons()&Qt::RightButton) {
-            presenter.eraseLine(x1,y1,x2,y2);
+            presenter.eraseLine(this,x1,y1,x2,y2);
          }
       }
       mousePos=event->pos();
+   } else if (panning&&(event->buttons()&Qt::LeftButton)) {
+      presenter.pan(this,event->x()-mousePos.x(),event->y()-mousePos.y());
+      mousePos=event->pos();
    }
    showCursorTemporarily();
 }
@@ -132,6 +152,9 @@ void View::mousePressEvent(QMouseEvent* event)
    if (mouseDrawing) {
       mouseDown=true;
       mousePos=event->pos();
+   } else if (presenter.isZoomed()) {
+      panning=true;
+      mousePos=event->pos();
    } else if (target.contains(event->pos())) {
       unsigned x=event->x()-target.left();
       unsigned y=event->y()-target.top();
@@ -145,7 +168,22 @@ void View::mouseReleaseEvent(QMouseEvent* /*event*/)
 {
    if (mouseDrawing) {
       mouseDown=false;
+      presenter.finishStroke();
    }
+   panning=false;
+}
+//----------------------------------------------------------------------------
+void View::wheelEvent(QWheelEvent* event)
+   // Handle the mouse wheel
+{
+   int steps=event->angleDelta().y()/120;
+   if (steps) {
+      // The overview scrolls instead of zooming
+      if (presenter.isOverview())
+         presenter.scrollOverview(-steps); else
+         presenter.zoomAt(this,event->pos(),steps);
+   }
+   event->accept();
 }
 //----------------------------------------------------------------------------
 void View::showCursorTemporarily()
@@ -173,6 +211,7 @@ void View::hideCursor()
 void View::tabletEvent(QTabletEvent *event)
    // Handle tablet events
 {
+   Trace::Span span("tablet event");
    switch (event->type()) {
       case QEvent::TabletPress:
          tabletDown=true;
@@ -180,16 +219,17 @@ void View::tabletEvent(QTabletEvent *event)
          break;
       case QEvent::TabletRelease:
          tabletDown=false;
+         presenter.finishStroke();
          break;
       case QEvent::TabletMove:
          if (tabletDown&&target.contains(event->pos())) {
-            int x1=tabletPos.x()-target.left(),y1=tabletPos.y()-target.top();
-            int x2=event->x()-target.left(),y2=event->y()-target.top();
+            int x1=tabletPos.x(),y1=tabletPos.y();
+            int x2=event->x(),y2=event->y();
             double intensity=tabletPressureSensitiveness?event->pressure():1.0;
             if (event->pointerType()==QTabletEvent::Pen) {
-               presenter.drawLine(x1,y1,x2,y2,intensity);
+               presenter.drawLine(this,x1,y1,x2,y2,intensity);
             } else if (event->pointerType()==QTabletEvent::Eraser) {
-               presenter.eraseLine(x1,y1,x2,y2,intensity);
+               presenter.eraseLine(this,x1,y1,x2,y2,intensity);
             }
          }
          tabletPos=event->pos();
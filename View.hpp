@@ -3,8 +3,12 @@
 //----------------------------------------------------------------------------
 #include <QWidget>
 #include <QTimer>
+#include <QImage>
+#include <QPixmap>
+#include <vector>
 //----------------------------------------------------------------------------
 class Presenter;
+class Scribble;
 //----------------------------------------------------------------------------
 /// A viewer window. The renderering is done by the presenter class
 class View : public QWidget
@@ -16,6 +20,37 @@ class View : public QWidget
    Presenter& presenter;
    /// The target rectangle
    QRect target;
+   /// The resolution pages are rendered for
+   unsigned resolution;
+   /// The composited visible part of the overview
+   QImage overview;
+   /// The first row of the overview in the composite
+   unsigned overviewRow;
+   /// The content of each visible overview cell
+   std::vector<unsigned char> overviewCells;
+   /// A page converted for the display
+   struct PagePixmap {
+      /// The page
+      unsigned page;
+      /// The cache key of the image it was converted from
+      qint64 key;
+      /// The pixmap
+      QPixmap pixmap;
+   };
+   /// The current page and its neighbors, converted for the display
+   std::vector<PagePixmap> pixmaps;
+   /// Scaled down copies of the current and the next page for the presenter console
+   std::vector<PagePixmap> consolePixmaps;
+   /// The rasterized scribble, covering the target
+   QImage ink;
+   /// The scribble in the ink
+   const Scribble* inkScribble;
+   /// The scribble revision in the ink
+   unsigned inkRevision;
+   /// The scribble segments starting before this point are in the ink
+   unsigned inkPoints;
+   /// The page area the ink was drawn for
+   QRect inkArea;
    /// A timer for hiding the cursor
    QTimer cursorTimeout;
    /// Show full screen of next paint?
@@ -32,6 +67,8 @@ class View : public QWidget
    bool mouseDrawing,mouseDown;
    /// Mouse position
    QPoint mousePos;
+   /// Dragging a magnified page?
+   bool panning;
 
    friend class Presenter;
 
@@ -46,6 +83,8 @@ class View : public QWidget
    void mousePressEvent(QMouseEvent* event);
    /// Handle mouse clicks
    void mouseReleaseEvent(QMouseEvent* event);
+   /// Handle the mouse wheel
+   void wheelEvent(QWheelEvent* event);
    /// Handle tablet events
    void tabletEvent(QTabletEvent *event);
 
@@ -57,7 +96,7 @@ class View : public QWidget
 
    public:
    /// Constructor
-   View(Presenter& presenter,const QRect& target);
+   View(Presenter& presenter,const QRect& target,unsigned resolution);
    /// Destructor
    ~View();
 };
@@ -0,0 +1,361 @@
+#include "WorkerPool.hpp"
+#include <iostream>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+/// The time a worker may take for a job before it is considered hung, in milliseconds
+static const int jobTimeout = 60000;
+/// The maximum size of a job description
+static const unsigned maxDescription = 16384;
+/// The maximum number of file descriptors passed to a worker, including its pipes
+static const unsigned maxFiles = 16;
+//----------------------------------------------------------------------------
+/// A request to the server
+struct Request {
+   /// The request types
+   enum Type : uint32_t { Spawn, Terminate };
+   /// The type
+   Type type;
+   /// The worker to terminate
+   int32_t pid;
+};
+//----------------------------------------------------------------------------
+/// The socket to the server process, -1 if there is none
+static int serverSocket = -1;
+/// Serializes the requests to the server
+static mutex serverLock;
+//----------------------------------------------------------------------------
+static bool readAll(int fd,void* data,size_t len,const chrono::steady_clock::time_point* deadline=nullptr)
+   // Read a message completely. Fails with ETIMEDOUT if the deadline passes first
+{
+   char* writer=static_cast<char*>(data);
+   while (len) {
+      if (deadline) {
+         long long left=chrono::duration_cast<chrono::milliseconds>(*deadline-chrono::steady_clock::now()).count();
+         pollfd p{fd,POLLIN,0};
+         int ready=(left>0)?poll(&p,1,static_cast<int>(left)):0;
+         if (ready<0) {
+            if (errno==EINTR) continue;
+            return false;
+         }
+         if (!ready) {
+            errno=ETIMEDOUT;
+            return false;
+         }
+      }
+      ssize_t r=::read(fd,writer,len);
+      if (r<0) {
+         if (errno==EINTR) continue;
+         return false;
+      }
+      if (!r)
+         return false;
+      writer+=r;
+      len-=r;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+static bool writeAll(int fd,const void* data,size_t len)
+   // Write a message completely
+{
+   const char* reader=static_cast<const char*>(data);
+   while (len) {
+      ssize_t w=::write(fd,reader,len);
+      if (w<0) {
+         if (errno==EINTR) continue;
+         return false;
+      }
+      reader+=w;
+      len-=w;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+static bool sendMessage(int socket,const Request& request,const string& description,const vector<int>& files)
+   // Send a request with a description and file descriptors
+{
+   iovec parts[2]={{const_cast<Request*>(&request),sizeof(request)},{const_cast<char*>(description.data()),description.size()}};
+   msghdr message;
+   memset(&message,0,sizeof(message));
+   message.msg_iov=parts;
+   message.msg_iovlen=description.empty()?1:2;
+   vector<char> control(CMSG_SPACE(sizeof(int)*files.size()));
+   if (!files.empty()) {
+      message.msg_control=control.data();
+      message.msg_controllen=control.size();
+      cmsghdr* c=CMSG_FIRSTHDR(&message);
+      c->cmsg_level=SOL_SOCKET;
+      c->cmsg_type=SCM_RIGHTS;
+      c->cmsg_len=CMSG_LEN(sizeof(int)*files.size());
+      memcpy(CMSG_DATA(c),files.data(),sizeof(int)*files.size());
+   }
+   while (sendmsg(socket,&message,MSG_NOSIGNAL)<0)
+      if (errno!=EINTR)
+         return false;
+   return true;
+}
+//----------------------------------------------------------------------------
+static bool receiveMessage(int socket,Request& request,string& description,vector<int>& files)
+   // Receive a request with a description and file descriptors
+{
+   vector<char> buffer(sizeof(Request)+maxDescription),control(CMSG_SPACE(sizeof(int)*maxFiles));
+   iovec part{buffer.data(),buffer.size()};
+   msghdr message;
+   memset(&message,0,sizeof(message));
+   message.msg_iov=&part;
+   message.msg_iovlen=1;
+   message.msg_control=control.data();
+   message.msg_controllen=control.size();
+   ssize_t len;
+   while ((len=recvmsg(socket,&message,MSG_CMSG_CLOEXEC))<0)
+      if (errno!=EINTR)
+         return false;
+
+   files.clear();
+   for (cmsghdr* c=CMSG_FIRSTHDR(&message);c;c=CMSG_NXTHDR(&message,c))
+      if ((c->cmsg_level==SOL_SOCKET)&&(c->cmsg_type==SCM_RIGHTS)) {
+         unsigned count=(c->cmsg_len-CMSG_LEN(0))/sizeof(int);
+         unsigned start=files.size();
+         files.resize(start+count);
+         memcpy(files.data()+start,CMSG_DATA(c),sizeof(int)*count);
+      }
+   if ((static_cast<size_t>(len)<sizeof(Request))||(message.msg_flags&(MSG_TRUNC|MSG_CTRUNC))) {
+      for (int fd:files)
+         close(fd);
+      return false;
+   }
+   memcpy(&request,buffer.data(),sizeof(Request));
+   description.assign(buffer.data()+sizeof(Request),len-sizeof(Request));
+   return true;
+}
+//----------------------------------------------------------------------------
+static bool ask(const Request& request,const string& description,const vector<int>& files,int32_t& reply)
+   // Send a request to the server and wait for its reply
+{
+   unique_lock<mutex> guard(serverLock);
+   if (serverSocket<0)
+      return false;
+   return sendMessage(serverSocket,request,description,files)&&readAll(serverSocket,&reply,sizeof(reply));
+}
+//----------------------------------------------------------------------------
+WorkerPool::WorkerPool()
+   : stopped(true)
+   // Constructor
+{
+}
+//----------------------------------------------------------------------------
+WorkerPool::~WorkerPool()
+   // Destructor
+{
+   stop();
+}
+//----------------------------------------------------------------------------
+bool WorkerPool::startServer(const JobFactory& factory)
+   // Start the server process that forks the workers
+{
+   int sockets[2];
+   if (socketpair(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0,sockets)<0)
+      return false;
+   pid_t parent=getpid(),pid=fork();
+   if (pid<0) {
+      cerr << "unable to start the render worker server" << endl;
+      close(sockets[0]); close(sockets[1]);
+      return false;
+   }
+   if (!pid) {
+      close(sockets[0]);
+      prctl(PR_SET_PDEATHSIG,SIGKILL);
+      if (getppid()==parent)
+         runServer(sockets[1],factory);
+      _exit(0);
+   }
+   close(sockets[1]);
+   serverSocket=sockets[0];
+   return true;
+}
+//----------------------------------------------------------------------------
+void WorkerPool::runServer(int socket,const JobFactory& factory)
+   // The request loop of the server process
+{
+   // The parent may be gone when we reply
+   signal(SIGPIPE,SIG_IGN);
+
+   Request request;
+   string description;
+   vector<int> files;
+   while (receiveMessage(socket,request,description,files)) {
+      int32_t reply=-1;
+      if (request.type==Request::Spawn) {
+         // The pipes of the worker come first
+         pid_t pid=(files.size()>=2)?fork():-1;
+         if (!pid) {
+            close(socket);
+            prctl(PR_SET_PDEATHSIG,SIGKILL);
+            Job job=factory(description,vector<int>(files.begin()+2,files.end()));
+            if (job)
+               serve(files[0],files[1],job);
+            _exit(0);
+         }
+         reply=pid;
+         for (int fd:files)
+            close(fd);
+      } else if (request.type==Request::Terminate) {
+         // Only we may reap the worker, its pid cannot be reused before
+         kill(request.pid,SIGKILL);
+         while ((waitpid(request.pid,0,0)<0)&&(errno==EINTR)) ;
+         reply=request.pid;
+      }
+      if (!writeAll(socket,&reply,sizeof(reply)))
+         break;
+   }
+}
+//----------------------------------------------------------------------------
+bool WorkerPool::start(unsigned count,const string& description,const vector<int>& files)
+   // Start a number of worker processes
+{
+   stop();
+   if ((description.size()>maxDescription)||(files.size()+2>maxFiles))
+      return false;
+
+   // A worker that dies while we write to it must not kill us
+   signal(SIGPIPE,SIG_IGN);
+
+   unique_lock<mutex> guard(lock);
+   this->description=description;
+   this->files=files;
+   stopped=false;
+   workers.assign(count,Worker{-1,-1,-1});
+   for (unsigned index=0;index<count;index++) {
+      if (!spawn(workers[index]))
+         break;
+      idle.push_back(index);
+   }
+   if (idle.empty()) {
+      stopped=true;
+      workers.clear();
+      return false;
+   }
+   return true;
+}
+//----------------------------------------------------------------------------
+bool WorkerPool::spawn(Worker& worker)
+   // Start a worker process
+{
+   int commands[2],results[2];
+   if (pipe2(commands,O_CLOEXEC)<0)
+      return false;
+   if (pipe2(results,O_CLOEXEC)<0) {
+      close(commands[0]); close(commands[1]);
+      return false;
+   }
+
+   // The server forks the worker, we never fork while other threads run
+   vector<int> passed={commands[0],results[1]};
+   passed.insert(passed.end(),files.begin(),files.end());
+   int32_t pid=-1;
+   bool ok=ask(Request{Request::Spawn,0},description,passed,pid)&&(pid>0);
+   close(commands[0]); close(results[1]);
+   if (!ok) {
+      cerr << "unable to start a render worker" << endl;
+      close(commands[1]); close(results[0]);
+      return false;
+   }
+
+   worker.pid=pid;
+   worker.commands=commands[1];
+   worker.results=results[0];
+   return true;
+}
+//----------------------------------------------------------------------------
+void WorkerPool::serve(int commands,int results,const Job& job)
+   // The job loop of a worker process
+{
+   uint32_t argument;
+   while (readAll(commands,&argument,sizeof(argument))) {
+      uint32_t reply[2]={argument,job(argument)};
+      if (!writeAll(results,reply,sizeof(reply)))
+         return;
+   }
+}
+//----------------------------------------------------------------------------
+void WorkerPool::terminate(Worker& worker)
+   // Terminate a worker process
+{
+   if (worker.pid<=0)
+      return;
+   close(worker.commands);
+   close(worker.results);
+   int32_t reply;
+   ask(Request{Request::Terminate,worker.pid},string(),vector<int>(),reply);
+   worker=Worker{-1,-1,-1};
+}
+//----------------------------------------------------------------------------
+void WorkerPool::stop()
+   // Kill all worker processes
+{
+   unique_lock<mutex> guard(lock);
+   stopped=true;
+
+   // Busy workers are killed, too. Their callers see a crash and clean up. The server reaps them, so their pids stay valid until then
+   for (auto& worker:workers)
+      if (worker.pid>0)
+         kill(worker.pid,SIGKILL);
+   for (unsigned index:idle)
+      terminate(workers[index]);
+   idle.clear();
+   available.notify_all();
+}
+//----------------------------------------------------------------------------
+WorkerPool::Result WorkerPool::run(unsigned argument)
+   // Run a job in the next idle worker and wait for its result
+{
+   // Take an idle worker
+   unsigned slot;
+   {
+      unique_lock<mutex> guard(lock);
+      available.wait(guard,[this]() { return stopped||(!idle.empty()); });
+      if (stopped)
+         return Crashed;
+      slot=idle.back();
+      idle.pop_back();
+   }
+   Worker& worker=workers[slot];
+
+   // Let it work. A worker that hangs, e.g., in an endless loop on a broken page, is killed at the deadline
+   uint32_t command=argument,reply[2];
+   auto deadline=chrono::steady_clock::now()+chrono::milliseconds(jobTimeout);
+   bool sent=writeAll(worker.commands,&command,sizeof(command));
+   bool received=sent&&readAll(worker.results,reply,sizeof(reply),&deadline);
+   bool timedOut=sent&&(!received)&&(errno==ETIMEDOUT);
+   bool ok=received&&(reply[0]==command);
+   Result result=ok?(reply[1]?Done:Failed):(timedOut?TimedOut:Crashed);
+
+   // Hand the worker back, replacing it if it died
+   unique_lock<mutex> guard(lock);
+   if (!ok) {
+      terminate(worker);
+      if (stopped||(!spawn(worker))) {
+         available.notify_all();
+         return result;
+      }
+   } else if (stopped) {
+      terminate(worker);
+      return result;
+   }
+   idle.push_back(slot);
+   available.notify_one();
+   return result;
+}
+//----------------------------------------------------------------------------
@@ -0,0 +1,79 @@
+#ifndef H_WorkerPool
+#define H_WorkerPool
+//----------------------------------------------------------------------------
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+//----------------------------------------------------------------------------
+/// A set of forked worker processes. A crashing or hanging job only takes down its worker, which is replaced.
+/// The workers are forked by a server process that is started before any thread, a fork of a threaded process may inherit a lock that is never released
+class WorkerPool
+{
+   public:
+   /// The outcome of a job
+   enum Result { Done, Failed, Crashed, TimedOut };
+   /// The job function, runs in the worker processes
+   typedef std::function<bool(unsigned)> Job;
+   /// Set up the job of a worker process from a description and the file descriptors passed along. Runs in the worker process
+   typedef std::function<Job(const std::string& description,const std::vector<int>& files)> JobFactory;
+
+   private:
+   /// A worker process
+   struct Worker {
+      /// The process id
+      pid_t pid;
+      /// The pipe for jobs
+      int commands;
+      /// The pipe for results
+      int results;
+   };
+
+   /// The description of the job for new workers
+   std::string description;
+   /// The file descriptors passed to new workers
+   std::vector<int> files;
+   /// The workers
+   std::vector<Worker> workers;
+   /// The workers that wait for a job
+   std::vector<unsigned> idle;
+   /// The lock
+   std::mutex lock;
+   /// Signals idle workers
+   std::condition_variable available;
+   /// Are the workers shut down?
+   bool stopped;
+
+   /// Start a worker process
+   bool spawn(Worker& worker);
+   /// Terminate a worker process
+   static void terminate(Worker& worker);
+   /// The request loop of the server process
+   static void runServer(int socket,const JobFactory& factory);
+   /// The job loop of a worker process
+   static void serve(int commands,int results,const Job& job);
+
+   WorkerPool(const WorkerPool&);
+   void operator=(const WorkerPool&);
+
+   public:
+   /// Constructor
+   WorkerPool();
+   /// Destructor
+   ~WorkerPool();
+
+   /// Start the server process that forks the workers. Must be called before any thread is started, the workers see the memory as of this call
+   static bool startServer(const JobFactory& factory);
+
+   /// Start a number of worker processes. Each one sets up its job with the factory given to the server, the file descriptors must stay open until the workers are stopped
+   bool start(unsigned count,const std::string& description,const std::vector<int>& files);
+   /// Kill all worker processes. Running jobs report a crash
+   void stop();
+
+   /// Run a job in the next idle worker and wait for its result. Replaces the worker if it crashes or does not finish in time
+   Result run(unsigned argument);
+};
+//----------------------------------------------------------------------------
+#endif
@@ -0,0 +1,296 @@
+#include <QGuiApplication>
+#include <QImage>
+#include <QPainter>
+#include <poppler/qt5/poppler-qt5.h>
+#include <omp.h>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include "ImageKernels.hpp"
+#include "Renderer.hpp"
+#include "Scribble.hpp"
+//----------------------------------------------------------------------------
+// Headless render benchmark. Prints one JSON object per document and thread count, or per amount of ink for the eraser
+//----------------------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------------------
+static void usage(const char* name)
+   // Show the command line syntax
+{
+   cerr << "usage: " << name << " [options] <pdf>..." << endl
+        << "       " << name << " --eraser [<lines>,..]" << endl
+        << "       " << name << " --selftest" << endl
+        << "options:" << endl
+        << "  --size <w>x<h>   render for a screen of this size (default 1920x1080)" << endl
+        << "  --threads <n,..> thread counts to measure (default 1,2,4,... up to the number of cores)" << endl
+        << "  --compress       keep the rendered pages compressed in memory" << endl
+        << "  --private-docs   let every render thread open its own copy of the document" << endl;
+}
+//----------------------------------------------------------------------------
+static bool parseList(const char* text,vector<unsigned>& result)
+   // Parse a comma separated list of numbers
+{
+   result.clear();
+   for (const char* iter=text;*iter;) {
+      char* end;
+      unsigned long value=strtoul(iter,&end,10);
+      if ((end==iter)||(!value))
+         return false;
+      result.push_back(value);
+      iter=(*end==',')?(end+1):end;
+      if (*end&&(*end!=','))
+         return false;
+   }
+   return !result.empty();
+}
+//----------------------------------------------------------------------------
+static void resetPeakMemory()
+   // Reset the peak resident set size of the process
+{
+   ofstream out("/proc/self/clear_refs");
+   out << "5" << endl;
+}
+//----------------------------------------------------------------------------
+static unsigned long peakMemoryKB()
+   // The peak resident set size since the last reset
+{
+   ifstream in("/proc/self/status");
+   string line;
+   while (getline(in,line))
+      if (line.compare(0,6,"VmHWM:")==0)
+         return strtoul(line.c_str()+6,0,10);
+   return 0;
+}
+//----------------------------------------------------------------------------
+static string jsonString(const QString& text)
+   // Quote a string for JSON
+{
+   QByteArray utf8=text.toUtf8();
+   string result="\"";
+   for (const char* iter=utf8.constData();*iter;++iter) {
+      char c=*iter;
+      if ((c=='"')||(c=='\\')) {
+         result+='\\'; result+=c;
+      } else if (static_cast<unsigned char>(c)<0x20) {
+         result+=' ';
+      } else {
+         result+=c;
+      }
+   }
+   return result+"\"";
+}
+//----------------------------------------------------------------------------
+static bool measure(const QString& fileName,const QSize& size,unsigned threads,bool compress,bool privateDocs)
+   // Render a document once and report the timings
+{
+   shared_ptr<Poppler::Document> doc(Poppler::Document::load(fileName));
+   if (!doc) {
+      cerr << "unable to open " << fileName.toLocal8Bit().constData() << endl;
+      return false;
+   }
+   unsigned pageCount=doc->numPages();
+
+   // The same thumbnail layout as the presenter. Larger decks scroll instead of shrinking the thumbnails
+   unsigned thumbX=1;
+   while (((thumbX*thumbX)<pageCount)&&(thumbX<max<unsigned>(size.width()/320,1)))
+      thumbX++;
+   QSize thumbSize(size.width()/thumbX-10,size.height()/thumbX-10);
+   vector<ScreenInfo::Resolution> resolutions{ScreenInfo::Resolution{size,1.0}};
+
+   // Render everything, always from scratch
+   resetPeakMemory();
+   Renderer renderer;
+   renderer.setPersistentCache(false);
+   renderer.setCompression(compress);
+   renderer.setThreads(threads);
+   renderer.setPrivateDocuments(privateDocs);
+   RenderStats& stats=renderer.getStats();
+   stats.reset();
+   if (!renderer.prepare(doc,fileName,resolutions))
+      return false;
+   renderer.start();
+
+   // Open the overview right away: render the thumbnails of the first screen and dim them once, as the overview does
+   vector<unsigned> visible;
+   for (unsigned index=0;(index<thumbX*thumbX)&&(index<pageCount);index++)
+      visible.push_back(index);
+   auto overviewStart=chrono::steady_clock::now();
+   renderer.requestThumbnails(visible,thumbSize);
+   for (unsigned index:visible) {
+      // A page that cannot be rendered never gets a thumbnail
+      QImage thumb;
+      for (unsigned wait=0;((thumb=renderer.getThumbnail(index,thumbSize)).isNull())&&(wait<10000);wait++)
+         this_thread::sleep_for(chrono::milliseconds(1));
+      vector<uint32_t> dimmed(thumb.width());
+      RenderStats::Timer timer(stats,RenderStats::Dim);
+      for (int row=0;row<thumb.height();row++)
+         ImageKernels::dim(reinterpret_cast<const uint32_t*>(thumb.constScanLine(row)),dimmed.data(),thumb.width());
+   }
+   double overviewMs=chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-overviewStart).count()/1e6;
+
+   while (stats.pageCount()+stats.failureCount()<pageCount)
+      this_thread::sleep_for(chrono::milliseconds(1));
+   renderer.stop();
+
+   // Report
+   double allPages=stats.timeToLastPage()/1e6;
+   cout << "{\"file\":" << jsonString(fileName)
+        << ",\"pages\":" << pageCount
+        << ",\"failed_pages\":" << stats.failureCount()
+        << ",\"width\":" << size.width() << ",\"height\":" << size.height()
+        << ",\"threads\":" << threads
+        << ",\"compressed\":" << (compress?"true":"false")
+        << ",\"private_docs\":" << (privateDocs?"true":"false")
+        << ",\"kernels\":\"" << ImageKernels::implementation() << "\""
+        << ",\"first_preview_ms\":" << (stats.timeToFirstPreview()/1e6)
+        << ",\"first_page_ms\":" << (stats.timeToFirstPage()/1e6)
+        << ",\"all_pages_ms\":" << allPages
+        << ",\"pages_per_s\":" << (allPages>0?(pageCount*1000.0/allPages):0.0)
+        << ",\"overview_ms\":" << overviewMs
+        << ",\"shared_images\":" << stats.sharedCount()
+        << ",\"shared_mb\":" << (stats.sharedBytes()/1048576.0)
+        << ",\"peak_rss_kb\":" << peakMemoryKB()
+        << ",\"stages\":{";
+   for (unsigned stage=0;stage<RenderStats::stageCount;stage++) {
+      RenderStats::Stage s=static_cast<RenderStats::Stage>(stage);
+      cout << (stage?",":"") << "\"" << RenderStats::stageName(s) << "\":{\"ms\":" << (stats.stageTime(s)/1e6) << ",\"calls\":" << stats.stageCalls(s) << "}";
+   }
+   cout << "}}" << endl;
+   return true;
+}
+//----------------------------------------------------------------------------
+static void drawStrokes(Scribble& scribble,mt19937& random,const QRect& area,unsigned lineCount)
+   // Draw random pen strokes of 20 lines each
+{
+   uniform_int_distribution<int> posX(area.left(),area.right()),posY(area.top(),area.bottom()),step(-8,8);
+   for (unsigned index=0;index<lineCount;) {
+      int x=posX(random),y=posY(random);
+      for (unsigned segment=0;(segment<20)&&(index<lineCount);segment++,index++) {
+         int nx=x+step(random),ny=y+step(random);
+         scribble.drawLine(x,y,nx,ny,3,Qt::black);
+         x=nx; y=ny;
+      }
+   }
+}
+//----------------------------------------------------------------------------
+static void measureEraser(unsigned lineCount)
+   // Erase on a page with a certain amount of ink and report the time per eraser move
+{
+   // The eraser works in the top left corner of a full HD page, which always holds the same ink. The rest of the ink lies on the remaining page
+   const unsigned nearby=2000;
+   QRect corner(QPoint(0,0),QPoint(399,399)),rest(QPoint(500,0),QPoint(1919,1079));
+   Scribble scribble;
+   mt19937 random(42),other(7);
+   drawStrokes(scribble,random,corner,min(nearby,lineCount));
+   drawStrokes(scribble,other,rest,lineCount-min(nearby,lineCount));
+
+   // Short eraser moves with the width the presenter uses for the eraser
+   const unsigned moves=2000;
+   uniform_int_distribution<int> pos(0,399),step(-8,8);
+   unsigned points=scribble.pointCount();
+   size_t bytes=scribble.memoryUsage();
+
+   // Paint all ink once, as a full repaint of the overlay does
+   QImage ink(1920,1080,QImage::Format_ARGB32_Premultiplied);
+   ink.fill(Qt::transparent);
+   auto paintStart=chrono::steady_clock::now();
+   {
+      QPainter painter(&ink);
+      painter.setRenderHint(QPainter::Antialiasing);
+      scribble.paint(painter,QRect(0,0,1920,1080));
+   }
+   double paintMs=chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-paintStart).count()/1e6;
+
+   auto start=chrono::steady_clock::now();
+   for (unsigned index=0;index<moves;index++) {
+      int x=pos(random),y=pos(random);
+      scribble.eraseLine(x,y,x+step(random),y+step(random),12);
+   }
+   double ms=chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count()/1e6;
+
+   cout << "{\"eraser\":true"
+        << ",\"lines\":" << lineCount
+        << ",\"moves\":" << moves
+        << ",\"points\":" << points
+        << ",\"bytes\":" << bytes
+        << ",\"paint_ms\":" << paintMs
+        << ",\"total_ms\":" << ms
+        << ",\"us_per_move\":" << (ms*1000.0/moves)
+        << "}" << endl;
+}
+//----------------------------------------------------------------------------
+int main(int argc,char* argv[])
+{
+   // No screen needed
+   qputenv("QT_QPA_PLATFORM","offscreen");
+   QGuiApplication app(argc,argv);
+
+   // Check command line arguments
+   QSize size(1920,1080);
+   vector<unsigned> threads,eraser;
+   bool compress=false,privateDocs=false;
+   vector<QString> files;
+   for (int index=1;index<argc;index++) {
+      string arg=argv[index];
+      if ((arg=="--size")&&(index+1<argc)) {
+         int w,h;
+         if ((sscanf(argv[++index],"%dx%d",&w,&h)!=2)||(w<=0)||(h<=0)) {
+            usage(argv[0]);
+            return 1;
+         }
+         size=QSize(w,h);
+      } else if ((arg=="--threads")&&(index+1<argc)) {
+         if (!parseList(argv[++index],threads)) {
+            usage(argv[0]);
+            return 1;
+         }
+      } else if (arg=="--compress") {
+         compress=true;
+      } else if (arg=="--private-docs") {
+         privateDocs=true;
+      } else if (arg=="--eraser") {
+         eraser={1000,10000,100000,1000000};
+         if ((index+1<argc)&&isdigit(argv[index+1][0])&&(!parseList(argv[++index],eraser))) {
+            usage(argv[0]);
+            return 1;
+         }
+      } else if (arg=="--selftest") {
+         return ImageKernels::selfTest()?0:1;
+      } else if (arg.compare(0,2,"--")==0) {
+         usage(argv[0]);
+         return 1;
+      } else {
+         files.push_back(QString::fromLocal8Bit(argv[index]));
+      }
+   }
+   if (!eraser.empty()) {
+      for (unsigned lines:eraser)
+         measureEraser(lines);
+      return 0;
+   }
+   if (files.empty()) {
+      usage(argv[0]);
+      return 1;
+   }
+   if (threads.empty()) {
+      unsigned cores=omp_get_max_threads();
+      for (unsigned count=1;count<cores;count*=2)
+         threads.push_back(count);
+      threads.push_back(cores);
+   }
+
+   // Measure every combination
+   bool ok=true;
+   for (auto& file:files)
+      for (unsigned count:threads)
+         ok&=measure(file,size,count,compress,privateDocs);
+   return ok?0:1;
+}
+//----------------------------------------------------------------------------
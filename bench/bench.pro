@@ -0,0 +1,49 @@
+TEMPLATE = app
+TARGET = presentpdf-bench
+DEPENDPATH += . ..
+INCLUDEPATH += . ..
+LIBS+= -fopenmp
+QMAKE_CXXFLAGS += -std=c++14
+QMAKE_CXXFLAGS += -fopenmp
+QT += gui
+
+# Input
+HEADERS +=				\
+	../ScreenInfo.hpp		\
+	../RenderQueue.hpp		\
+	../RenderStats.hpp		\
+	../PageCache.hpp		\
+	../PageCodec.hpp		\
+	../ImageKernels.hpp		\
+	../FrameCache.hpp		\
+	../TileCache.hpp		\
+	../WorkerPool.hpp		\
+	../Trace.hpp		\
+	../Scribble.hpp		\
+	../Renderer.hpp
+SOURCES +=				\
+	Bench.cpp			\
+	../ScreenInfo.cpp		\
+	../RenderQueue.cpp		\
+	../PageCache.cpp		\
+	../PageCodec.cpp		\
+	../ImageKernels.cpp		\
+	../FrameCache.cpp		\
+	../TileCache.cpp		\
+	../WorkerPool.cpp		\
+	../Trace.cpp		\
+	../Scribble.cpp		\
+	../Renderer.cpp
+LIBS += -lpoppler-qt5
+
+# make check compares the vectorized pixel kernels with the scalar ones
+check.commands = bin/presentpdf-bench --selftest
+check.depends = first
+QMAKE_EXTRA_TARGETS += check
+
+# Output directories
+MOC_DIR=bin
+UI_DIR=bin
+RCC_DIR=bin
+OBJECTS_DIR=bin
+DESTDIR=bin
@@ -2,8 +2,12 @@
 #include <poppler/qt5/poppler-qt5.h>
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include "Presenter.hpp"
 #include "Renderer.hpp"
+#include "Trace.hpp"
 //----------------------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------------------
@@ -64,43 +68,127 @@ static bool readProfile(const char* file,vector<unsigned>& profile)
    return true;
 }
 //----------------------------------------------------------------------------
+static void usage(const char* name)
+   // Show the command line syntax
+{
+   cerr << "usage: " << name << " [options] [pdf] <profile>" << endl
+        << "options:" << endl
+        << "  --compress       keep the rendered pages compressed in memory" << endl
+        << "  --cache-mb <n>   limit the cache for full size pages to n MB" << endl
+        << "  --threads <n>    render with n threads" << endl
+        << "  --private-docs   let every render thread open its own copy of the document" << endl
+        << "  --processes <n>  render in n worker processes, a broken page only crashes its worker" << endl
+        << "  --scaling        measure how rendering scales with the number of threads and exit" << endl
+        << "  --trace <file>   record render, paint and input spans and write them as Chrome trace JSON on exit" << endl
+        << "  --no-annotations do not store the scribbles in <pdf>.annotations" << endl
+        << "  --console        show the presenter console on the first screen if there are several" << endl;
+}
+//----------------------------------------------------------------------------
 int main(int argc, char *argv[])
 {
+   // Render worker processes are forked by a server that starts before Qt or the renderer start any thread
+   for (int index=1;index<argc;index++)
+      if (!strcmp(argv[index],"--processes")) {
+         WorkerPool::startServer(Renderer::workerJob);
+         break;
+      }
+
    // Check command line arguments
    QApplication app(argc, argv);
-   if ((argc!=2)&&(argc!=3))  {
-      cerr << "usage: " << argv[0] << " [pdf] <profile>" << endl;
+   bool compress=false,privateDocs=false,scaling=false,annotations=true,console=false;
+   unsigned long cacheMB=0,threads=0,processes=0;
+   const char* traceFile=nullptr;
+   vector<const char*> args;
+   for (int index=1;index<argc;index++) {
+      string arg=argv[index];
+      if (arg=="--compress") {
+         compress=true;
+      } else if ((arg=="--cache-mb")&&(index+1<argc)) {
+         cacheMB=strtoul(argv[++index],0,10);
+         if (!cacheMB) {
+            usage(argv[0]);
+            return 1;
+         }
+      } else if ((arg=="--threads")&&(index+1<argc)) {
+         threads=strtoul(argv[++index],0,10);
+         if (!threads) {
+            usage(argv[0]);
+            return 1;
+         }
+      } else if ((arg=="--processes")&&(index+1<argc)) {
+         processes=strtoul(argv[++index],0,10);
+         if (!processes) {
+            usage(argv[0]);
+            return 1;
+         }
+      } else if (arg=="--private-docs") {
+         privateDocs=true;
+      } else if ((arg=="--trace")&&(index+1<argc)) {
+         traceFile=argv[++index];
+      } else if (arg=="--scaling") {
+         scaling=true;
+      } else if (arg=="--no-annotations") {
+         annotations=false;
+      } else if (arg=="--console") {
+         console=true;
+      } else if (arg.compare(0,2,"--")==0) {
+         usage(argv[0]);
+         return 1;
+      } else {
+         args.push_back(argv[index]);
+      }
+   }
+   if ((args.size()!=1)&&(args.size()!=2))  {
+      usage(argv[0]);
       return 1;
    }
 
    // Read the profile
    vector<unsigned> timings;
-   if ((argc==3)&&(!readProfile(argv[2],timings)))
+   if ((args.size()==2)&&(!readProfile(args[1],timings)))
       return 1;
 
    // Open the PDF
-   Poppler::Document* doc=Poppler::Document::load(argv[1]);
+   shared_ptr<Poppler::Document> doc(Poppler::Document::load(args[0]));
    if (!doc) {
-      cerr << "unable to open " << argv[1] << endl;
+      cerr << "unable to open " << args[0] << endl;
       return 1;
    }
 
+   // Record spans from the start if requested
+   if (traceFile) {
+      Trace::start(QString::fromLocal8Bit(traceFile));
+      Trace::nameThread("gui");
+   }
+
    // Prepare rendererer and presenter
    Renderer renderer;
+   renderer.setCompression(compress);
+   renderer.setCacheBudget(static_cast<uint64_t>(cacheMB)*1024*1024);
+   renderer.setThreads(threads);
+   renderer.setPrivateDocuments(privateDocs);
+   renderer.setWorkerProcesses(processes);
    Presenter presenter(renderer,doc->numPages());
-   if (!renderer.prepare(*doc,presenter.presentationSize(),presenter.thumbnailSize()))
+   if (scaling)
+      return renderer.measureScaling(doc,QString::fromLocal8Bit(args[0]),presenter.renderResolutions().front().size,threads)?0:1;
+   if (!renderer.prepare(doc,QString::fromLocal8Bit(args[0]),presenter.renderResolutions()))
       return 1;
    renderer.start();
 
-   // Show the presentation
-   if (argc==3)
+   // Show the presentation. Annotations are optional, the talk goes on without them
+   if (args.size()==2)
       presenter.setProfile(timings);
+   if (annotations)
+      presenter.setJournal(Journal::defaultFileName(QString::fromLocal8Bit(args[0])));
    presenter.createViews();
+   presenter.watchFile(QString::fromLocal8Bit(args[0]));
+   if (console)
+      presenter.toggleConsole();
    int result=app.exec();
 
    // Cleanup
    renderer.stop();
-   delete doc;
+   Trace::finish();
    return result;
 }
 //----------------------------------------------------------------------------
@@ -10,12 +10,31 @@ QT += widgets
 # Input
 HEADERS +=				\
 	ScreenInfo.hpp			\
+	RenderQueue.hpp			\
+	RenderStats.hpp			\
+	PageCache.hpp			\
+	PageCodec.hpp			\
+	ImageKernels.hpp		\
+	FrameCache.hpp			\
+	TileCache.hpp			\
+	WorkerPool.hpp			\
+	Trace.hpp			\
+	Journal.hpp			\
 	Renderer.hpp			\
 	Presenter.hpp			\
 	View.hpp
 SOURCES +=				\
 	main.cpp			\
 	ScreenInfo.cpp			\
+	RenderQueue.cpp			\
+	PageCache.cpp			\
+	PageCodec.cpp			\
+	ImageKernels.cpp		\
+	FrameCache.cpp			\
+	TileCache.cpp			\
+	WorkerPool.cpp			\
+	Trace.cpp			\
+	Journal.cpp			\
 	Renderer.cpp			\
 	Presenter.cpp			\
 	View.cpp			\